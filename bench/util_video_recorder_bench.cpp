@@ -0,0 +1,529 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Encodes synthetic frames with every codec/format pair supported by the FFmpeg build, reads the
+// results back with VideoPlayer and prints the measurements as JSON. Run with --help for the options.
+
+#include "util_video_recorder.hpp"
+#include "util_video_player.hpp"
+#include "stdio_file.hpp"
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <array>
+#include <memory>
+#include <optional>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <filesystem>
+#ifdef _WIN32
+	#include <Windows.h>
+	#include <Psapi.h>
+#else
+	#include <sys/resource.h>
+#endif
+
+using namespace media;
+
+namespace
+{
+	struct Resolution
+	{
+		std::string name;
+		uint32_t width = 0;
+		uint32_t height = 0;
+	};
+	const std::array<Resolution,3> RESOLUTIONS = {{
+		{"720p",1'280,720},
+		{"1080p",1'920,1'080},
+		{"4k",3'840,2'160}
+	}};
+
+	enum class Pattern : uint8_t
+	{
+		// Smooth gradients which move every frame; Easy to predict
+		Gradient = 0,
+		// Random pixels; Worst case for every codec
+		Noise,
+		// The same frame over and over again; Best case
+		Static,
+
+		Count
+	};
+	const std::array<std::string,static_cast<size_t>(Pattern::Count)> PATTERN_NAMES = {"gradient","noise","static"};
+	// Number of distinct frames per pattern; The frames are submitted in a loop
+	constexpr uint32_t FRAME_VARIANT_COUNT = 4;
+
+	struct BenchSettings
+	{
+		uint32_t frameCount = 120;
+		FrameRate frameRate = 60;
+		// See EncodingSettings::gopParallelWorkerCount; Only applied to codecs which support it
+		uint32_t gopWorkerCount = 1;
+		std::vector<Resolution> resolutions {RESOLUTIONS.begin(),RESOLUTIONS.end()};
+		std::vector<Pattern> patterns {Pattern::Gradient,Pattern::Noise,Pattern::Static};
+		std::optional<std::string> codecName {};
+		std::optional<std::string> formatName {};
+		std::filesystem::path workDirectory = std::filesystem::temp_directory_path() /"util_video_recorder_bench";
+		std::string outputFileName;
+		std::string traceFileName;
+		bool keepFiles = false;
+	};
+
+	struct LatencyStatistics
+	{
+		// In microseconds
+		double mean = 0.0;
+		double p50 = 0.0;
+		double p90 = 0.0;
+		double p99 = 0.0;
+		double max = 0.0;
+	};
+
+	struct EncodeResult
+	{
+		double wallTime = 0.0;
+		double framesPerSecond = 0.0;
+		// Time WriteFrame blocked the caller
+		LatencyStatistics submitLatency {};
+		// Time spent in the conversion and codec stages, see VideoRecorder::StageTimings
+		double conversionTime = 0.0;
+		double encodeTime = 0.0;
+		uint64_t outputSize = 0;
+		uint64_t peakRss = 0;
+	};
+
+	struct DecodeResult
+	{
+		double wallTime = 0.0;
+		double framesPerSecond = 0.0;
+		LatencyStatistics frameLatency {};
+		uint64_t frameCount = 0;
+		uint32_t codecThreadCount = 0;
+		uint64_t peakRss = 0;
+	};
+
+	struct CaseResult
+	{
+		Codec codec = Codec::Count;
+		Format format = Format::Count;
+		Resolution resolution {};
+		Pattern pattern = Pattern::Gradient;
+		std::optional<EncodeResult> encode {};
+		std::optional<DecodeResult> decode {};
+		std::string error;
+	};
+};
+
+// Resets the peak so it only covers the following case; Only possible on Linux
+static void reset_peak_rss()
+{
+#ifdef __linux__
+	std::ofstream f {"/proc/self/clear_refs"};
+	if(f.is_open())
+		f <<"5";
+#endif
+}
+// In bytes
+static uint64_t get_peak_rss()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters {};
+	if(GetProcessMemoryInfo(GetCurrentProcess(),&counters,sizeof(counters)) == FALSE)
+		return 0;
+	return counters.PeakWorkingSetSize;
+#elif defined(__linux__)
+	std::ifstream f {"/proc/self/status"};
+	std::string line;
+	while(std::getline(f,line))
+	{
+		if(line.rfind("VmHWM:",0) == 0)
+			return std::stoull(line.substr(6)) *1'024;
+	}
+	return 0;
+#else
+	rusage usage {};
+	getrusage(RUSAGE_SELF,&usage);
+	return usage.ru_maxrss; // Bytes on macOS
+#endif
+}
+
+static LatencyStatistics calc_latency_statistics(std::vector<double> samples)
+{
+	LatencyStatistics stats {};
+	if(samples.empty())
+		return stats;
+	std::sort(samples.begin(),samples.end());
+	auto percentile = [&samples](double p) {
+		auto idx = static_cast<size_t>(std::ceil(p *samples.size())) -1;
+		return samples.at(std::min(idx,samples.size() -1));
+	};
+	stats.mean = std::accumulate(samples.begin(),samples.end(),0.0) /samples.size();
+	stats.p50 = percentile(0.5);
+	stats.p90 = percentile(0.9);
+	stats.p99 = percentile(0.99);
+	stats.max = samples.back();
+	return stats;
+}
+
+static std::vector<FrameBuffer> generate_frames(Pattern pattern,uint32_t width,uint32_t height)
+{
+	auto numVariants = (pattern == Pattern::Static) ? 1u : FRAME_VARIANT_COUNT;
+	std::vector<FrameBuffer> frames;
+	frames.reserve(numVariants);
+	// Fixed seed, so every run encodes the same content
+	uint32_t rngState = 0x9E3779B9;
+	for(auto i=decltype(numVariants){0u};i<numVariants;++i)
+	{
+		auto data = std::make_shared<std::vector<uint8_t>>(static_cast<size_t>(width) *height *4);
+		auto *px = data->data();
+		for(auto y=decltype(height){0u};y<height;++y)
+		{
+			for(auto x=decltype(width){0u};x<width;++x)
+			{
+				switch(pattern)
+				{
+					case Pattern::Noise:
+						rngState ^= rngState <<13;
+						rngState ^= rngState >>17;
+						rngState ^= rngState <<5;
+						px[0] = rngState &0xFF;
+						px[1] = (rngState >>8) &0xFF;
+						px[2] = (rngState >>16) &0xFF;
+						break;
+					default:
+					{
+						auto offset = i *(width /(FRAME_VARIANT_COUNT *8));
+						px[0] = static_cast<uint8_t>(((x +offset) *255) /width);
+						px[1] = static_cast<uint8_t>((y *255) /height);
+						px[2] = static_cast<uint8_t>(((x +y +offset) *255) /(width +height));
+						break;
+					}
+				}
+				px[3] = 255;
+				px += 4;
+			}
+		}
+		FrameBuffer frameBuffer {};
+		frameBuffer.format = PixelFormat::RGBA8;
+		frameBuffer.width = width;
+		frameBuffer.height = height;
+		frameBuffer.data[0] = data->data();
+		frameBuffer.lineSize[0] = width *4;
+		frameBuffer.owner = data;
+		frames.push_back(std::move(frameBuffer));
+	}
+	return frames;
+}
+
+static EncodeResult run_encode(
+	const BenchSettings &settings,const std::vector<FrameBuffer> &frames,Codec codec,Format format,const Resolution &resolution,const std::string &fileName
+)
+{
+	reset_peak_rss();
+	auto recorder = VideoRecorder::Create(std::make_unique<StdioFile>());
+	VideoRecorder::EncodingSettings encodingSettings {};
+	encodingSettings.width = resolution.width;
+	encodingSettings.height = resolution.height;
+	encodingSettings.codec = codec;
+	encodingSettings.format = format;
+	encodingSettings.frameRate = settings.frameRate;
+	if(supports_gop_parallel_encoding(codec))
+		encodingSettings.gopParallelWorkerCount = settings.gopWorkerCount;
+
+	std::vector<double> latencies;
+	latencies.reserve(settings.frameCount);
+	auto tStart = std::chrono::steady_clock::now();
+	recorder->StartRecording(fileName,encodingSettings);
+	for(auto i=decltype(settings.frameCount){0u};i<settings.frameCount;++i)
+	{
+		auto t = std::chrono::steady_clock::now();
+		recorder->StartFrame();
+		recorder->WriteFrame(frames.at(i %frames.size()),i /static_cast<double>(settings.frameRate));
+		latencies.push_back(std::chrono::duration<double,std::micro>{std::chrono::steady_clock::now() -t}.count());
+	}
+	// Timings have to be queried before the recording ends, as the encoder is released afterwards
+	auto timings = recorder->GetStageTimings();
+	recorder->EndRecording();
+	auto wallTime = std::chrono::duration<double>{std::chrono::steady_clock::now() -tStart}.count();
+
+	EncodeResult result {};
+	result.wallTime = wallTime;
+	result.framesPerSecond = (wallTime > 0.0) ? (settings.frameCount /wallTime) : 0.0;
+	result.submitLatency = calc_latency_statistics(std::move(latencies));
+	result.conversionTime = std::chrono::duration<double>{timings.conversionDuration}.count();
+	result.encodeTime = std::chrono::duration<double>{timings.encodeDuration}.count();
+	std::error_code errCode;
+	result.outputSize = std::filesystem::file_size(fileName,errCode);
+	result.peakRss = get_peak_rss();
+	return result;
+}
+
+static DecodeResult run_decode(const std::string &fileName)
+{
+	reset_peak_rss();
+	auto tStart = std::chrono::steady_clock::now();
+	auto player = VideoPlayer::Create(fileName);
+	if(player == nullptr)
+		throw RuntimeError{"Unable to open '" +fileName +"' for playback"};
+	std::vector<double> latencies;
+	for(;;)
+	{
+		FrameBuffer frame {};
+		double pts = 0.0;
+		auto t = std::chrono::steady_clock::now();
+		if(player->ReadFrame(frame,pts) == false)
+			break;
+		latencies.push_back(std::chrono::duration<double,std::micro>{std::chrono::steady_clock::now() -t}.count());
+	}
+	auto wallTime = std::chrono::duration<double>{std::chrono::steady_clock::now() -tStart}.count();
+
+	DecodeResult result {};
+	result.wallTime = wallTime;
+	result.frameCount = latencies.size();
+	result.framesPerSecond = (wallTime > 0.0) ? (latencies.size() /wallTime) : 0.0;
+	result.frameLatency = calc_latency_statistics(std::move(latencies));
+	result.codecThreadCount = player->GetCodecThreadCount();
+	result.peakRss = get_peak_rss();
+	return result;
+}
+
+static std::string escape_json(const std::string &str)
+{
+	std::string result;
+	result.reserve(str.size());
+	for(auto c : str)
+	{
+		switch(c)
+		{
+			case '"':
+				result += "\\\"";
+				break;
+			case '\\':
+				result += "\\\\";
+				break;
+			case '\n':
+				result += "\\n";
+				break;
+			default:
+				if(static_cast<unsigned char>(c) < 0x20)
+					result += ' ';
+				else
+					result += c;
+				break;
+		}
+	}
+	return result;
+}
+static void write_latency_json(std::ostream &out,const LatencyStatistics &stats)
+{
+	out <<"{\"mean\":" <<stats.mean <<",\"p50\":" <<stats.p50 <<",\"p90\":" <<stats.p90 <<",\"p99\":" <<stats.p99 <<",\"max\":" <<stats.max <<"}";
+}
+static void write_json(std::ostream &out,const BenchSettings &settings,const std::vector<CaseResult> &results)
+{
+	out <<"{\n";
+	out <<"\t\"frameCount\": " <<settings.frameCount <<",\n";
+	out <<"\t\"frameRate\": " <<settings.frameRate <<",\n";
+	out <<"\t\"gopWorkerCount\": " <<settings.gopWorkerCount <<",\n";
+	out <<"\t\"latencyUnit\": \"us\",\n";
+	out <<"\t\"results\": [";
+	for(auto i=decltype(results.size()){0u};i<results.size();++i)
+	{
+		auto &result = results.at(i);
+		out <<((i > 0) ? ",\n" : "\n");
+		out <<"\t\t{\"codec\":\"" <<codec_to_name(result.codec) <<"\",\"format\":\"" <<format_to_name(result.format) <<"\"";
+		out <<",\"resolution\":\"" <<result.resolution.name <<"\",\"width\":" <<result.resolution.width <<",\"height\":" <<result.resolution.height;
+		out <<",\"pattern\":\"" <<PATTERN_NAMES.at(static_cast<size_t>(result.pattern)) <<"\"";
+		if(result.encode.has_value())
+		{
+			auto &encode = *result.encode;
+			out <<",\"encode\":{\"wallTime\":" <<encode.wallTime <<",\"fps\":" <<encode.framesPerSecond;
+			out <<",\"conversionTime\":" <<encode.conversionTime <<",\"encodeTime\":" <<encode.encodeTime;
+			out <<",\"outputSize\":" <<encode.outputSize <<",\"peakRss\":" <<encode.peakRss <<",\"submitLatency\":";
+			write_latency_json(out,encode.submitLatency);
+			out <<"}";
+		}
+		if(result.decode.has_value())
+		{
+			auto &decode = *result.decode;
+			out <<",\"decode\":{\"wallTime\":" <<decode.wallTime <<",\"fps\":" <<decode.framesPerSecond <<",\"frameCount\":" <<decode.frameCount;
+			out <<",\"codecThreadCount\":" <<decode.codecThreadCount <<",\"peakRss\":" <<decode.peakRss <<",\"frameLatency\":";
+			write_latency_json(out,decode.frameLatency);
+			out <<"}";
+		}
+		if(result.error.empty() == false)
+			out <<",\"error\":\"" <<escape_json(result.error) <<"\"";
+		out <<"}";
+	}
+	out <<"\n\t]\n}\n";
+}
+
+static std::vector<std::string> split(const std::string &str)
+{
+	std::vector<std::string> result;
+	std::stringstream ss {str};
+	std::string item;
+	while(std::getline(ss,item,','))
+	{
+		if(item.empty() == false)
+			result.push_back(item);
+	}
+	return result;
+}
+static void print_usage()
+{
+	std::cerr
+		<<"Usage: util_video_recorder_bench [options]\n"
+		<<"  --frames <n>             Number of frames per case (default 120)\n"
+		<<"  --frame-rate <n>         Frame rate of the recordings (default 60)\n"
+		<<"  --gop-workers <n>        Number of GOP-parallel workers for codecs which support it (default 1)\n"
+		<<"  --resolutions <list>     Comma-separated subset of 720p,1080p,4k\n"
+		<<"  --patterns <list>        Comma-separated subset of gradient,noise,static\n"
+		<<"  --codec <name>           Only run the codec with this FFmpeg name (e.g. mpeg4)\n"
+		<<"  --format <name>          Only run the format with this FFmpeg name (e.g. mp4)\n"
+		<<"  --work-dir <path>        Directory for the recorded files\n"
+		<<"  --keep-files             Don't delete the recorded files\n"
+		<<"  --output <file>          Write the JSON to a file instead of stdout\n"
+		<<"  --trace <file>           Record a trace of all cases and write it to a file (Chrome trace format)\n";
+}
+static std::optional<BenchSettings> parse_arguments(int argc,char *argv[])
+{
+	BenchSettings settings {};
+	for(auto i=1;i<argc;++i)
+	{
+		std::string arg = argv[i];
+		auto hasValue = (i +1 < argc);
+		if(arg == "--keep-files")
+			settings.keepFiles = true;
+		else if(arg == "--help" || hasValue == false)
+			return {};
+		else
+		{
+			std::string value = argv[++i];
+			if(arg == "--frames")
+				settings.frameCount = std::max(static_cast<uint32_t>(std::stoul(value)),1u);
+			else if(arg == "--frame-rate")
+				settings.frameRate = std::max(static_cast<uint32_t>(std::stoul(value)),1u);
+			else if(arg == "--gop-workers")
+				settings.gopWorkerCount = std::max(static_cast<uint32_t>(std::stoul(value)),1u);
+			else if(arg == "--resolutions")
+			{
+				settings.resolutions.clear();
+				for(auto &name : split(value))
+				{
+					auto it = std::find_if(RESOLUTIONS.begin(),RESOLUTIONS.end(),[&name](const Resolution &res) {return res.name == name;});
+					if(it == RESOLUTIONS.end())
+						return {};
+					settings.resolutions.push_back(*it);
+				}
+			}
+			else if(arg == "--patterns")
+			{
+				settings.patterns.clear();
+				for(auto &name : split(value))
+				{
+					auto it = std::find(PATTERN_NAMES.begin(),PATTERN_NAMES.end(),name);
+					if(it == PATTERN_NAMES.end())
+						return {};
+					settings.patterns.push_back(static_cast<Pattern>(it -PATTERN_NAMES.begin()));
+				}
+			}
+			else if(arg == "--codec")
+				settings.codecName = value;
+			else if(arg == "--format")
+				settings.formatName = value;
+			else if(arg == "--work-dir")
+				settings.workDirectory = value;
+			else if(arg == "--output")
+				settings.outputFileName = value;
+			else if(arg == "--trace")
+				settings.traceFileName = value;
+			else
+				return {};
+		}
+	}
+	return settings;
+}
+
+int main(int argc,char *argv[])
+{
+	auto settings = parse_arguments(argc,argv);
+	if(settings.has_value() == false)
+	{
+		print_usage();
+		return EXIT_FAILURE;
+	}
+	std::error_code errCode;
+	std::filesystem::create_directories(settings->workDirectory,errCode);
+
+	if(settings->traceFileName.empty() == false)
+		set_tracing_enabled(true);
+	std::vector<CaseResult> results;
+	for(auto &resolution : settings->resolutions)
+	{
+		for(auto pattern : settings->patterns)
+		{
+			// Generated once per resolution and pattern, so the generation doesn't count towards the encode time
+			auto frames = generate_frames(pattern,resolution.width,resolution.height);
+			for(auto format : get_all_formats())
+			{
+				if(settings->formatName.has_value() && format_to_name(format) != *settings->formatName)
+					continue;
+				for(auto codec : get_supported_codecs(format))
+				{
+					if(settings->codecName.has_value() && codec_to_name(codec) != *settings->codecName)
+						continue;
+					CaseResult result {};
+					result.codec = codec;
+					result.format = format;
+					result.resolution = resolution;
+					result.pattern = pattern;
+					auto fileName = (settings->workDirectory /(codec_to_name(codec) +"_" +format_to_name(format) +"_" +resolution.name +"_" +PATTERN_NAMES.at(static_cast<size_t>(pattern)) +".bin")).string();
+					std::cerr <<"Running " <<codec_to_name(codec) <<"/" <<format_to_name(format) <<" " <<resolution.name <<" " <<PATTERN_NAMES.at(static_cast<size_t>(pattern)) <<"..." <<std::endl;
+					try
+					{
+						result.encode = run_encode(*settings,frames,codec,format,resolution,fileName);
+						result.decode = run_decode(fileName);
+					}
+					catch(const std::exception &e)
+					{
+						result.error = e.what();
+					}
+					if(settings->keepFiles == false)
+						std::filesystem::remove(fileName,errCode);
+					results.push_back(std::move(result));
+				}
+			}
+		}
+	}
+
+	if(settings->traceFileName.empty() == false)
+	{
+		std::ofstream f {settings->traceFileName};
+		if(f.is_open())
+			f <<export_trace();
+		else
+			std::cerr <<"Unable to open '" <<settings->traceFileName <<"' for writing" <<std::endl;
+	}
+	if(settings->outputFileName.empty())
+		write_json(std::cout,*settings,results);
+	else
+	{
+		std::ofstream f {settings->outputFileName};
+		if(f.is_open() == false)
+		{
+			std::cerr <<"Unable to open '" <<settings->outputFileName <<"' for writing" <<std::endl;
+			return EXIT_FAILURE;
+		}
+		write_json(f,*settings,results);
+	}
+	return EXIT_SUCCESS;
+}
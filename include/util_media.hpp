@@ -10,6 +10,7 @@
 
 #include <memory>
 #include <string>
+#include <array>
 #include <optional>
 #include <vector>
 #include <stdexcept>
@@ -58,6 +59,22 @@ namespace media
 
 		Count
 	};
+	enum class AudioCodec : uint32_t
+	{
+		AAC = 0,
+		Opus,
+		// Uncompressed 16-bit samples
+		PCM,
+
+		Count
+	};
+	// Samples are always interleaved, i.e. the samples of all channels of a sample frame are stored next to each other
+	enum class AudioSampleFormat : uint8_t
+	{
+		// 32-bit floats in the range [-1,1]
+		Float32 = 0,
+		Int16
+	};
 	enum class Quality : uint32_t
 	{
 		VeryLow = 0,
@@ -66,6 +83,56 @@ namespace media
 		High,
 		VeryHigh
 	};
+	enum class ColorMatrix : uint32_t
+	{
+		BT601 = 0,
+		BT709
+	};
+	enum class CodecThreadType : uint32_t
+	{
+		// Lets the codec pick; Uses frame threading where available, slice threading otherwise
+		Automatic = 0,
+		// Processes several frames in parallel. Best throughput, but adds one frame of latency per thread.
+		Frame,
+		// Splits each frame into slices which are processed in parallel; When decoding, this is only effective if the stream has been encoded with slices
+		Slice
+	};
+	// Shared by the encoder and the decoder; See VideoRecorder::EncodingSettings and VideoPlayer::DecodingSettings for how they determine the thread count
+	struct CodecThreadingSettings
+	{
+		// Number of threads used by the codec. If 0, the count is determined automatically.
+		uint32_t threadCount = 0;
+		CodecThreadType threadType = CodecThreadType::Automatic;
+		// Number of cores left to the application if the thread count is determined automatically
+		uint32_t reservedCoreCount = 2;
+	};
+
+	enum class PixelFormat : uint32_t
+	{
+		RGBA8 = 0,
+		BGRA8,
+		RGB8,
+		// Half-precision floats
+		RGBA16F,
+		RGBA32F,
+		// Three planes (Y, U, V), chroma planes are subsampled by 2 in both directions
+		YUV420P,
+		// Two planes (Y, interleaved UV), UV plane is subsampled by 2 in both directions
+		NV12,
+
+		Count
+	};
+	// Non-owning view of an image with an arbitrary pixel format; Packed formats only use the first plane
+	struct FrameBuffer
+	{
+		PixelFormat format = PixelFormat::RGBA8;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		std::array<const uint8_t*,4> data {};
+		std::array<int32_t,4> lineSize {};
+		// Optional; Will be kept alive until the frame is no longer needed
+		std::shared_ptr<const void> owner = nullptr;
+	};
 
 	struct ICustomFile
 	{
@@ -75,6 +142,9 @@ namespace media
 		virtual std::optional<uint64_t> write(const uint8_t *data, size_t size)=0;
 		virtual std::optional<uint64_t> read(uint8_t *data, size_t size)=0;
 		virtual std::optional<uint64_t> seek(int64_t offset, int whence)=0;
+		// Called once all output has been written, before the file is closed. Implementations which write asynchronously
+		// have to wait for their pending writes here; Returns false if any of them have failed.
+		virtual bool sync() {return true;}
 	};
 
 	using FrameRate = uint32_t;
@@ -88,9 +158,23 @@ namespace media
 	std::vector<Codec> get_all_codecs();
 	std::string format_to_name(Format format);
 	std::string codec_to_name(Codec codec);
+	std::string audio_codec_to_name(AudioCodec codec);
+	std::string pixel_format_to_name(PixelFormat format);
+	bool supports_variable_frame_rate(Format format);
+	bool supports_gop_parallel_encoding(Codec codec);
 	BitRate calc_bitrate(uint32_t width,uint32_t height,FrameRate frameRate,double bitsPerPixel);
 	double get_bits_per_pixel(Quality quality);
 
+	// Tracing of the recorder and player pipelines, e.g. to correlate encoder stalls with frame time spikes of the application.
+	// Each thread records its events into its own buffer without locks; While tracing is disabled, the instrumented calls only
+	// check a flag. Events are timestamped with std::chrono::steady_clock.
+	void set_tracing_enabled(bool enabled);
+	bool is_tracing_enabled();
+	// Discards all events which have been recorded so far
+	void clear_trace();
+	// Returns the recorded events in the Chrome trace event format (JSON), which can be opened in Perfetto or chrome://tracing
+	std::string export_trace();
+
 	using LogicError = std::logic_error;
 	using RuntimeError = std::runtime_error;
 };
@@ -0,0 +1,137 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_POSIX_FILE_HPP__
+#define __UTIL_POSIX_FILE_HPP__
+
+#include "util_media.hpp"
+
+#ifdef __linux__
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace media
+{
+	// File interface which passes all writes to a dedicated I/O thread, so the caller never blocks on
+	// page cache writeback. Writes are collected in aligned buffers and written with pwrite, so seeks
+	// (e.g. the muxer patching a header) don't require any synchronization with the I/O thread.
+	// Since this class already buffers all writes, EncodingSettings::writeBufferSize can be set to 0.
+	class PosixFile
+		: public ICustomFile
+	{
+	public:
+		static constexpr size_t BUFFER_ALIGNMENT = 4'096;
+		enum class SyncMode : uint32_t
+		{
+			// Leaves it to the OS when the data reaches the disk
+			None = 0,
+			// Calls fdatasync when the file is closed
+			OnClose,
+			// Calls fdatasync whenever syncInterval bytes have been written, as well as on close.
+			// Keeps the amount of dirty pages low, so the OS doesn't stall on writeback later on.
+			Interval
+		};
+		struct Settings
+		{
+			// Size of each write buffer; Rounded up to BUFFER_ALIGNMENT
+			size_t bufferSize = 4 *1'024 *1'024;
+			// Number of buffers which can be queued for the I/O thread before write has to wait
+			uint32_t maxPendingBuffers = 4;
+			// Disk space is reserved in steps of this size ahead of the writes, which avoids fragmentation
+			// and block allocation during writeback. 0 disables preallocation.
+			uint64_t preallocationSize = 256 *1'024 *1'024;
+			// Bypasses the page cache with O_DIRECT. Writes which are not aligned to BUFFER_ALIGNMENT
+			// (like the muxer patching a header) still go through the page cache.
+			bool directIo = false;
+			SyncMode syncMode = SyncMode::OnClose;
+			uint64_t syncInterval = 64 *1'024 *1'024;
+		};
+		struct Statistics
+		{
+			uint64_t bytesWritten = 0;
+			// Number of pwrite calls
+			uint64_t writeCallCount = 0;
+			uint64_t syncCount = 0;
+			// Number of times write had to wait for a free buffer
+			uint64_t stallCount = 0;
+		};
+
+		PosixFile();
+		PosixFile(const Settings &settings);
+		virtual ~PosixFile() override;
+		virtual bool open(const std::string &fileName) override;
+		virtual void close() override;
+		virtual std::optional<uint64_t> write(const uint8_t *data, size_t size) override;
+		virtual std::optional<uint64_t> read(uint8_t *data, size_t size) override;
+		virtual std::optional<uint64_t> seek(int64_t offset, int whence) override;
+		// Waits for all queued buffers to be written and, unless the sync mode is None, calls fdatasync
+		virtual bool sync() override;
+		Statistics GetStatistics() const;
+		// Returns the errno of the first write, sync or close which has failed since the file was opened.
+		// Errors which only occur while the file is being closed can't be reported any other way.
+		std::optional<int> GetError() const;
+	private:
+		struct AlignedDeleter
+		{
+			void operator()(uint8_t *p) const;
+		};
+		struct Buffer
+		{
+			std::unique_ptr<uint8_t[],AlignedDeleter> data = nullptr;
+			size_t size = 0;
+			// Offset in the file the data has to be written to
+			uint64_t offset = 0;
+		};
+		bool AcquireStagingBuffer();
+		void SubmitStagingBuffer();
+		// Waits until all queued buffers have been written
+		bool Drain();
+		void RunIoThread();
+		bool WriteBuffer(const Buffer &buffer);
+		bool WriteToFile(int fd,const uint8_t *data,size_t size,uint64_t offset);
+		bool Sync();
+		// Marks the file as failed; Only the first error is kept
+		void SetError(int errorCode);
+
+		Settings m_settings;
+		int m_fd = -1;
+		// Used for writes which don't meet the alignment requirements of O_DIRECT; Same as m_fd otherwise
+		int m_bufferedFd = -1;
+		uint64_t m_position = 0;
+		uint64_t m_fileSize = 0;
+
+		std::vector<Buffer> m_buffers;
+		std::optional<uint32_t> m_stagingBuffer = {};
+		std::deque<uint32_t> m_freeBuffers;
+		std::deque<uint32_t> m_queuedBuffers;
+		bool m_stopIoThread = false;
+		bool m_writeFailed = false;
+		int m_errorCode = 0;
+		// Set by sync, so close doesn't have to sync again if nothing has been written since
+		bool m_isSynced = false;
+		mutable std::mutex m_ioMutex;
+		std::condition_variable m_ioCondition;
+		std::thread m_ioThread;
+
+		// Only accessed by the I/O thread
+		uint64_t m_preallocatedSize = 0;
+		uint64_t m_bytesSinceSync = 0;
+
+		std::atomic<uint64_t> m_bytesWritten = 0;
+		std::atomic<uint64_t> m_writeCallCount = 0;
+		std::atomic<uint64_t> m_syncCount = 0;
+		std::atomic<uint64_t> m_stallCount = 0;
+	};
+};
+#endif
+
+#endif
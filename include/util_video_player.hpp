@@ -17,13 +17,160 @@ namespace media
 	class VideoPlayer
 	{
 	public:
+		enum class IndexMode : uint8_t
+		{
+			None = 0,
+			// The index is kept in memory for as long as the process is running
+			Memory,
+			// The index is additionally written to a sidecar file, so it survives restarts
+			Sidecar
+		};
+		enum class FramePoolPolicy : uint8_t
+		{
+			// Allocates additional frames if all frames of the pool are still referenced
+			Grow = 0,
+			// The decode thread waits until the caller releases a frame. Only applies to asynchronous
+			// decoding; In synchronous mode the pool always grows.
+			Wait
+		};
+		using CodecThreadType = media::CodecThreadType;
+		using CodecThreadingSettings = media::CodecThreadingSettings;
+		enum class ScalingAlgorithm : uint8_t
+		{
+			FastBilinear = 0,
+			Bilinear,
+			Bicubic,
+			// Best quality for strong downscaling, e.g. thumbnails
+			Area,
+			Lanczos
+		};
+		enum class OutputFormat : uint8_t
+		{
+			// Frames are converted to RGBA8
+			RGBA8 = 0,
+			// Frames are passed through without conversion if the decoder's pixel format has a PixelFormat equivalent (e.g.
+			// YUV420P or NV12 planes, which can then be converted in a shader), and converted to RGBA8 otherwise. YUV frames
+			// are only passed through if they are limited range and use one of the matrices of ColorMatrix (see GetColorMatrix).
+			// Frames which are passed through keep the resolution of the video. Only the FrameBuffer overloads of ReadFrame and
+			// TryReadFrame can be used in this mode.
+			Native
+		};
+		using AudioSampleFormat = media::AudioSampleFormat;
+		struct AudioFormat
+		{
+			AudioSampleFormat sampleFormat = AudioSampleFormat::Float32;
+			uint32_t sampleRate = 0;
+			uint32_t channelCount = 0;
+		};
+		struct DecodingSettings
+		{
+			// Size of the buffer FFmpeg's I/O layer reads the file into. If 0, the default of avcpp is used.
+			uint32_t avioBufferSize = 0;
+			// Memory-mapped files only: Amount of data the OS is asked to prefetch ahead of the read position
+			uint32_t readAheadSize = 8 *1'024 *1'024;
+			// Memory-mapped files only: The first time a file is opened, it is scanned once to build an index
+			// of its keyframes. Later opens reuse the index, which makes seeking exact and skips stream probing.
+			IndexMode indexMode = IndexMode::None;
+			// Location of the sidecar file; If empty, the index is stored next to the video as "<fileName>.vidx"
+			std::string indexFileName;
+			// Decodes and converts frames on a background thread, which stays up to decodeAheadFrameCount
+			// frames ahead of the reader.
+			bool asyncDecoding = false;
+			uint32_t decodeAheadFrameCount = 4;
+			// Number of frames in the pool returned frames are taken from. If 0, the pool is large enough
+			// for the decode-ahead frames, plus one frame held by the caller.
+			uint32_t framePoolSize = 0;
+			FramePoolPolicy framePoolPolicy = FramePoolPolicy::Grow;
+			// Applies to the video codec. If the thread count is 0, the number of cores minus reservedCoreCount is used; Decoding
+			// leaves one core fewer to the application by default than encoding, since the caller usually only consumes the frames.
+			CodecThreadingSettings codecThreading = {.reservedCoreCount = 1};
+			// Size of the returned frames. If only one of them is set, the other one is derived from the
+			// aspect ratio of the video; If neither is set, frames have the size of the video.
+			uint32_t outputWidth = 0;
+			uint32_t outputHeight = 0;
+			ScalingAlgorithm scalingAlgorithm = ScalingAlgorithm::Bicubic;
+			OutputFormat outputFormat = OutputFormat::RGBA8;
+			// Decodes the audio stream in the same demuxing pass as the video stream and resamples it to the
+			// format below. Audio is decoded as a side effect of reading video frames (or by the decode thread
+			// with asynchronous decoding) and can be retrieved with ReadAudio.
+			bool decodeAudio = false;
+			AudioSampleFormat audioSampleFormat = AudioSampleFormat::Float32;
+			// If 0, the sample rate / channel count of the audio stream is kept
+			uint32_t audioSampleRate = 0;
+			uint32_t audioChannelCount = 0;
+			// Amount of decoded audio which can be buffered, in milliseconds. Audio which doesn't fit
+			// into the buffer anymore is dropped, so it should cover at least the decode-ahead frames.
+			uint32_t audioBufferDuration = 2'000;
+		};
+		enum class ReadResult : uint8_t
+		{
+			Success = 0,
+			// The decode thread hasn't caught up yet
+			NotReady,
+			EndOfStream
+		};
+		struct DecodeAheadStatistics
+		{
+			uint64_t framesRead = 0;
+			// Number of times TryReadFrame found no ready frame
+			uint64_t underrunCount = 0;
+			// Number of frames the ring can hold and number of frames currently ready
+			uint32_t capacity = 0;
+			uint32_t occupancy = 0;
+			// Average number of ready frames at the time a frame was read
+			double averageOccupancy = 0.0;
+		};
+		struct AudioStatistics
+		{
+			// Sample frames (one sample per channel) which have been decoded and read
+			uint64_t framesDecoded = 0;
+			uint64_t framesRead = 0;
+			// Sample frames which were dropped because the buffer was full
+			uint64_t droppedFrameCount = 0;
+			uint32_t bufferedFrameCount = 0;
+			uint32_t capacity = 0;
+		};
 		static std::unique_ptr<VideoPlayer> Create(VFilePtr f);
+		static std::unique_ptr<VideoPlayer> Create(VFilePtr f,const DecodingSettings &settings);
+		// Memory-maps the local file instead of reading it through the virtual file system. Players which
+		// open the same file share the mapping. Returns nullptr if the file could not be mapped.
+		static std::unique_ptr<VideoPlayer> Create(const std::string &localFileName);
+		static std::unique_ptr<VideoPlayer> Create(const std::string &localFileName,const DecodingSettings &settings);
+		// Frames are taken from a pool and stay valid for as long as a reference to them is held.
+		// Once the last reference has been released, the frame is recycled for a later one.
 		std::shared_ptr<uimg::ImageBuffer> ReadFrame(double &outPts);
+		// Never blocks with asynchronous decoding; Same as ReadFrame otherwise
+		ReadResult TryReadFrame(std::shared_ptr<uimg::ImageBuffer> &outFrame,double &outPts);
+		// The frame buffer keeps its data alive through FrameBuffer::owner. Returns false at the end of the stream.
+		bool ReadFrame(FrameBuffer &outFrame,double &outPts);
+		ReadResult TryReadFrame(FrameBuffer &outFrame,double &outPts);
+		// Only available with asynchronous decoding
+		DecodeAheadStatistics GetDecodeAheadStatistics() const;
+		// Only true if audio decoding has been enabled and the file has an audio stream
+		bool HasAudio() const;
+		AudioFormat GetAudioFormat() const;
+		// Copies up to frameCount sample frames of interleaved audio in the format returned by GetAudioFormat
+		// into outData and returns the number of frames copied. Never blocks and doesn't allocate, so it can be
+		// called from a mixer or audio device thread; Only one thread may read audio at a time.
+		uint32_t ReadAudio(void *outData,uint32_t frameCount);
+		// Timestamp of the next sample frame returned by ReadAudio, on the same timeline as the video frames
+		double GetAudioTime() const;
+		AudioStatistics GetAudioStatistics() const;
+		// Seeks to the frame which is displayed at the given time; The time is on the same timeline as the
+		// timestamps returned by ReadFrame. The next call to ReadFrame returns the target frame.
+		// Audio which has been buffered before the seek is discarded. Returns false if the stream is not seekable.
+		bool Seek(double seconds);
+		bool SeekToFrame(uint64_t frameIndex);
 		double GetVideoFrameRate() const;
 		double GetAudioFrameRate() const;
 		double GetAspectRatio() const;
 		uint32_t GetWidth() const;
 		uint32_t GetHeight() const;
+		// Number of threads the video codec is using
+		uint32_t GetCodecThreadCount() const;
+		// Matrix to use when converting frames which have been passed through as YUV (see OutputFormat::Native), based on the
+		// most recently decoded frame. Returns no value if the video uses a matrix with no ColorMatrix equivalent (e.g. BT.2020).
+		std::optional<ColorMatrix> GetColorMatrix() const;
 	private:
 		VideoPlayer(std::shared_ptr<FFMpegDecoder> ffmpegDecoder);
 
@@ -23,6 +23,113 @@ namespace media
 	{
 	public:
 		using ThreadIndex = uint32_t;
+		enum class FrameRateMode : uint32_t
+		{
+			// Frames are placed on a fixed grid of 1/frameRate. If the frame time passed to WriteFrame
+			// skips grid positions, the frame is encoded repeatedly to fill the gap.
+			Constant = 0,
+			// Every frame is encoded exactly once and stamped with its actual frame time.
+			// Only supported by containers with real timestamps, see supports_variable_frame_rate.
+			Variable
+		};
+		using CodecThreadType = media::CodecThreadType;
+		using CodecThreadingSettings = media::CodecThreadingSettings;
+		// Determines how the encoder and writer threads wait for work, as well as how
+		// WriteFrame waits for a free encoder thread
+		struct WaitSettings
+		{
+			// Number of busy-spin iterations before the thread starts yielding
+			uint32_t spinCount = 2'000;
+			// Number of yields before the thread is parked on a condition variable
+			uint32_t yieldCount = 16;
+			// If disabled, the thread will keep yielding instead of parking. Lowers wake-up latency,
+			// but an idle recorder will keep its threads busy.
+			bool allowPark = true;
+		};
+		struct WaitStatistics
+		{
+			std::chrono::nanoseconds spinDuration {0};
+			std::chrono::nanoseconds yieldDuration {0};
+			std::chrono::nanoseconds parkedDuration {0};
+			uint64_t waitCount = 0;
+			uint64_t parkCount = 0;
+		};
+		// Cumulative time spent in the conversion and encoding stages. If the sum of both
+		// is larger than wallDuration, the stages have been running in parallel.
+		struct StageTimings
+		{
+			std::chrono::nanoseconds conversionDuration {0};
+			std::chrono::nanoseconds encodeDuration {0};
+			std::chrono::nanoseconds wallDuration {0};
+			uint64_t numConvertedFrames = 0;
+			uint64_t numEncodedFrames = 0;
+			// Time WriteFrame was blocked because the frame queue was full
+			std::chrono::nanoseconds submitWaitDuration {0};
+			// Time the encoder thread was waiting for a frame to be converted
+			std::chrono::nanoseconds encoderIdleDuration {0};
+			// Time the encoder threads were blocked because the packet queue was full, i.e. the output could not keep up
+			std::chrono::nanoseconds packetStallDuration {0};
+			uint64_t numPacketStalls = 0;
+		};
+		// Writes to the custom file interface
+		struct IOStatistics
+		{
+			uint64_t bytesWritten = 0;
+			uint64_t writeCallCount = 0;
+		};
+		// Logarithmic histogram of durations; Bucket 0 counts durations below 1 microsecond, bucket i
+		// durations in [2^(i-1),2^i) microseconds. The last bucket also counts everything above.
+		struct LatencyHistogram
+		{
+			static constexpr uint32_t BUCKET_COUNT = 24;
+			std::array<uint64_t,BUCKET_COUNT> buckets {};
+			uint64_t count = 0;
+			std::chrono::nanoseconds totalDuration {0};
+			std::chrono::nanoseconds maxDuration {0};
+
+			std::chrono::nanoseconds GetMeanDuration() const;
+			// Returns the upper bound of the bucket the percentile (in the range [0,1]) falls into
+			std::chrono::nanoseconds GetPercentile(double percentile) const;
+		};
+		// Snapshot of the pipeline counters. The counters are updated without locks and read independently
+		// of each other, so a snapshot taken during a recording may be off by the frames currently in flight.
+		// Cheap enough to be polled every frame.
+		struct Statistics
+		{
+			// Time WriteFrame waited for a free queue slot, per submitted frame
+			LatencyHistogram submitWait {};
+			// Pixel format conversion, per frame (frames which need no conversion are not counted)
+			LatencyHistogram rescale {};
+			// Sending a frame to the codec and receiving its packets, per frame
+			LatencyHistogram encode {};
+			// Time packets spent in the writer queue before being written, per packet
+			LatencyHistogram writerQueueWait {};
+			// Muxing a packet (including the I/O it causes), per packet
+			LatencyHistogram writePacket {};
+			// Number of packets currently waiting to be written, and the maximum so far
+			uint32_t writerQueueDepth = 0;
+			uint32_t maxWriterQueueDepth = 0;
+			// Size of the packets passed to the muxer; See GetIOStatistics for the actual output
+			uint64_t bytesWritten = 0;
+			uint64_t packetsWritten = 0;
+			// Frames passed to WriteFrame, and how many of them have been dropped or encoded repeatedly
+			// to map them onto the frame grid of a constant frame rate
+			uint64_t framesSubmitted = 0;
+			uint64_t framesSkipped = 0;
+			uint64_t framesDuplicated = 0;
+		};
+		struct AudioEncodingSettings
+		{
+			AudioCodec codec = AudioCodec::AAC;
+			// Format of the samples passed to WriteAudio
+			AudioSampleFormat sampleFormat = AudioSampleFormat::Float32;
+			uint32_t sampleRate = 48'000;
+			uint32_t channelCount = 2;
+			// Ignored by PCM
+			BitRate bitRate = 192'000;
+			// Amount of audio WriteAudio can queue up before it has to wait for the encoder, in milliseconds
+			uint32_t bufferDuration = 500;
+		};
 		struct EncodingSettings
 		{
 			uint32_t width = 1'024;
@@ -30,8 +137,46 @@ namespace media
 			Codec codec = Codec::MPEG4;
 			Format format = Format::AVI;
 			FrameRate frameRate = 60;
+			FrameRateMode frameRateMode = FrameRateMode::Constant;
 			std::optional<BitRate> bitRate = {};
 			Quality quality = Quality::VeryHigh;
+			// Maximum number of consecutive B-frames. If not set, the codec's default is used.
+			std::optional<uint32_t> maxBFrames = {};
+			// If the thread count is 0, it is determined from the number of cores minus reservedCoreCount, and is adjusted between
+			// recordings based on how long WriteFrame had to wait for the encoder (more threads) or how long the encoder has been idle (fewer threads).
+			CodecThreadingSettings codecThreading = {};
+			// If larger than 1, the frames are split into closed GOPs of gopParallelChunkSize frames which are encoded in
+			// parallel by this many workers, each with its own encoder context. Only supported by codecs with weak internal
+			// threading and no frame reordering (see supports_gop_parallel_encoding), B-frames and codec threading are disabled.
+			uint32_t gopParallelWorkerCount = 1;
+			// Number of frames per chunk; If 0, the chunks span one second
+			uint32_t gopParallelChunkSize = 0;
+			WaitSettings waitSettings = {};
+			// Maximum number of frames that can be queued per encoder thread before WriteFrame
+			// has to wait. The image buffers passed to WriteFrame are referenced (not copied) until
+			// their frame has been encoded, so they must not be modified until then. ImageBuffers
+			// with a format that has no FFmpeg equivalent (RGB16, RGB32) are copied to RGBA8 first.
+			// With GOP-parallel encoding every worker can queue at least a whole chunk.
+			uint32_t frameQueueSize = 4;
+			// Maximum number of encoded packets waiting to be written to the output. If the output can't keep up, the
+			// encoder threads (and eventually WriteFrame) will wait, instead of buffering an unbounded amount of packets.
+			// With GOP-parallel encoding it is raised to span at least one chunk per worker, so the workers don't wait for each other.
+			uint32_t packetQueueSize = 256;
+			// Size of the buffer FFmpeg's I/O layer collects the muxer output in before passing it on.
+			// If 0, the default of avcpp is used. Only applies if the recorder has a custom file interface.
+			uint32_t avioBufferSize = 0;
+			// The muxer output is collected in two buffers of this size before it is passed to the custom file interface;
+			// While one buffer is written in the background, the other one is being filled. If 0, every chunk of output is
+			// passed to the file interface right away.
+			uint32_t writeBufferSize = 4 *1'024 *1'024;
+			// Number of horizontal slices each frame is split into for the color conversion, each of
+			// which is converted on its own thread. If 0, the slice count is determined automatically.
+			uint32_t conversionSliceCount = 0;
+			// Matrix used for the RGB to YUV conversion; Also written to the stream's color metadata
+			ColorMatrix colorMatrix = ColorMatrix::BT601;
+			// If set, the recording gets an audio stream, which is fed with WriteAudio. Audio and video packets are
+			// interleaved while the file is being written, so no separate muxing pass is required.
+			std::optional<AudioEncodingSettings> audio = {};
 		};
 		static std::unique_ptr<VideoRecorder> Create(std::unique_ptr<ICustomFile> fileInterface);
 		~VideoRecorder();
@@ -41,15 +186,39 @@ namespace media
 		bool IsRecording() const;
 		ThreadIndex StartFrame();
 		int32_t WriteFrame(const uimg::ImageBuffer &imgBuf,double frameTime);
+		// Frames are passed to the encoder without an intermediate copy; The data has to stay valid
+		// until the frame has been encoded, which can be ensured via FrameBuffer::owner
+		int32_t WriteFrame(const FrameBuffer &frameBuffer,double frameTime);
+		// Appends frameCount sample frames in the format of EncodingSettings::audio to the audio stream. The audio stream starts at
+		// the same time as the first video frame and has no gaps, silence has to be written explicitly. Audio should be written
+		// continuously alongside the video, otherwise the video packets are held back (up to half the packet queue) to be interleaved.
+		// May be called from a different thread than WriteFrame, but only from one thread at a time. Blocks if the audio encoder can't
+		// keep up. Returns the number of frames written, or -1 if there is no recording with an audio stream.
+		int32_t WriteAudio(const void *data,uint32_t frameCount);
 
 		uint32_t GetWidth() const;
 		uint32_t GetHeight() const;
 		std::chrono::nanoseconds GetEncodingDuration() const;
+		WaitStatistics GetWaitStatistics() const;
+		StageTimings GetStageTimings() const;
+		IOStatistics GetIOStatistics() const;
+		Statistics GetStatistics() const;
 		std::pair<uint32_t,uint32_t> GetResolution() const;
 	private:
 		VideoRecorder(std::unique_ptr<ICustomFile> fileInterface);
 		std::shared_ptr<FFMpegEncoder> m_ffmpegEncoder = nullptr;
 		std::shared_ptr<ICustomFile> m_fileInterface = nullptr;
+
+		// Codec thread count determined by previous recordings with automatic threading
+		struct AutoThreadingState
+		{
+			Codec codec = Codec::Count;
+			uint32_t width = 0;
+			uint32_t height = 0;
+			uint32_t threadCount = 0;
+		};
+		AutoThreadingState m_autoThreadingState = {};
+		bool m_isAutoThreading = false;
 	};
 };
 
@@ -0,0 +1,61 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "audio_ring_buffer.hpp"
+#include <algorithm>
+#include <cstring>
+
+using namespace media;
+
+AudioRingBuffer::AudioRingBuffer(uint32_t capacity,uint32_t frameSize)
+	: m_capacity{std::max(capacity,1u)},m_frameSize{frameSize}
+{
+	m_data.resize(static_cast<size_t>(m_capacity) *m_frameSize);
+}
+
+uint32_t AudioRingBuffer::Write(const uint8_t *data,uint32_t frameCount)
+{
+	auto writeIndex = m_writeIndex.load(std::memory_order_relaxed);
+	auto readIndex = m_readIndex.load(std::memory_order_acquire);
+	// If the consumer isn't reading right now, its next read will skip the flushed frames, so they can be reused
+	// immediately; Otherwise new frames would be dropped after a seek until the consumer reads again.
+	if(m_isReading.load(std::memory_order_seq_cst) == false)
+		readIndex = std::max(readIndex,m_flushIndex.load(std::memory_order_relaxed));
+	frameCount = std::min(frameCount,static_cast<uint32_t>(m_capacity -(writeIndex -readIndex)));
+	// The range may wrap around the end of the ring
+	auto offset = static_cast<uint32_t>(writeIndex %m_capacity);
+	auto n0 = std::min(frameCount,m_capacity -offset);
+	memcpy(m_data.data() +static_cast<size_t>(offset) *m_frameSize,data,static_cast<size_t>(n0) *m_frameSize);
+	memcpy(m_data.data(),data +static_cast<size_t>(n0) *m_frameSize,static_cast<size_t>(frameCount -n0) *m_frameSize);
+	m_writeIndex.store(writeIndex +frameCount,std::memory_order_release);
+	return frameCount;
+}
+
+void AudioRingBuffer::Flush() {m_flushIndex.store(m_writeIndex.load(std::memory_order_relaxed),std::memory_order_seq_cst);}
+
+uint32_t AudioRingBuffer::Read(uint8_t *data,uint32_t frameCount)
+{
+	m_isReading.store(true,std::memory_order_seq_cst);
+	auto readIndex = std::max(m_readIndex.load(std::memory_order_relaxed),m_flushIndex.load(std::memory_order_seq_cst));
+	auto writeIndex = m_writeIndex.load(std::memory_order_acquire);
+	frameCount = std::min(frameCount,static_cast<uint32_t>(writeIndex -readIndex));
+	auto offset = static_cast<uint32_t>(readIndex %m_capacity);
+	auto n0 = std::min(frameCount,m_capacity -offset);
+	memcpy(data,m_data.data() +static_cast<size_t>(offset) *m_frameSize,static_cast<size_t>(n0) *m_frameSize);
+	memcpy(data +static_cast<size_t>(n0) *m_frameSize,m_data.data(),static_cast<size_t>(frameCount -n0) *m_frameSize);
+	m_readIndex.store(readIndex +frameCount,std::memory_order_release);
+	m_isReading.store(false,std::memory_order_release);
+	return frameCount;
+}
+
+uint32_t AudioRingBuffer::GetCapacity() const {return m_capacity;}
+uint32_t AudioRingBuffer::GetFrameSize() const {return m_frameSize;}
+uint32_t AudioRingBuffer::GetAvailableFrameCount() const
+{
+	auto readIndex = std::max(m_readIndex.load(std::memory_order_relaxed),m_flushIndex.load(std::memory_order_relaxed));
+	auto writeIndex = m_writeIndex.load(std::memory_order_relaxed);
+	return static_cast<uint32_t>(writeIndex -std::min(readIndex,writeIndex));
+}
+uint64_t AudioRingBuffer::GetReadIndex() const {return std::max(m_readIndex.load(std::memory_order_relaxed),m_flushIndex.load(std::memory_order_relaxed));}
+uint64_t AudioRingBuffer::GetWriteIndex() const {return m_writeIndex.load(std::memory_order_relaxed);}
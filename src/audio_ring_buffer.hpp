@@ -0,0 +1,48 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __AUDIO_RING_BUFFER_HPP__
+#define __AUDIO_RING_BUFFER_HPP__
+
+#include <cinttypes>
+#include <vector>
+#include <atomic>
+
+namespace media
+{
+	// Lock-free single-producer single-consumer ring of interleaved PCM sample frames. Indices are counted in
+	// sample frames and only ever increase; The write index is only advanced by the producer, the read index
+	// only by the consumer.
+	class AudioRingBuffer
+	{
+	public:
+		AudioRingBuffer(uint32_t capacity,uint32_t frameSize);
+		// Producer; Returns the number of frames which have been written, which is less than frameCount if the ring is full
+		uint32_t Write(const uint8_t *data,uint32_t frameCount);
+		// Producer; Discards all frames which have been written so far. Frames the consumer is currently reading are not affected.
+		void Flush();
+		// Consumer; Returns the number of frames which have been read
+		uint32_t Read(uint8_t *data,uint32_t frameCount);
+
+		uint32_t GetCapacity() const;
+		uint32_t GetFrameSize() const;
+		uint32_t GetAvailableFrameCount() const;
+		// Index of the next frame which will be read
+		uint64_t GetReadIndex() const;
+		uint64_t GetWriteIndex() const;
+	private:
+		std::vector<uint8_t> m_data;
+		uint32_t m_capacity = 0;
+		uint32_t m_frameSize = 0;
+		std::atomic<uint64_t> m_readIndex = 0;
+		std::atomic<uint64_t> m_writeIndex = 0;
+		// Frames before this index have been flushed and are skipped by the consumer
+		std::atomic<uint64_t> m_flushIndex = 0;
+		// Set by the consumer while it is copying frames out of the ring. Flushed frames can only be overwritten
+		// while it is not set, otherwise the consumer may still be reading them.
+		std::atomic<bool> m_isReading = false;
+	};
+};
+
+#endif
@@ -0,0 +1,199 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "color_conversion.hpp"
+#include <algorithm>
+#include <cmath>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#define VIDEO_RECORDER_X86
+	#ifdef _MSC_VER
+		#include <intrin.h>
+	#endif
+#endif
+
+using namespace media;
+
+color::ConversionCoefficients color::calc_conversion_coefficients(ColorMatrix matrix,bool fullRange,bool swapRedBlue)
+{
+	double kr,kb;
+	switch(matrix)
+	{
+		case ColorMatrix::BT709:
+			kr = 0.2126;
+			kb = 0.0722;
+			break;
+		case ColorMatrix::BT601:
+		default:
+			kr = 0.299;
+			kb = 0.114;
+			break;
+	}
+	auto kg = 1.0 -kr -kb;
+	auto yScale = fullRange ? 1.0 : (219.0 /255.0);
+	auto uvScale = fullRange ? 1.0 : (224.0 /255.0);
+	auto yOffset = fullRange ? 0 : 16;
+
+	auto scale = static_cast<double>(1 <<COEFFICIENT_PRECISION);
+	auto toFixed = [scale](double v) {return static_cast<int16_t>(std::lround(v *scale));};
+	std::array<double,3> y {kr,kg,kb};
+	std::array<double,3> u {-kr /(2.0 *(1.0 -kb)),-kg /(2.0 *(1.0 -kb)),0.5};
+	std::array<double,3> v {0.5,-kg /(2.0 *(1.0 -kr)),-kb /(2.0 *(1.0 -kr))};
+
+	ConversionCoefficients coefficients {};
+	for(auto i=0u;i<3;++i)
+	{
+		auto channel = swapRedBlue ? (2 -i) : i;
+		coefficients.y[channel] = toFixed(y[i] *yScale);
+		coefficients.u[channel] = toFixed(u[i] *uvScale);
+		coefficients.v[channel] = toFixed(v[i] *uvScale);
+	}
+	coefficients.yBias = (yOffset <<COEFFICIENT_PRECISION) +(1 <<(COEFFICIENT_PRECISION -1));
+	// Chroma is calculated from the sum of four pixels, which adds another two bits of precision
+	coefficients.uvBias = (128 <<(COEFFICIENT_PRECISION +2)) +(1 <<(COEFFICIENT_PRECISION +1));
+	return coefficients;
+}
+
+static uint8_t calc_luma(const uint8_t *px,const color::ConversionCoefficients &c)
+{
+	auto y = (c.y[0] *px[0] +c.y[1] *px[1] +c.y[2] *px[2] +c.yBias) >>color::COEFFICIENT_PRECISION;
+	return static_cast<uint8_t>(std::clamp(y,0,255));
+}
+static uint8_t calc_chroma(const std::array<int32_t,3> &sum,const std::array<int16_t,3> &weights,int32_t bias)
+{
+	auto c = (weights[0] *sum[0] +weights[1] *sum[1] +weights[2] *sum[2] +bias) >>(color::COEFFICIENT_PRECISION +2);
+	return static_cast<uint8_t>(std::clamp(c,0,255));
+}
+
+void color::convert_rgba_to_yuv420_scalar(
+	const uint8_t *src0,const uint8_t *src1,uint8_t *dstY0,uint8_t *dstY1,uint8_t *dstU,uint8_t *dstV,uint32_t uvStep,
+	uint32_t x,uint32_t width,const ConversionCoefficients &coefficients
+)
+{
+	for(;x<width;x+=2)
+	{
+		// Last column is duplicated for odd widths
+		auto x1 = std::min(x +1,width -1);
+		std::array<const uint8_t*,4> px {src0 +x *4,src0 +x1 *4,src1 +x *4,src1 +x1 *4};
+		dstY0[x] = calc_luma(px[0],coefficients);
+		if(x1 != x)
+			dstY0[x1] = calc_luma(px[1],coefficients);
+		if(dstY1)
+		{
+			dstY1[x] = calc_luma(px[2],coefficients);
+			if(x1 != x)
+				dstY1[x1] = calc_luma(px[3],coefficients);
+		}
+
+		std::array<int32_t,3> sum {};
+		for(auto *p : px)
+		{
+			for(auto i=0u;i<sum.size();++i)
+				sum[i] += p[i];
+		}
+		auto uvOffset = (x /2) *uvStep;
+		dstU[uvOffset] = calc_chroma(sum,coefficients.u,coefficients.uvBias);
+		dstV[uvOffset] = calc_chroma(sum,coefficients.v,coefficients.uvBias);
+	}
+}
+
+void color::convert_rgba_to_yuv420_scalar(
+	const uint8_t *src,int srcLineSize,const ConversionTarget &dst,uint32_t width,uint32_t rowStart,uint32_t rowEnd,
+	const ConversionCoefficients &coefficients
+)
+{
+	auto uvStep = (dst.layout == YUVLayout::NV12) ? 2u : 1u;
+	for(auto y=rowStart;y<rowEnd;y+=2)
+	{
+		// Last row is duplicated for odd heights
+		auto hasSecondRow = (y +1 < rowEnd);
+		auto *src0 = src +static_cast<ptrdiff_t>(y) *srcLineSize;
+		auto *src1 = hasSecondRow ? (src0 +srcLineSize) : src0;
+		auto *dstY0 = dst.data[0] +static_cast<ptrdiff_t>(y) *dst.lineSize[0];
+		auto *dstY1 = hasSecondRow ? (dstY0 +dst.lineSize[0]) : nullptr;
+		auto *dstU = dst.data[1] +static_cast<ptrdiff_t>(y /2) *dst.lineSize[1];
+		auto *dstV = (dst.layout == YUVLayout::NV12) ? (dstU +1) : (dst.data[2] +static_cast<ptrdiff_t>(y /2) *dst.lineSize[2]);
+		convert_rgba_to_yuv420_scalar(src0,src1,dstY0,dstY1,dstU,dstV,uvStep,0,width,coefficients);
+	}
+}
+
+color::InstructionSet color::get_supported_instruction_set()
+{
+#ifdef VIDEO_RECORDER_X86
+	#ifdef _MSC_VER
+	std::array<int,4> info {};
+	__cpuid(info.data(),0);
+	auto maxLeaf = info[0];
+	__cpuid(info.data(),1);
+	auto hasSse41 = (info[2] &(1 <<19)) != 0;
+	auto hasOsxsave = (info[2] &(1 <<27)) != 0;
+	auto hasAvx = (info[2] &(1 <<28)) != 0;
+	auto xcr0 = hasOsxsave ? _xgetbv(0) : 0;
+	auto osSupportsAvx = (xcr0 &0x6) == 0x6;
+	auto osSupportsAvx512 = (xcr0 &0xe6) == 0xe6;
+	auto hasAvx2 = false;
+	auto hasAvx512 = false;
+	if(maxLeaf >= 7)
+	{
+		__cpuidex(info.data(),7,0);
+		hasAvx2 = (info[1] &(1 <<5)) != 0;
+		hasAvx512 = (info[1] &(1 <<16)) != 0;
+	}
+	if(hasAvx512 && osSupportsAvx512)
+		return InstructionSet::AVX512;
+	if(hasAvx && hasAvx2 && osSupportsAvx)
+		return InstructionSet::AVX2;
+	if(hasSse41)
+		return InstructionSet::SSE41;
+	#else
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f"))
+		return InstructionSet::AVX512;
+	if(__builtin_cpu_supports("avx2"))
+		return InstructionSet::AVX2;
+	if(__builtin_cpu_supports("sse4.1"))
+		return InstructionSet::SSE41;
+	#endif
+#endif
+	return InstructionSet::Scalar;
+}
+
+std::string color::instruction_set_to_string(InstructionSet instructionSet)
+{
+	switch(instructionSet)
+	{
+		case InstructionSet::SSE41:
+			return "SSE4.1";
+		case InstructionSet::AVX2:
+			return "AVX2";
+		case InstructionSet::AVX512:
+			return "AVX-512";
+		case InstructionSet::Scalar:
+		default:
+			return "Scalar";
+	}
+}
+
+color::ConversionKernel color::get_conversion_kernel(InstructionSet maxInstructionSet)
+{
+	static auto supportedInstructionSet = get_supported_instruction_set();
+	auto instructionSet = std::min(supportedInstructionSet,maxInstructionSet);
+#ifdef VIDEO_RECORDER_X86
+	switch(instructionSet)
+	{
+		case InstructionSet::AVX512:
+	#ifdef VIDEO_RECORDER_ENABLE_AVX512
+			return convert_rgba_to_yuv420_avx512;
+	#else
+			[[fallthrough]];
+	#endif
+		case InstructionSet::AVX2:
+			return convert_rgba_to_yuv420_avx2;
+		case InstructionSet::SSE41:
+			return convert_rgba_to_yuv420_sse41;
+		default:
+			break;
+	}
+#endif
+	return convert_rgba_to_yuv420_scalar;
+}
@@ -0,0 +1,90 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __COLOR_CONVERSION_HPP__
+#define __COLOR_CONVERSION_HPP__
+
+#include <cinttypes>
+#include <array>
+#include "util_media.hpp"
+
+// Hand-vectorized conversion kernels from packed 8-bit RGBA/BGRA to 4:2:0 YUV, used instead of
+// swscale for the most common encoder input formats. Luma is converted per pixel, chroma is the
+// average of each 2x2 pixel block. All kernels use the same 14-bit fixed-point arithmetic, so
+// the SIMD variants are bit-exact with the scalar one. Compared to swscale (SWS_BICUBIC) the output
+// is within +-1 for luma; chroma is within +-2 for smooth content, but can differ more at hard
+// edges, since swscale uses a wider filter for the chroma downsampling.
+namespace media::color
+{
+	enum class InstructionSet : uint8_t
+	{
+		Scalar = 0,
+		SSE41,
+		AVX2,
+		AVX512
+	};
+	enum class YUVLayout : uint8_t
+	{
+		// Three planes: Y, U, V
+		Planar = 0,
+		// Two planes: Y, interleaved UV
+		NV12
+	};
+
+	static constexpr uint32_t COEFFICIENT_PRECISION = 14;
+	struct ConversionCoefficients
+	{
+		// Weights for the first three channels in memory order (i.e. swapped for BGRA)
+		std::array<int16_t,3> y;
+		std::array<int16_t,3> u;
+		std::array<int16_t,3> v;
+		// Includes the luma offset and the rounding term
+		int32_t yBias;
+		// Includes the chroma offset and the rounding term for the 2x2 average
+		int32_t uvBias;
+	};
+	ConversionCoefficients calc_conversion_coefficients(ColorMatrix matrix,bool fullRange,bool swapRedBlue);
+
+	struct ConversionTarget
+	{
+		std::array<uint8_t*,3> data;
+		std::array<int,3> lineSize;
+		YUVLayout layout;
+	};
+	// Converts the rows [rowStart,rowEnd) of the source image. rowStart has to be even.
+	using ConversionKernel = void(*)(
+		const uint8_t *src,int srcLineSize,const ConversionTarget &dst,uint32_t width,uint32_t rowStart,uint32_t rowEnd,
+		const ConversionCoefficients &coefficients
+	);
+
+	InstructionSet get_supported_instruction_set();
+	std::string instruction_set_to_string(InstructionSet instructionSet);
+	// Returns the kernel for the best instruction set supported by both the CPU and this build,
+	// which is not better than maxInstructionSet
+	ConversionKernel get_conversion_kernel(InstructionSet maxInstructionSet=InstructionSet::AVX512);
+
+	void convert_rgba_to_yuv420_scalar(
+		const uint8_t *src,int srcLineSize,const ConversionTarget &dst,uint32_t width,uint32_t rowStart,uint32_t rowEnd,
+		const ConversionCoefficients &coefficients
+	);
+	// Converts a single row pair starting at pixel x; Used by the SIMD kernels for the remaining pixels
+	void convert_rgba_to_yuv420_scalar(
+		const uint8_t *src0,const uint8_t *src1,uint8_t *dstY0,uint8_t *dstY1,uint8_t *dstU,uint8_t *dstV,uint32_t uvStep,
+		uint32_t x,uint32_t width,const ConversionCoefficients &coefficients
+	);
+	void convert_rgba_to_yuv420_sse41(
+		const uint8_t *src,int srcLineSize,const ConversionTarget &dst,uint32_t width,uint32_t rowStart,uint32_t rowEnd,
+		const ConversionCoefficients &coefficients
+	);
+	void convert_rgba_to_yuv420_avx2(
+		const uint8_t *src,int srcLineSize,const ConversionTarget &dst,uint32_t width,uint32_t rowStart,uint32_t rowEnd,
+		const ConversionCoefficients &coefficients
+	);
+	void convert_rgba_to_yuv420_avx512(
+		const uint8_t *src,int srcLineSize,const ConversionTarget &dst,uint32_t width,uint32_t rowStart,uint32_t rowEnd,
+		const ConversionCoefficients &coefficients
+	);
+};
+
+#endif
@@ -0,0 +1,127 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "color_conversion.hpp"
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+using namespace media;
+
+namespace
+{
+	struct Weights
+	{
+		__m256i y;
+		__m256i u;
+		__m256i v;
+		__m256i yBias;
+		__m256i uvBias;
+	};
+	__m256i make_weights(const std::array<int16_t,3> &w) {return _mm256_setr_epi16(w[0],w[1],w[2],0,w[0],w[1],w[2],0,w[0],w[1],w[2],0,w[0],w[1],w[2],0);}
+
+	// All operations below work within 128-bit lanes. A register of 8 pixels [p0-p3|p4-p7] is unpacked to
+	// [p0,p1|p4,p5] and [p2,p3|p6,p7], so the horizontal add restores the original pixel order.
+	__m256i weighted_sum(__m256i lo,__m256i hi,__m256i weights)
+	{
+		return _mm256_hadd_epi32(_mm256_madd_epi16(lo,weights),_mm256_madd_epi16(hi,weights));
+	}
+
+	// Converts 16 pixels to luma
+	__m128i calc_luma(__m256i px0,__m256i px1,const Weights &w)
+	{
+		auto zero = _mm256_setzero_si256();
+		auto y0 = weighted_sum(_mm256_unpacklo_epi8(px0,zero),_mm256_unpackhi_epi8(px0,zero),w.y);
+		auto y1 = weighted_sum(_mm256_unpacklo_epi8(px1,zero),_mm256_unpackhi_epi8(px1,zero),w.y);
+		y0 = _mm256_srai_epi32(_mm256_add_epi32(y0,w.yBias),color::COEFFICIENT_PRECISION);
+		y1 = _mm256_srai_epi32(_mm256_add_epi32(y1,w.yBias),color::COEFFICIENT_PRECISION);
+		// [y0-3,y8-11|y4-7,y12-15] -> [y0-3,y4-7|y8-11,y12-15]
+		auto y = _mm256_permute4x64_epi64(_mm256_packs_epi32(y0,y1),_MM_SHUFFLE(3,1,2,0));
+		// [y0-7,y0-7|y8-15,y8-15]
+		y = _mm256_packus_epi16(y,y);
+		return _mm256_castsi256_si128(_mm256_permute4x64_epi64(y,_MM_SHUFFLE(3,1,2,0)));
+	}
+
+	// Converts the 2x2 blocks of 16x2 pixels (given as 16-bit sums of both rows) to 8 chroma values
+	__m256i calc_chroma(const __m256i (&rowSums)[4],__m256i weights,__m256i bias)
+	{
+		auto c0 = weighted_sum(rowSums[0],rowSums[1],weights);
+		auto c1 = weighted_sum(rowSums[2],rowSums[3],weights);
+		// [c0,c1,c4,c5|c2,c3,c6,c7] -> [c0-c3|c4-c7]
+		auto c = _mm256_permutevar8x32_epi32(_mm256_hadd_epi32(c0,c1),_mm256_setr_epi32(0,1,4,5,2,3,6,7));
+		return _mm256_srai_epi32(_mm256_add_epi32(c,bias),color::COEFFICIENT_PRECISION +2);
+	}
+};
+
+void color::convert_rgba_to_yuv420_avx2(
+	const uint8_t *src,int srcLineSize,const ConversionTarget &dst,uint32_t width,uint32_t rowStart,uint32_t rowEnd,
+	const ConversionCoefficients &coefficients
+)
+{
+	Weights w {};
+	w.y = make_weights(coefficients.y);
+	w.u = make_weights(coefficients.u);
+	w.v = make_weights(coefficients.v);
+	w.yBias = _mm256_set1_epi32(coefficients.yBias);
+	w.uvBias = _mm256_set1_epi32(coefficients.uvBias);
+	auto zero = _mm256_setzero_si256();
+	auto isNv12 = (dst.layout == YUVLayout::NV12);
+	auto uvStep = isNv12 ? 2u : 1u;
+	constexpr uint32_t pixelsPerIteration = 16;
+	for(auto y=rowStart;y<rowEnd;y+=2)
+	{
+		auto hasSecondRow = (y +1 < rowEnd);
+		auto *src0 = src +static_cast<ptrdiff_t>(y) *srcLineSize;
+		auto *src1 = hasSecondRow ? (src0 +srcLineSize) : src0;
+		auto *dstY0 = dst.data[0] +static_cast<ptrdiff_t>(y) *dst.lineSize[0];
+		auto *dstY1 = hasSecondRow ? (dstY0 +dst.lineSize[0]) : nullptr;
+		auto *dstU = dst.data[1] +static_cast<ptrdiff_t>(y /2) *dst.lineSize[1];
+		auto *dstV = isNv12 ? (dstU +1) : (dst.data[2] +static_cast<ptrdiff_t>(y /2) *dst.lineSize[2]);
+
+		auto x = 0u;
+		for(;x +pixelsPerIteration<=width;x+=pixelsPerIteration)
+		{
+			auto a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src0 +x *4));
+			auto a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src0 +x *4 +32));
+			auto b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src1 +x *4));
+			auto b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src1 +x *4 +32));
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dstY0 +x),calc_luma(a0,a1,w));
+			if(dstY1)
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dstY1 +x),calc_luma(b0,b1,w));
+
+			__m256i rowSums[4] = {
+				_mm256_add_epi16(_mm256_unpacklo_epi8(a0,zero),_mm256_unpacklo_epi8(b0,zero)),
+				_mm256_add_epi16(_mm256_unpackhi_epi8(a0,zero),_mm256_unpackhi_epi8(b0,zero)),
+				_mm256_add_epi16(_mm256_unpacklo_epi8(a1,zero),_mm256_unpacklo_epi8(b1,zero)),
+				_mm256_add_epi16(_mm256_unpackhi_epi8(a1,zero),_mm256_unpackhi_epi8(b1,zero))
+			};
+			auto u = calc_chroma(rowSums,w.u,w.uvBias);
+			auto v = calc_chroma(rowSums,w.v,w.uvBias);
+			// [u0-3,v0-3|u4-7,v4-7] -> [u0-7|v0-7]
+			auto uv = _mm256_permute4x64_epi64(_mm256_packs_epi32(u,v),_MM_SHUFFLE(3,1,2,0));
+			// [u0-7,u0-7|v0-7,v0-7]
+			uv = _mm256_packus_epi16(uv,uv);
+			auto u8 = _mm256_castsi256_si128(uv);
+			auto v8 = _mm256_extracti128_si256(uv,1);
+			auto uvOffset = x /2 *uvStep;
+			if(isNv12)
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dstU +uvOffset),_mm_unpacklo_epi8(u8,v8));
+			else
+			{
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(dstU +uvOffset),u8);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(dstV +uvOffset),v8);
+			}
+		}
+		convert_rgba_to_yuv420_scalar(src0,src1,dstY0,dstY1,dstU,dstV,uvStep,x,width,coefficients);
+	}
+}
+#else
+void media::color::convert_rgba_to_yuv420_avx2(
+	const uint8_t *src,int srcLineSize,const ConversionTarget &dst,uint32_t width,uint32_t rowStart,uint32_t rowEnd,
+	const ConversionCoefficients &coefficients
+)
+{
+	convert_rgba_to_yuv420_scalar(src,srcLineSize,dst,width,rowStart,rowEnd,coefficients);
+}
+#endif
@@ -0,0 +1,131 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "color_conversion.hpp"
+#if defined(VIDEO_RECORDER_ENABLE_AVX512) && (defined(_M_X64) || defined(__x86_64__))
+#include <immintrin.h>
+
+using namespace media;
+
+namespace
+{
+	struct Channels
+	{
+		__m512i c[3];
+	};
+	struct Weights
+	{
+		Channels y;
+		Channels u;
+		Channels v;
+		__m512i yBias;
+		__m512i uvBias;
+	};
+	Channels make_weights(const std::array<int16_t,3> &w)
+	{
+		return {{_mm512_set1_epi32(w[0]),_mm512_set1_epi32(w[1]),_mm512_set1_epi32(w[2])}};
+	}
+
+	// Unlike the SSE4.1 and AVX2 kernels, the pixels are split into one register per channel
+	// with 32-bit elements, which only requires AVX-512F
+	Channels split_channels(__m512i px)
+	{
+		auto mask = _mm512_set1_epi32(0xFF);
+		return {{
+			_mm512_and_si512(px,mask),
+			_mm512_and_si512(_mm512_srli_epi32(px,8),mask),
+			_mm512_and_si512(_mm512_srli_epi32(px,16),mask)
+		}};
+	}
+	__m512i weighted_sum(const Channels &channels,const Channels &weights,__m512i bias)
+	{
+		auto sum = _mm512_add_epi32(_mm512_mullo_epi32(channels.c[0],weights.c[0]),_mm512_mullo_epi32(channels.c[1],weights.c[1]));
+		sum = _mm512_add_epi32(sum,_mm512_mullo_epi32(channels.c[2],weights.c[2]));
+		return _mm512_add_epi32(sum,bias);
+	}
+	__m512i clamp_to_byte(__m512i v)
+	{
+		return _mm512_min_epi32(_mm512_max_epi32(v,_mm512_setzero_si512()),_mm512_set1_epi32(255));
+	}
+
+	// Converts 16 pixels to luma
+	__m128i calc_luma(const Channels &channels,const Weights &w)
+	{
+		auto y = _mm512_srai_epi32(weighted_sum(channels,w.y,w.yBias),color::COEFFICIENT_PRECISION);
+		return _mm512_cvtepi32_epi8(clamp_to_byte(y));
+	}
+
+	// Converts the 2x2 blocks of 16x2 pixels (given as sums of both rows) to 8 chroma values
+	__m128i calc_chroma(const Channels &pairSums,const Channels &weights,__m512i bias)
+	{
+		auto c = _mm512_srai_epi32(weighted_sum(pairSums,weights,bias),color::COEFFICIENT_PRECISION +2);
+		// Only the even elements contain valid values, the low byte of each 64-bit element is the result
+		return _mm512_cvtepi64_epi8(clamp_to_byte(c));
+	}
+};
+
+void color::convert_rgba_to_yuv420_avx512(
+	const uint8_t *src,int srcLineSize,const ConversionTarget &dst,uint32_t width,uint32_t rowStart,uint32_t rowEnd,
+	const ConversionCoefficients &coefficients
+)
+{
+	Weights w {};
+	w.y = make_weights(coefficients.y);
+	w.u = make_weights(coefficients.u);
+	w.v = make_weights(coefficients.v);
+	w.yBias = _mm512_set1_epi32(coefficients.yBias);
+	w.uvBias = _mm512_set1_epi32(coefficients.uvBias);
+	auto isNv12 = (dst.layout == YUVLayout::NV12);
+	auto uvStep = isNv12 ? 2u : 1u;
+	constexpr uint32_t pixelsPerIteration = 16;
+	for(auto y=rowStart;y<rowEnd;y+=2)
+	{
+		auto hasSecondRow = (y +1 < rowEnd);
+		auto *src0 = src +static_cast<ptrdiff_t>(y) *srcLineSize;
+		auto *src1 = hasSecondRow ? (src0 +srcLineSize) : src0;
+		auto *dstY0 = dst.data[0] +static_cast<ptrdiff_t>(y) *dst.lineSize[0];
+		auto *dstY1 = hasSecondRow ? (dstY0 +dst.lineSize[0]) : nullptr;
+		auto *dstU = dst.data[1] +static_cast<ptrdiff_t>(y /2) *dst.lineSize[1];
+		auto *dstV = isNv12 ? (dstU +1) : (dst.data[2] +static_cast<ptrdiff_t>(y /2) *dst.lineSize[2]);
+
+		auto x = 0u;
+		for(;x +pixelsPerIteration<=width;x+=pixelsPerIteration)
+		{
+			auto a = split_channels(_mm512_loadu_si512(src0 +x *4));
+			auto b = split_channels(_mm512_loadu_si512(src1 +x *4));
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dstY0 +x),calc_luma(a,w));
+			if(dstY1)
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dstY1 +x),calc_luma(b,w));
+
+			// Sum of both rows, then sum of horizontally adjacent pixels (into the even elements)
+			Channels pairSums;
+			for(auto i=0u;i<3;++i)
+			{
+				auto rowSum = _mm512_add_epi32(a.c[i],b.c[i]);
+				pairSums.c[i] = _mm512_add_epi32(rowSum,_mm512_srli_epi64(rowSum,32));
+			}
+			auto u8 = calc_chroma(pairSums,w.u,w.uvBias);
+			auto v8 = calc_chroma(pairSums,w.v,w.uvBias);
+			auto uvOffset = x /2 *uvStep;
+			if(isNv12)
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dstU +uvOffset),_mm_unpacklo_epi8(u8,v8));
+			else
+			{
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(dstU +uvOffset),u8);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(dstV +uvOffset),v8);
+			}
+		}
+		convert_rgba_to_yuv420_scalar(src0,src1,dstY0,dstY1,dstU,dstV,uvStep,x,width,coefficients);
+	}
+}
+#else
+void media::color::convert_rgba_to_yuv420_avx512(
+	const uint8_t *src,int srcLineSize,const ConversionTarget &dst,uint32_t width,uint32_t rowStart,uint32_t rowEnd,
+	const ConversionCoefficients &coefficients
+)
+{
+	convert_rgba_to_yuv420_avx2(src,srcLineSize,dst,width,rowStart,rowEnd,coefficients);
+}
+#endif
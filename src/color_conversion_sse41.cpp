@@ -0,0 +1,126 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "color_conversion.hpp"
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <smmintrin.h>
+#include <cstring>
+
+using namespace media;
+
+namespace
+{
+	struct Weights
+	{
+		// Channel weights for two pixels, as expected by _mm_madd_epi16
+		__m128i y;
+		__m128i u;
+		__m128i v;
+		__m128i yBias;
+		__m128i uvBias;
+	};
+	__m128i make_weights(const std::array<int16_t,3> &w) {return _mm_setr_epi16(w[0],w[1],w[2],0,w[0],w[1],w[2],0);}
+
+	// Returns the weighted channel sums of four pixels (as 16-bit channels in lo and hi) as 32-bit integers
+	__m128i weighted_sum(__m128i lo,__m128i hi,__m128i weights)
+	{
+		return _mm_hadd_epi32(_mm_madd_epi16(lo,weights),_mm_madd_epi16(hi,weights));
+	}
+
+	// Converts 8 pixels to luma
+	__m128i calc_luma(__m128i px0,__m128i px1,const Weights &w)
+	{
+		auto zero = _mm_setzero_si128();
+		auto y0 = weighted_sum(_mm_unpacklo_epi8(px0,zero),_mm_unpackhi_epi8(px0,zero),w.y);
+		auto y1 = weighted_sum(_mm_unpacklo_epi8(px1,zero),_mm_unpackhi_epi8(px1,zero),w.y);
+		y0 = _mm_srai_epi32(_mm_add_epi32(y0,w.yBias),color::COEFFICIENT_PRECISION);
+		y1 = _mm_srai_epi32(_mm_add_epi32(y1,w.yBias),color::COEFFICIENT_PRECISION);
+		auto y = _mm_packs_epi32(y0,y1);
+		return _mm_packus_epi16(y,y);
+	}
+
+	// Converts the 2x2 blocks of 8x2 pixels (given as 16-bit sums of both rows) to 4 chroma values
+	__m128i calc_chroma(const __m128i (&rowSums)[4],__m128i weights,__m128i bias)
+	{
+		auto c0 = weighted_sum(rowSums[0],rowSums[1],weights);
+		auto c1 = weighted_sum(rowSums[2],rowSums[3],weights);
+		auto c = _mm_hadd_epi32(c0,c1);
+		return _mm_srai_epi32(_mm_add_epi32(c,bias),color::COEFFICIENT_PRECISION +2);
+	}
+};
+
+void color::convert_rgba_to_yuv420_sse41(
+	const uint8_t *src,int srcLineSize,const ConversionTarget &dst,uint32_t width,uint32_t rowStart,uint32_t rowEnd,
+	const ConversionCoefficients &coefficients
+)
+{
+	Weights w {};
+	w.y = make_weights(coefficients.y);
+	w.u = make_weights(coefficients.u);
+	w.v = make_weights(coefficients.v);
+	w.yBias = _mm_set1_epi32(coefficients.yBias);
+	w.uvBias = _mm_set1_epi32(coefficients.uvBias);
+	auto zero = _mm_setzero_si128();
+	auto isNv12 = (dst.layout == YUVLayout::NV12);
+	auto uvStep = isNv12 ? 2u : 1u;
+	constexpr uint32_t pixelsPerIteration = 8;
+	for(auto y=rowStart;y<rowEnd;y+=2)
+	{
+		auto hasSecondRow = (y +1 < rowEnd);
+		auto *src0 = src +static_cast<ptrdiff_t>(y) *srcLineSize;
+		auto *src1 = hasSecondRow ? (src0 +srcLineSize) : src0;
+		auto *dstY0 = dst.data[0] +static_cast<ptrdiff_t>(y) *dst.lineSize[0];
+		auto *dstY1 = hasSecondRow ? (dstY0 +dst.lineSize[0]) : nullptr;
+		auto *dstU = dst.data[1] +static_cast<ptrdiff_t>(y /2) *dst.lineSize[1];
+		auto *dstV = isNv12 ? (dstU +1) : (dst.data[2] +static_cast<ptrdiff_t>(y /2) *dst.lineSize[2]);
+
+		auto x = 0u;
+		for(;x +pixelsPerIteration<=width;x+=pixelsPerIteration)
+		{
+			auto a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 +x *4));
+			auto a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 +x *4 +16));
+			auto b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 +x *4));
+			auto b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 +x *4 +16));
+
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(dstY0 +x),calc_luma(a0,a1,w));
+			if(dstY1)
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(dstY1 +x),calc_luma(b0,b1,w));
+
+			__m128i rowSums[4] = {
+				_mm_add_epi16(_mm_unpacklo_epi8(a0,zero),_mm_unpacklo_epi8(b0,zero)),
+				_mm_add_epi16(_mm_unpackhi_epi8(a0,zero),_mm_unpackhi_epi8(b0,zero)),
+				_mm_add_epi16(_mm_unpacklo_epi8(a1,zero),_mm_unpacklo_epi8(b1,zero)),
+				_mm_add_epi16(_mm_unpackhi_epi8(a1,zero),_mm_unpackhi_epi8(b1,zero))
+			};
+			auto u = calc_chroma(rowSums,w.u,w.uvBias);
+			auto v = calc_chroma(rowSums,w.v,w.uvBias);
+			// u0-u3, v0-v3 as bytes
+			auto uv = _mm_packs_epi32(u,v);
+			uv = _mm_packus_epi16(uv,uv);
+			auto uvOffset = x /2 *uvStep;
+			if(isNv12)
+			{
+				auto interleaved = _mm_unpacklo_epi8(uv,_mm_srli_si128(uv,4));
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(dstU +uvOffset),interleaved);
+			}
+			else
+			{
+				auto packed = _mm_cvtsi128_si32(uv);
+				memcpy(dstU +uvOffset,&packed,sizeof(packed));
+				packed = _mm_extract_epi32(uv,1);
+				memcpy(dstV +uvOffset,&packed,sizeof(packed));
+			}
+		}
+		convert_rgba_to_yuv420_scalar(src0,src1,dstY0,dstY1,dstU,dstV,uvStep,x,width,coefficients);
+	}
+}
+#else
+void media::color::convert_rgba_to_yuv420_sse41(
+	const uint8_t *src,int srcLineSize,const ConversionTarget &dst,uint32_t width,uint32_t rowStart,uint32_t rowEnd,
+	const ConversionCoefficients &coefficients
+)
+{
+	convert_rgba_to_yuv420_scalar(src,srcLineSize,dst,width,rowStart,rowEnd,coefficients);
+}
+#endif
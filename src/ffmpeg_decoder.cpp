@@ -4,298 +4,858 @@
 
 #include "ffmpeg_decoder.hpp"
 #include "util_ffmpeg.hpp"
+#include "util_mapped_file.hpp"
+#include "ffmpeg_video_index.hpp"
+#include "frame_pool.hpp"
+#include "audio_ring_buffer.hpp"
+#include "trace_events.hpp"
 #include <util_image_buffer.hpp>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <cstring>
 extern "C" {
 	#include <libavutil/opt.h>
 	#include <libavcodec/avcodec.h>
 	#include <libavformat/avformat.h>
 	#include <libswresample/swresample.h>
+	#include <libswscale/swscale.h>
 }
 
 using namespace media;
-#pragma optimize("",off)
+
+// Returns no value for matrices ColorMatrix has no equivalent for, e.g. BT.2020
+static std::optional<ColorMatrix> determine_color_matrix(AVColorSpace colorSpace,uint32_t height)
+{
+	switch(colorSpace)
+	{
+		case AVCOL_SPC_BT709:
+			return ColorMatrix::BT709;
+		case AVCOL_SPC_BT470BG:
+		case AVCOL_SPC_SMPTE170M:
+			return ColorMatrix::BT601;
+		case AVCOL_SPC_UNSPECIFIED:
+			// Same guess most players make; HD content is BT.709, SD content BT.601
+			return (height > 576) ? ColorMatrix::BT709 : ColorMatrix::BT601;
+		default:
+			return {};
+	}
+}
+// swscale assumes limited range BT.601 unless told otherwise. Only updates the context if the details have changed,
+// since setting them rebuilds the conversion tables.
+static void update_source_color_details(SwsContext *swsContext,AVColorSpace colorSpace,bool fullRange)
+{
+	int *srcTable = nullptr;
+	int *dstTable = nullptr;
+	int srcRange = 0;
+	int dstRange = 0;
+	int brightness = 0;
+	int contrast = 0;
+	int saturation = 0;
+	if(sws_getColorspaceDetails(swsContext,&srcTable,&srcRange,&dstTable,&dstRange,&brightness,&contrast,&saturation) < 0)
+		return;
+	// Accepts AVColorSpace values; Unknown ones fall back to BT.601
+	auto *coefficients = sws_getCoefficients(colorSpace);
+	if(srcRange == (fullRange ? 1 : 0) && memcmp(srcTable,coefficients,sizeof(int) *4) == 0)
+		return;
+	sws_setColorspaceDetails(swsContext,coefficients,fullRange ? 1 : 0,dstTable,dstRange,brightness,contrast,saturation);
+}
+
 FFMpegDecoder::FFMpegDecoder()
+	: m_packet{av_packet_alloc()},m_decodedFrame{av_frame_alloc()}
 {}
-std::shared_ptr<FFMpegDecoder> FFMpegDecoder::Create(VFilePtr f)
+FFMpegDecoder::~FFMpegDecoder()
+{
+	StopDecodeThread();
+	if(m_swsContext)
+		sws_freeContext(m_swsContext);
+	swr_free(&m_swrContext);
+	av_frame_free(&m_decodedAudioFrame);
+	av_frame_free(&m_decodedFrame);
+	av_packet_free(&m_packet);
+}
+std::shared_ptr<FFMpegDecoder> FFMpegDecoder::Create(VFilePtr f,const VideoPlayer::DecodingSettings &settings)
+{
+	auto decoder = std::shared_ptr<FFMpegDecoder>{new FFMpegDecoder{}};
+	decoder->Initialize(std::make_unique<AVFileIOFSys>(f),settings);
+	if(decoder->m_asyncDecoding)
+		decoder->StartDecodeThread();
+	return decoder;
+}
+std::shared_ptr<FFMpegDecoder> FFMpegDecoder::Create(const std::string &localFileName,const VideoPlayer::DecodingSettings &settings)
+{
+	auto mappedFile = MappedFile::Open(localFileName);
+	if(mappedFile == nullptr)
+		return nullptr;
+	std::shared_ptr<const VideoIndex> index = nullptr;
+	std::string sidecarFileName;
+	if(settings.indexMode != VideoPlayer::IndexMode::None)
+	{
+		if(settings.indexMode == VideoPlayer::IndexMode::Sidecar)
+			sidecarFileName = settings.indexFileName.empty() ? (localFileName +".vidx") : settings.indexFileName;
+		index = VideoIndex::Find(localFileName,sidecarFileName);
+	}
+	auto decoder = std::shared_ptr<FFMpegDecoder>{new FFMpegDecoder{}};
+	decoder->Initialize(std::make_unique<AVFileIOMapped>(mappedFile,settings.readAheadSize),settings,index);
+	if(settings.indexMode != VideoPlayer::IndexMode::None && decoder->m_index == nullptr && decoder->m_videoCodecContext)
+	{
+		auto newIndex = VideoIndex::Build(decoder->m_formatContext.raw(),decoder->m_videoInputStream.index());
+		if(newIndex)
+		{
+			VideoIndex::Store(localFileName,sidecarFileName,newIndex);
+			decoder->m_index = newIndex;
+		}
+	}
+	if(decoder->m_asyncDecoding)
+		decoder->StartDecodeThread();
+	return decoder;
+}
+bool FFMpegDecoder::ApplyIndex()
+{
+	auto *formatContext = m_formatContext.raw();
+	auto hasVideoStream = false;
+	for(auto i=decltype(formatContext->nb_streams){0u};i<formatContext->nb_streams;++i)
+	{
+		auto &stream = *formatContext->streams[i];
+		auto &codecPar = *stream.codecpar;
+		if(static_cast<int>(i) == m_index->GetStreamParameters().streamIndex)
+		{
+			if(m_index->ApplyStreamParameters(stream) == false)
+				return false;
+			hasVideoStream = true;
+			continue;
+		}
+		if(codecPar.codec_type == AVMEDIA_TYPE_AUDIO && (codecPar.codec_id == AV_CODEC_ID_NONE || codecPar.sample_rate <= 0))
+			return false;
+	}
+	return hasVideoStream;
+}
+void FFMpegDecoder::Initialize(std::unique_ptr<av::CustomIO> fileIo,const VideoPlayer::DecodingSettings &settings,const std::shared_ptr<const VideoIndex> &index)
 {
 	av::init();
 	//av::set_logging_level(AV_LOG_DEBUG);
 
-	auto decoder = std::shared_ptr<FFMpegDecoder>{new FFMpegDecoder{}};
-
 	/* set end of buffer to 0 (this ensures that no overreading happens for damaged MPEG streams) */
-	std::fill(decoder->m_buffer.begin() +(decoder->m_buffer.size() -AV_INPUT_BUFFER_PADDING_SIZE),decoder->m_buffer.end(),0);
+	std::fill(m_buffer.begin() +(m_buffer.size() -AV_INPUT_BUFFER_PADDING_SIZE),m_buffer.end(),0);
 
 	std::error_code errCode;
-	decoder->m_fileIo = std::make_unique<AVFileIOFSys>(f);
-	decoder->m_formatContext.openInput(decoder->m_fileIo.get(),av::InputFormat{},errCode);
+	m_fileIo = std::move(fileIo);
+	if(settings.avioBufferSize > 0)
+		m_formatContext.openInput(m_fileIo.get(),av::InputFormat{},errCode,settings.avioBufferSize);
+	else
+		m_formatContext.openInput(m_fileIo.get(),av::InputFormat{},errCode);
 	check_error(errCode);
 
-	decoder->m_formatContext.findStreamInfo(errCode);
-	check_error(errCode);
+	m_index = index;
+	if(m_index == nullptr || ApplyIndex() == false)
+	{
+		m_formatContext.findStreamInfo(errCode);
+		check_error(errCode);
+		// The index doesn't match the file, it has to be rebuilt
+		if(m_index)
+		{
+			auto *formatContext = m_formatContext.raw();
+			auto streamIndex = m_index->GetStreamParameters().streamIndex;
+			if(streamIndex < 0 || streamIndex >= static_cast<int>(formatContext->nb_streams) || m_index->ApplyStreamParameters(*formatContext->streams[streamIndex]) == false)
+				m_index = nullptr;
+		}
+	}
 
 	std::optional<av::Stream> videoStream {};
 	av::Codec videoCodec;
 	std::optional<av::Stream> audioStream {};
 	av::Codec audioCodec;
-	auto numStreams = decoder->m_formatContext.streamsCount();
+	auto numStreams = m_formatContext.streamsCount();
 	for(auto i=decltype(numStreams){0};i<numStreams;++i)
 	{
-		auto stream = decoder->m_formatContext.stream(i);
+		auto stream = m_formatContext.stream(i);
 		if(stream.isVideo())
 		{
 			videoStream = stream;
-			videoCodec = av::findDecodingCodec(decoder->m_formatContext.raw()->streams[i]->codec->codec_id);
+			videoCodec = av::findDecodingCodec(m_formatContext.raw()->streams[i]->codecpar->codec_id);
 		}
 		else if(stream.isAudio())
 		{
 			audioStream = stream;
-			audioCodec = av::findDecodingCodec(decoder->m_formatContext.raw()->streams[i]->codec->codec_id);
+			audioCodec = av::findDecodingCodec(m_formatContext.raw()->streams[i]->codecpar->codec_id);
 		}
 	}
 
 	if(videoStream)
 	{
-		decoder->m_videoInputStream = *videoStream;
-		decoder->m_videoCodecContext = std::make_unique<av::VideoDecoderContext>(decoder->m_videoInputStream);
-		decoder->m_videoCodecContext->open(videoCodec,errCode);
+		m_videoInputStream = *videoStream;
+		m_videoCodecContext = std::make_unique<av::VideoDecoderContext>(m_videoInputStream);
+		auto *rawDecoder = m_videoCodecContext->raw();
+		rawDecoder->thread_count = CalcCodecThreadCount(settings.codecThreading);
+		rawDecoder->thread_type = to_av_thread_type(settings.codecThreading.threadType);
+		m_videoCodecContext->open(videoCodec,errCode);
 		check_error(errCode);
+		m_outputWidth = settings.outputWidth;
+		m_outputHeight = settings.outputHeight;
+		m_outputFormat = settings.outputFormat;
+		switch(settings.scalingAlgorithm)
+		{
+			case VideoPlayer::ScalingAlgorithm::FastBilinear:
+				m_scalerFlags = SWS_FAST_BILINEAR;
+				break;
+			case VideoPlayer::ScalingAlgorithm::Bilinear:
+				m_scalerFlags = SWS_BILINEAR;
+				break;
+			case VideoPlayer::ScalingAlgorithm::Area:
+				m_scalerFlags = SWS_AREA;
+				break;
+			case VideoPlayer::ScalingAlgorithm::Lanczos:
+				m_scalerFlags = SWS_LANCZOS;
+				break;
+			default:
+				m_scalerFlags = SWS_BICUBIC;
+				break;
+		}
+		auto [width,height] = CalcOutputSize(m_videoCodecContext->raw()->width,m_videoCodecContext->raw()->height);
+		m_width = width;
+		m_height = height;
+		// Updated by every decoded frame
+		m_colorMatrix = determine_color_matrix(rawDecoder->colorspace,rawDecoder->height);
+
+		if(settings.asyncDecoding)
+		{
+			m_asyncDecoding = true;
+			m_frameRing.resize(std::max(settings.decodeAheadFrameCount,1u));
+		}
+		// By default there are enough frames for a full ring, plus one frame held by the caller and one being decoded
+		auto framePoolSize = (settings.framePoolSize > 0) ? settings.framePoolSize : (static_cast<uint32_t>(m_frameRing.size()) +2);
+		// In synchronous mode the thread which would have to wait for a frame to be released is the one holding it
+		auto framePoolGrowable = (settings.framePoolPolicy == VideoPlayer::FramePoolPolicy::Grow || m_asyncDecoding == false);
+		m_framePool = FramePool::Create(width,height,uimg::ImageBuffer::Format::RGBA8,framePoolSize,framePoolGrowable);
 	}
 
 	if(audioStream)
 	{
-		decoder->m_audioInputStream = *audioStream;
-		decoder->m_audioCodecContest = std::make_unique<av::AudioDecoderContext>(decoder->m_audioInputStream);
-		decoder->m_audioCodecContest->open(audioCodec,errCode);
+		m_audioInputStream = *audioStream;
+		m_audioCodecContest = std::make_unique<av::AudioDecoderContext>(m_audioInputStream);
+		m_audioCodecContest->open(audioCodec,errCode);
 		check_error(errCode);
+		if(settings.decodeAudio)
+			InitializeAudio(settings);
 	}
-	return decoder;
-}
-static int64_t FrameToPts(AVStream* pavStream, int frame)
-{
-	return (int64_t(frame) * pavStream->r_frame_rate.den *  pavStream->time_base.den) / 
-		(int64_t(pavStream->r_frame_rate.num) * 
-			pavStream->time_base.num);
 }
-bool seekFrame(AVFormatContext *_format_ctx,AVCodecContext *_codec_ctx,AVStream* _video_stream,int FrameIndex)
+void FFMpegDecoder::InitializeAudio(const VideoPlayer::DecodingSettings &settings)
 {
-	// Seek is done on packet dts
-	int64_t target_dts_usecs = (int64_t)round(FrameIndex * (double)_video_stream->r_frame_rate.den / _video_stream->r_frame_rate.num * AV_TIME_BASE);
-	// Remove first dts: when non zero seek should be more accurate
-	auto first_dts_usecs = (int64_t)round(_video_stream->first_dts * (double)_video_stream->time_base.num / _video_stream->time_base.den * AV_TIME_BASE);
-	target_dts_usecs += first_dts_usecs;
-	int rv = av_seek_frame(_format_ctx, -1, target_dts_usecs, AVSEEK_FLAG_BACKWARD);
-	if (rv < 0)
-		return false;
-		;//throw exception();
-
-	avcodec_flush_buffers(_codec_ctx);
-	return true;
-}
-#if 0
-void AV_seek(AV * av, size_t frame)
-{
-	int frame_delta = frame - av->frame_id;
-	if (frame_delta < 0 || frame_delta > 5)
-		av_seek_frame(av->fmt_ctx, av->video_stream_id,
-			frame, AVSEEK_FLAG_BACKWARD);
-	while (av->frame_id != frame)
-		AV_read_frame(av);
-}
+	auto *codecContext = m_audioCodecContest->raw();
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57,28,100)
+	auto srcChannelCount = static_cast<uint32_t>(codecContext->ch_layout.nb_channels);
+#else
+	auto srcChannelCount = static_cast<uint32_t>(codecContext->channels);
+#endif
+	m_audioFormat.sampleFormat = settings.audioSampleFormat;
+	m_audioFormat.sampleRate = (settings.audioSampleRate > 0) ? settings.audioSampleRate : static_cast<uint32_t>(std::max(codecContext->sample_rate,0));
+	m_audioFormat.channelCount = (settings.audioChannelCount > 0) ? settings.audioChannelCount : srcChannelCount;
+	if(m_audioFormat.sampleRate == 0 || m_audioFormat.channelCount == 0 || srcChannelCount == 0)
+		throw RuntimeError{"Audio stream has an invalid sample rate or channel layout"};
+	auto dstSampleFormat = (m_audioFormat.sampleFormat == VideoPlayer::AudioSampleFormat::Int16) ? AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_FLT;
+
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57,28,100)
+	AVChannelLayout srcLayout {};
+	if(codecContext->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC)
+		av_channel_layout_default(&srcLayout,srcChannelCount);
+	else
+		av_channel_layout_copy(&srcLayout,&codecContext->ch_layout);
+	AVChannelLayout dstLayout {};
+	av_channel_layout_default(&dstLayout,m_audioFormat.channelCount);
+	auto result = swr_alloc_set_opts2(
+		&m_swrContext,&dstLayout,dstSampleFormat,m_audioFormat.sampleRate,
+		&srcLayout,codecContext->sample_fmt,codecContext->sample_rate,0,nullptr
+	);
+	av_channel_layout_uninit(&srcLayout);
+	av_channel_layout_uninit(&dstLayout);
+	check_error(make_ffmpeg_error(result));
+#else
+	auto srcLayout = (codecContext->channel_layout != 0) ? codecContext->channel_layout : av_get_default_channel_layout(srcChannelCount);
+	m_swrContext = swr_alloc_set_opts(
+		nullptr,av_get_default_channel_layout(m_audioFormat.channelCount),dstSampleFormat,m_audioFormat.sampleRate,
+		srcLayout,codecContext->sample_fmt,codecContext->sample_rate,0,nullptr
+	);
 #endif
-#if 0
-static void decode_test(AVCodecContext *dec_ctx, AVFrame *frame, AVPacket *pkt,
-	const char *filename)
+	if(m_swrContext == nullptr)
+		throw RuntimeError{"Failed to create audio resampler"};
+	check_error(make_ffmpeg_error(swr_init(m_swrContext)));
+
+	m_decodedAudioFrame = av_frame_alloc();
+	auto frameSize = m_audioFormat.channelCount *static_cast<uint32_t>(av_get_bytes_per_sample(dstSampleFormat));
+	auto capacity = std::max<uint64_t>(static_cast<uint64_t>(m_audioFormat.sampleRate) *settings.audioBufferDuration /1'000,1);
+	m_audioRing = std::make_unique<AudioRingBuffer>(static_cast<uint32_t>(std::min<uint64_t>(capacity,std::numeric_limits<uint32_t>::max())),frameSize);
+}
+uint32_t FFMpegDecoder::CalcCodecThreadCount(const CodecThreadingSettings &threading)
 {
-	char buf[1024];
-	int ret;
-
-	ret = avcodec_send_packet(dec_ctx, pkt);
-	if (ret < 0) {
-		fprintf(stderr, "Error sending a packet for decoding\n");
-		exit(1);
-	}
-
-	while (ret >= 0) {
-		ret = avcodec_receive_frame(dec_ctx, frame);
-		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-			return;
-		else if (ret < 0) {
-			fprintf(stderr, "Error during decoding\n");
-			exit(1);
-		}
-
-		printf("saving frame %3d\n", dec_ctx->frame_number);
-		fflush(stdout);
-
-		/* the picture is allocated by the decoder. no need to
-		free it */
-		snprintf(buf, sizeof(buf), "%s-%d", filename, dec_ctx->frame_number);
-		//pgm_save(frame->data[0], frame->linesize[0],
-		//	frame->width, frame->height, buf);
-	}
+	if(threading.threadCount > 0)
+		return threading.threadCount;
+	// Beyond 16 threads FFmpeg's decoders don't scale anymore, and frame threading adds a frame of latency per thread
+	auto numCores = std::max(std::thread::hardware_concurrency(),1u);
+	auto threadCount = (numCores > threading.reservedCoreCount) ? (numCores -threading.reservedCoreCount) : 1u;
+	return std::clamp(threadCount,1u,16u);
 }
-#endif
-
+std::optional<ColorMatrix> FFMpegDecoder::GetColorMatrix() const {return m_colorMatrix.load(std::memory_order_relaxed);}
+uint32_t FFMpegDecoder::GetCodecThreadCount() const {return m_videoCodecContext ? m_videoCodecContext->raw()->thread_count : 0;}
 double FFMpegDecoder::GetVideoFrameRate() const {return m_videoInputStream.frameRate().getDouble();}
 double FFMpegDecoder::GetAudioFrameRate() const {return m_audioInputStream.frameRate().getDouble();}
 double FFMpegDecoder::GetAspectRatio() const {return (m_width > 0 && m_height > 0) ? (m_width /static_cast<double>(m_height)) : 1.0;}
 uint32_t FFMpegDecoder::GetWidth() const {return m_width;}
 uint32_t FFMpegDecoder::GetHeight() const {return m_height;}
 
-std::shared_ptr<uimg::ImageBuffer> FFMpegDecoder::ReadFrame(double &outPts)
+bool FFMpegDecoder::DecodeNextVideoFrame()
 {
-	//m_formatContext.seek({20,{1,1}});
-	/*if(stream_index>=0){
-		seek_target= av_rescale_q(seek_target, AV_TIME_BASE_Q,
-			pFormatCtx->streams[stream_index]->time_base);
-	}
-	if(av_seek_frame(is->pFormatCtx, stream_index, 
-		seek_target, is->seek_flags) < 0) {
-		fprintf(stderr, "%s: error while seeking\n",
-			is->pFormatCtx->filename);
-	} else {*/
+	auto *codecContext = m_videoCodecContext->raw();
+	for(;;)
 	{
-		//this->m_videoCodecContext->raw(
-		//auto frameIndex = 1000000;
-		//seekFrame(m_formatContext.raw(),m_videoCodecContext->raw(),m_videoInputStream.raw(),frameIndex);
-		//auto iSeekTarget = FrameToPts(m_videoInputStream.raw(),frameIndex);
-		//auto iSuccess = av_seek_frame(m_formatContext.raw(), m_videoInputStream.index(), 
-		//	iSeekTarget, AVSEEK_FLAG_FRAME);
-
-		//AVPacket avPacket;
-		//iRet = av_read_frame(m_pAVFmtCtx, &avPacket);
-	}
-	//av_seek_frame(m_formatContext.raw(),m_videoInputStream.index(),100,AVSEEK_FLAG_FRAME);
-	//m_formatContext.seek({20,{1,1}});
-
-	// ???????
-	//int64_t seek_to = 100;
-	//av_seek_frame(m_formatContext.raw(),m_videoInputStream.raw()->index,seek_to *m_videoInputStream.raw()->time_base.den / m_videoInputStream.raw()->time_base.num ,AVSEEK_FLAG_ANY);
-
-	//avcodec_flush_buffers(m_videoCodecContext->raw());
-
-	auto *frameT = av_frame_alloc();
-	auto *pkt = av_packet_alloc();
-	//decode_test(m_videoCodecContext->raw(),frameT,pkt,"");
-
-
-#if 0
-	std::error_code ec;
-	while (av::Packet pkt = m_formatContext.readPacket(ec)) {
-		if (ec) {
-			std::cout << "Packet reading error: " << ec << ", " << ec.message() << std::endl;
-			return nullptr;
+		// Frames which are already buffered in the decoder have to be received before more packets can be sent
+		auto result = avcodec_receive_frame(codecContext,m_decodedFrame);
+		if(result == 0)
+		{
+			if(m_restampState != RestampState::Off)
+				RestampDecodedFrame();
+			return true;
 		}
-
-		if (pkt.streamIndex() != m_videoInputStream.index()) {
-			continue;
+		if(result == AVERROR_EOF)
+			return false;
+		if(result != AVERROR(EAGAIN))
+			check_error(make_ffmpeg_error(result));
+		if(m_isDraining)
+			return false;
+
+		if(m_hasPendingPacket == false)
+		{
+			result = av_read_frame(m_formatContext.raw(),m_packet);
+			if(result == AVERROR_EOF)
+			{
+				// Flush the frames which are still held back by the decoder
+				m_isDraining = true;
+				check_error(make_ffmpeg_error(avcodec_send_packet(codecContext,nullptr)));
+				if(m_audioRing)
+					DecodeAudioPacket(nullptr);
+				continue;
+			}
+			if(result < 0)
+				check_error(make_ffmpeg_error(result));
+			if(m_packet->stream_index != m_videoInputStream.index())
+			{
+				// Audio is decoded in the same pass, so the file only has to be demuxed once for both streams
+				if(m_audioRing && m_packet->stream_index == m_audioInputStream.index())
+					DecodeAudioPacket(m_packet);
+				av_packet_unref(m_packet);
+				continue;
+			}
+			m_hasPendingPacket = true;
 		}
+		// If the decoder can't take the packet yet, its output has to be received first; The packet is sent again afterwards
+		result = avcodec_send_packet(codecContext,m_packet);
+		if(result == AVERROR(EAGAIN))
+			continue;
+		m_hasPendingPacket = false;
+		av_packet_unref(m_packet);
+		if(result < 0)
+			check_error(make_ffmpeg_error(result));
+	}
+	return false;
+}
 
-		auto ts = pkt.ts();
-		std::cout << "Read packet: " << ts << " / " << ts.seconds() << " / " << pkt.timeBase() << " / st: " << pkt.streamIndex() << std::endl;
-
-		av::VideoFrame frame = m_videoCodecContext->decode(pkt, ec);
+void FFMpegDecoder::DecodeAudioPacket(const AVPacket *packet)
+{
+	// Broken audio packets are skipped; They shouldn't interrupt the video
+	auto *codecContext = m_audioCodecContest->raw();
+	if(avcodec_send_packet(codecContext,packet) < 0)
+		return;
+	while(avcodec_receive_frame(codecContext,m_decodedAudioFrame) == 0)
+	{
+		WriteAudioFrame();
+		av_frame_unref(m_decodedAudioFrame);
+	}
+	// End of stream; The samples still buffered in the resampler are flushed as well
+	if(packet == nullptr)
+		WriteAudioFrame();
+}
+void FFMpegDecoder::WriteAudioFrame()
+{
+	// Called with an empty frame to flush the resampler
+	auto *frame = (m_decodedAudioFrame->nb_samples > 0) ? m_decodedAudioFrame : nullptr;
+	auto sampleRate = static_cast<double>(m_audioFormat.sampleRate);
+	auto delay = swr_get_delay(m_swrContext,m_audioFormat.sampleRate);
+	auto maxFrameCount = swr_get_out_samples(m_swrContext,frame ? frame->nb_samples : 0);
+	if(maxFrameCount <= 0)
+		return;
+	// The buffer grows to the size of the largest frame once and is reused afterwards
+	auto frameSize = m_audioRing->GetFrameSize();
+	auto requiredSize = static_cast<size_t>(maxFrameCount) *frameSize;
+	if(m_resampleBuffer.size() < requiredSize)
+		m_resampleBuffer.resize(requiredSize);
+	auto *dstData = m_resampleBuffer.data();
+	auto frameCount = swr_convert(
+		m_swrContext,&dstData,maxFrameCount,
+		frame ? const_cast<const uint8_t**>(frame->extended_data) : nullptr,frame ? frame->nb_samples : 0
+	);
+	if(frameCount <= 0)
+		return;
+
+	// The first converted sample frame is the one which was delayed the longest by the resampler
+	auto time = m_nextAudioTime;
+	if(frame && frame->best_effort_timestamp != AV_NOPTS_VALUE)
+		time = frame->best_effort_timestamp *av_q2d(m_audioInputStream.raw()->time_base) -delay /sampleRate;
+	m_nextAudioTime = time +frameCount /sampleRate;
+
+	uint32_t skipFrameCount = 0;
+	if(m_audioSeekTarget.has_value())
+	{
+		if(m_nextAudioTime <= *m_audioSeekTarget)
+			return;
+		skipFrameCount = std::min(static_cast<uint32_t>(std::max(std::round((*m_audioSeekTarget -time) *sampleRate),0.0)),static_cast<uint32_t>(frameCount));
+		m_audioSeekTarget = {};
+	}
+	auto writeFrameCount = static_cast<uint32_t>(frameCount) -skipFrameCount;
+	if(m_isAudioTimeBaseValid == false)
+	{
+		m_audioTimeBase = time +skipFrameCount /sampleRate;
+		m_audioTimeBaseIndex = m_audioRing->GetWriteIndex();
+		m_isAudioTimeBaseValid = true;
+	}
+	auto numWritten = m_audioRing->Write(dstData +static_cast<size_t>(skipFrameCount) *frameSize,writeFrameCount);
+	m_audioFramesDecoded.fetch_add(writeFrameCount,std::memory_order_relaxed);
+	if(numWritten < writeFrameCount)
+	{
+		// The reader isn't keeping up; The remaining samples are dropped, and the timeline is re-anchored at the next write
+		m_audioFramesDropped.fetch_add(writeFrameCount -numWritten,std::memory_order_relaxed);
+		m_isAudioTimeBaseValid = false;
+	}
+}
+void FFMpegDecoder::FlushAudio(double targetTime)
+{
+	if(m_audioRing == nullptr)
+		return;
+	avcodec_flush_buffers(m_audioCodecContest->raw());
+	// Re-initializing the resampler discards the samples it is still holding back
+	swr_init(m_swrContext);
+	m_audioRing->Flush();
+	m_audioSeekTarget = targetTime;
+	m_nextAudioTime = targetTime;
+	m_audioTimeBase = targetTime;
+	m_audioTimeBaseIndex = m_audioRing->GetWriteIndex();
+	m_isAudioTimeBaseValid = false;
+}
 
-		//count++;
-		//if (count > 100)
-		//    break;
+bool FFMpegDecoder::HasAudio() const {return m_audioRing != nullptr;}
+VideoPlayer::AudioFormat FFMpegDecoder::GetAudioFormat() const {return m_audioFormat;}
+uint32_t FFMpegDecoder::ReadAudio(void *outData,uint32_t frameCount)
+{
+	if(m_audioRing == nullptr)
+		return 0;
+	auto numRead = m_audioRing->Read(static_cast<uint8_t*>(outData),frameCount);
+	m_audioFramesRead.fetch_add(numRead,std::memory_order_relaxed);
+	return numRead;
+}
+double FFMpegDecoder::GetAudioTime() const
+{
+	if(m_audioRing == nullptr)
+		return 0.0;
+	// May be off briefly while a seek is in progress
+	auto offset = static_cast<int64_t>(m_audioRing->GetReadIndex() -m_audioTimeBaseIndex.load(std::memory_order_relaxed));
+	return m_audioTimeBase.load(std::memory_order_relaxed) +offset /static_cast<double>(m_audioFormat.sampleRate);
+}
+VideoPlayer::AudioStatistics FFMpegDecoder::GetAudioStatistics() const
+{
+	VideoPlayer::AudioStatistics stats {};
+	if(m_audioRing == nullptr)
+		return stats;
+	stats.framesDecoded = m_audioFramesDecoded.load(std::memory_order_relaxed);
+	stats.framesRead = m_audioFramesRead.load(std::memory_order_relaxed);
+	stats.droppedFrameCount = m_audioFramesDropped.load(std::memory_order_relaxed);
+	stats.bufferedFrameCount = m_audioRing->GetAvailableFrameCount();
+	stats.capacity = m_audioRing->GetCapacity();
+	return stats;
+}
 
-		if (ec) {
-			std::cerr << "Error: " << ec << ", " << ec.message() << std::endl;
-			return nullptr;
-		} else if (!frame) {
-			std::cerr << "Empty frame\n";
-			//continue;
+bool FFMpegDecoder::Seek(double seconds)
+{
+	if(m_videoCodecContext == nullptr)
+		return false;
+	// Same timeline as the timestamps returned by ReadFrame
+	return SeekToPts(static_cast<int64_t>(std::round(seconds /av_q2d(m_videoInputStream.raw()->time_base))));
+}
+bool FFMpegDecoder::SeekToFrame(uint64_t frameIndex)
+{
+	if(m_videoCodecContext == nullptr)
+		return false;
+	auto *stream = m_videoInputStream.raw();
+	auto frameRate = (stream->avg_frame_rate.num > 0) ? stream->avg_frame_rate : stream->r_frame_rate;
+	if(frameRate.num <= 0 || frameRate.den <= 0)
+		return false;
+	auto startTime = (stream->start_time != AV_NOPTS_VALUE) ? stream->start_time : 0;
+	return SeekToPts(startTime +av_rescale_q(frameIndex,AVRational{frameRate.den,frameRate.num},stream->time_base));
+}
+bool FFMpegDecoder::SeekToPts(int64_t pts)
+{
+	// The decode thread has to be stopped while the demuxer is repositioned; It restarts with an empty ring
+	auto isDecodeThreadActive = m_decodeThread.joinable();
+	StopDecodeThread();
+	auto result = SeekDemuxerToPts(pts);
+	if(isDecodeThreadActive)
+		StartDecodeThread();
+	return result;
+}
+bool FFMpegDecoder::SeekDemuxerToPts(int64_t pts)
+{
+	// Jumps to the closest keyframe before the target; The frames between the keyframe
+	// and the target are decoded by ReadFrame, but not converted
+	auto *formatContext = m_formatContext.raw();
+	auto result = -1;
+	auto isByteSeek = false;
+	auto *keyframe = m_index ? m_index->FindKeyframe(pts) : nullptr;
+	if(keyframe)
+	{
+		// Jumping to the byte offset of the keyframe lands exactly on it, unlike the timestamp search of the demuxer.
+		// The timestamps of the packets which follow may not be usable anymore though, see RestampDecodedFrame.
+		if(keyframe->position >= 0 && (formatContext->iformat->flags &AVFMT_NO_BYTE_SEEK) == 0)
+		{
+			result = av_seek_frame(formatContext,m_videoInputStream.index(),keyframe->position,AVSEEK_FLAG_BYTE);
+			isByteSeek = (result >= 0);
 		}
-
-		ts = frame.pts();
-
-		std::cout << "  Frame: " << frame.width() << "x" << frame.height() << ", size=" << frame.size() << ", ts=" << ts << ", tm: " << ts.seconds() << ", tb: " << frame.timeBase() << ", ref=" << frame.isReferenced() << ":" << frame.refCount() << std::endl;
-
+		if(result < 0)
+			result = av_seek_frame(formatContext,m_videoInputStream.index(),keyframe->pts,AVSEEK_FLAG_BACKWARD);
+	}
+	else
+		result = av_seek_frame(formatContext,m_videoInputStream.index(),pts,AVSEEK_FLAG_BACKWARD);
+	if(result < 0)
+		return false;
+	m_restampState = isByteSeek ? RestampState::Pending : RestampState::Off;
+	if(isByteSeek)
+	{
+		auto *stream = m_videoInputStream.raw();
+		auto startTime = (stream->start_time != AV_NOPTS_VALUE) ? stream->start_time : 0;
+		m_restampBasePts = (keyframe->pts != AV_NOPTS_VALUE) ? keyframe->pts : (startTime +static_cast<int64_t>(keyframe->frameIndex) *GetFrameDuration());
+		m_restampFrameCount = 0;
+	}
+	avcodec_flush_buffers(m_videoCodecContext->raw());
+	if(m_hasPendingPacket)
+	{
+		av_packet_unref(m_packet);
+		m_hasPendingPacket = false;
 	}
+	m_isDraining = false;
+	m_seekTargetPts = pts;
+	FlushAudio(pts *av_q2d(m_videoInputStream.raw()->time_base));
+	return true;
+}
+bool FFMpegDecoder::IsBeforeSeekTarget() const
+{
+	auto pts = m_decodedFrame->best_effort_timestamp;
+	if(pts == AV_NOPTS_VALUE)
+		return false;
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57,30,100)
+	auto duration = m_decodedFrame->duration;
+#else
+	auto duration = m_decodedFrame->pkt_duration;
 #endif
-
-
-
-
-
-	auto isFrameComplete = false;
-	av::VideoFrame frame;
-	auto t = std::chrono::high_resolution_clock::now();
-	while(isFrameComplete == false)
+	if(duration <= 0)
+		duration = GetFrameDuration();
+	// The target frame is the one which is being displayed at the target time
+	return pts +duration <= *m_seekTargetPts;
+}
+int64_t FFMpegDecoder::GetFrameDuration() const
+{
+	auto *stream = m_videoInputStream.raw();
+	auto frameRate = (stream->avg_frame_rate.num > 0) ? stream->avg_frame_rate : stream->r_frame_rate;
+	if(frameRate.num <= 0 || frameRate.den <= 0)
+		return 1;
+	return std::max<int64_t>(av_rescale_q(1,AVRational{frameRate.den,frameRate.num},stream->time_base),1);
+}
+void FFMpegDecoder::RestampDecodedFrame()
+{
+	if(m_restampState == RestampState::Pending)
 	{
-		std::error_code errCode;
-		m_packet = m_formatContext.readPacket(errCode);
-		check_error(errCode);
+		// Containers with real timestamps keep them across the jump, in which case they're left alone
+		if(m_decodedFrame->best_effort_timestamp == m_restampBasePts)
+		{
+			m_restampState = RestampState::Off;
+			return;
+		}
+		m_restampState = RestampState::Active;
+	}
+	// Frames are received in presentation order, starting with the keyframe
+	auto pts = m_restampBasePts +static_cast<int64_t>(m_restampFrameCount++) *GetFrameDuration();
+	m_decodedFrame->pts = pts;
+	m_decodedFrame->best_effort_timestamp = pts;
+}
 
-		if(m_packet.streamIndex() != m_videoInputStream.index())
-			return ReadFrame(outPts);
+std::pair<uint32_t,uint32_t> FFMpegDecoder::CalcOutputSize(uint32_t srcWidth,uint32_t srcHeight) const
+{
+	auto width = m_outputWidth;
+	auto height = m_outputHeight;
+	if((width == 0 && height == 0) || srcWidth == 0 || srcHeight == 0)
+		return {srcWidth,srcHeight};
+	if(width == 0)
+		width = std::max(static_cast<uint32_t>(std::round(height *(srcWidth /static_cast<double>(srcHeight)))),1u);
+	else if(height == 0)
+		height = std::max(static_cast<uint32_t>(std::round(width *(srcHeight /static_cast<double>(srcWidth)))),1u);
+	return {width,height};
+}
 
-		frame = m_videoCodecContext->decode(m_packet,errCode);
-		check_error(errCode);
-		isFrameComplete = frame.isComplete();
+bool FFMpegDecoder::DecodeFrame(DecodedFrame &outFrame)
+{
+	for(;;)
+	{
+		if(DecodeNextVideoFrame() == false)
+			return false;
+		if(m_seekTargetPts.has_value())
+		{
+			// Frames before the seek target are discarded without running them through the scaler
+			if(IsBeforeSeekTarget())
+				continue;
+			m_seekTargetPts = {};
+		}
+		break;
 	}
-	auto tDelta = std::chrono::high_resolution_clock::now() -t;
-	//
-	//frame.setTimeBase(encoder.timeBase());
-	auto width = frame.width();
-	auto height = frame.height();
-	if(m_frame == nullptr)
+	auto pts = m_decodedFrame->best_effort_timestamp;
+	outFrame.pts = (pts != AV_NOPTS_VALUE) ? (pts *av_q2d(m_videoInputStream.raw()->time_base)) : 0.0;
+
+	auto width = static_cast<uint32_t>(m_decodedFrame->width);
+	auto height = static_cast<uint32_t>(m_decodedFrame->height);
+	auto srcFormat = static_cast<AVPixelFormat>(m_decodedFrame->format);
+	auto colorSpace = m_decodedFrame->colorspace;
+	auto isFullRange = (m_decodedFrame->color_range == AVCOL_RANGE_JPEG);
+	// Determined here rather than by GetColorMatrix, since the codec context must not be accessed while this thread is decoding
+	auto colorMatrix = determine_color_matrix(colorSpace,height);
+	m_colorMatrix.store(colorMatrix,std::memory_order_relaxed);
+	auto &frameBuffer = outFrame.frameBuffer;
+	if(m_outputFormat == VideoPlayer::OutputFormat::Native)
 	{
-		m_frame = uimg::ImageBuffer::Create(width,height,uimg::ImageBuffer::Format::RGBA8);
-		m_swsContext = sws_getContext(width,height,frame.pixelFormat().get(),width,height,AV_PIX_FMT_RGBA,SWS_BICUBIC,NULL,NULL,NULL);
-		m_width = width;
-		m_height = height;
+		// PixelFormat implies limited range YUV, and the caller can only convert the matrices of ColorMatrix
+		auto format = from_av_pixel_format(srcFormat);
+		auto isYuv = format.has_value() && (*format == PixelFormat::YUV420P || *format == PixelFormat::NV12);
+		if(format.has_value() && (isYuv == false || (isFullRange == false && colorMatrix.has_value())))
+		{
+			// The planes are referenced, not copied; The decoder won't reuse them until the last reference has been released
+			auto frameRef = std::shared_ptr<AVFrame>{av_frame_clone(m_decodedFrame),[](AVFrame *frame) {av_frame_free(&frame);}};
+			if(frameRef == nullptr)
+				throw RuntimeError{"Failed to reference decoded frame"};
+			frameBuffer.format = *format;
+			frameBuffer.width = width;
+			frameBuffer.height = height;
+			for(auto i=decltype(frameBuffer.data.size()){0u};i<frameBuffer.data.size();++i)
+			{
+				frameBuffer.data[i] = frameRef->data[i];
+				frameBuffer.lineSize[i] = frameRef->linesize[i];
+			}
+			frameBuffer.owner = frameRef;
+			outFrame.image = nullptr;
+			m_width = width;
+			m_height = height;
+			return true;
+		}
 	}
-	if(width != m_frame->GetWidth() || height != m_frame->GetHeight())
-		return nullptr;
-	const std::array<uint8_t*,AV_NUM_DATA_POINTERS> srcFrameData = {
-		frame.data(0),
-		frame.data(1),
-		frame.data(2),
-		frame.data(3)
-#if AV_NUM_DATA_POINTERS == 8
-		,
-		frame.data(4),
-		frame.data(5),
-		frame.data(6),
-		frame.data(7)
-#endif
-	};
+
+	// The scaler is rebuilt if the resolution or pixel format changes mid-stream
+	auto [dstWidth,dstHeight] = CalcOutputSize(width,height);
+	m_swsContext = sws_getCachedContext(m_swsContext,width,height,srcFormat,dstWidth,dstHeight,AV_PIX_FMT_RGBA,m_scalerFlags,nullptr,nullptr,nullptr);
+	if(m_swsContext == nullptr)
+		throw RuntimeError{"Failed to create scaler for pixel format " +std::to_string(srcFormat) +" at " +std::to_string(width) +"x" +std::to_string(height)};
+	if(colorSpace == AVCOL_SPC_UNSPECIFIED && colorMatrix.has_value())
+		colorSpace = (*colorMatrix == ColorMatrix::BT709) ? AVCOL_SPC_BT709 : AVCOL_SPC_BT470BG;
+	update_source_color_details(m_swsContext,colorSpace,isFullRange);
+	if(dstWidth != m_framePool->GetWidth() || dstHeight != m_framePool->GetHeight())
+		m_framePool->Resize(dstWidth,dstHeight);
+	m_width = dstWidth;
+	m_height = dstHeight;
+
+	// Only fails if the decode thread is being stopped while waiting for a frame to be released
+	auto image = m_framePool->Acquire();
+	if(image == nullptr)
+		return false;
 	const std::array<uint8_t*,1> dstFrameData = {
-		static_cast<uint8_t*>(m_frame->GetData())
+		static_cast<uint8_t*>(image->GetData())
 	};
 	std::array<int,1> dstLineSize = {
-		m_frame->GetWidth() *m_frame->GetPixelSize()
+		static_cast<int>(image->GetWidth() *image->GetPixelSize())
 	};
+	sws_scale(m_swsContext,m_decodedFrame->data,m_decodedFrame->linesize,0,height,dstFrameData.data(),dstLineSize.data());
+
+	frameBuffer = {};
+	frameBuffer.format = PixelFormat::RGBA8;
+	frameBuffer.width = dstWidth;
+	frameBuffer.height = dstHeight;
+	frameBuffer.data[0] = static_cast<const uint8_t*>(image->GetData());
+	frameBuffer.lineSize[0] = dstLineSize[0];
+	frameBuffer.owner = image;
+	outFrame.image = std::move(image);
+	return true;
+}
+
+bool FFMpegDecoder::ReadFrame(DecodedFrame &outFrame)
+{
+	if(m_videoCodecContext == nullptr)
+		return false;
+	// The frame index is only known once the frame has been read
+	trace::ScopedEvent event {"FFMpegDecoder::ReadFrame","frame",-1};
+	auto traceFrameIndex = [this,&event,&outFrame]() {
+		if(event.IsActive())
+			event.SetArgument(std::llround(outFrame.pts *GetVideoFrameRate()));
+	};
+	if(m_asyncDecoding == false)
+	{
+		if(DecodeFrame(outFrame) == false)
+			return false;
+		traceFrameIndex();
+		return true;
+	}
+	for(;;)
+	{
+		auto result = TryReadFrame(outFrame);
+		if(result == VideoPlayer::ReadResult::Success)
+			traceFrameIndex();
+		if(result != VideoPlayer::ReadResult::NotReady)
+			return result == VideoPlayer::ReadResult::Success;
+		m_waitStrategy.Wait([this]() {return HasReadyFrame() || m_decodeThreadFinished;});
+	}
+	return false;
+}
 
-	auto t2 = std::chrono::high_resolution_clock::now();
-	sws_scale(m_swsContext,srcFrameData.data(),frame.raw()->linesize,0,frame.height(),dstFrameData.data(),dstLineSize.data());
-	auto tDelta2 = std::chrono::high_resolution_clock::now() -t2;
-	std::cout<<"Time passed: "<<(std::chrono::duration_cast<std::chrono::nanoseconds>(tDelta).count() /1'000'000'000.0)<<","<<(std::chrono::duration_cast<std::chrono::nanoseconds>(tDelta2).count() /1'000'000'000.0)<<std::endl;
-
-	//auto ts = m_packet.ts();
-	//std::cout << "Read packet: " << ts << " / " << ts.seconds() << " / " << m_packet.timeBase() << " / st: " << m_packet.streamIndex() << std::endl;
-
-	//ts = frame.pts();
-	//auto frameIndex = frame.raw()->display_picture_number;
-	//std::cout << "  Frame: " << frame.width() << "x" << frame.height() << ", size=" << frame.size() << ", ts=" << ts << ", tm: " << ts.seconds() << ", tb: " << frame.timeBase() << ", ref=" << frame.isReferenced() << ":" << frame.refCount() << std::endl;
-	//auto bestEffortTimestamp = av::frame::get_best_effort_timestamp(frame.raw());
-	//auto time = bestEffortTimestamp /m_audioInputStream.timeBase().getDouble();
-
-	int64_t pts = 0;
-	if(m_packet.raw()->dts != AV_NOPTS_VALUE) {
-		pts = av::frame::get_best_effort_timestamp(frame.raw());
-	} else {
-		pts = 0;
+VideoPlayer::ReadResult FFMpegDecoder::TryReadFrame(DecodedFrame &outFrame)
+{
+	if(m_asyncDecoding == false)
+		return ReadFrame(outFrame) ? VideoPlayer::ReadResult::Success : VideoPlayer::ReadResult::EndOfStream;
+	// Has to be checked before the write index, otherwise the last frames could be missed
+	auto isFinished = m_decodeThreadFinished.load(std::memory_order_acquire);
+	auto readIndex = m_ringReadIndex.load(std::memory_order_relaxed);
+	auto writeIndex = m_ringWriteIndex.load(std::memory_order_acquire);
+	if(readIndex == writeIndex)
+	{
+		if(isFinished == false)
+		{
+			m_underrunCount.fetch_add(1,std::memory_order_relaxed);
+			return VideoPlayer::ReadResult::NotReady;
+		}
+		if(m_decodeException)
+		{
+			// Errors of the decode thread are raised on the thread reading the frames, same as in synchronous mode
+			auto exception = m_decodeException;
+			m_decodeException = nullptr;
+			std::rethrow_exception(exception);
+		}
+		return VideoPlayer::ReadResult::EndOfStream;
+	}
+	// The ring must not keep a reference, otherwise the frame couldn't return to the pool once the caller is done with it
+	outFrame = std::move(m_frameRing.at(readIndex %m_frameRing.size()));
+	m_occupancySum.fetch_add(writeIndex -readIndex,std::memory_order_relaxed);
+	m_framesRead.fetch_add(1,std::memory_order_relaxed);
+	m_ringReadIndex = readIndex +1;
+	m_waitStrategy.Notify();
+	return VideoPlayer::ReadResult::Success;
+}
+
+void FFMpegDecoder::ValidateImageOutput() const
+{
+	if(m_outputFormat != VideoPlayer::OutputFormat::RGBA8)
+		throw LogicError{"Frames can only be read as image buffers with output format RGBA8, use the FrameBuffer overload instead"};
+}
+std::shared_ptr<uimg::ImageBuffer> FFMpegDecoder::ReadFrame(double &outPts)
+{
+	ValidateImageOutput();
+	DecodedFrame frame {};
+	if(ReadFrame(frame) == false)
+		return nullptr;
+	outPts = frame.pts;
+	return frame.image;
+}
+VideoPlayer::ReadResult FFMpegDecoder::TryReadFrame(std::shared_ptr<uimg::ImageBuffer> &outFrame,double &outPts)
+{
+	ValidateImageOutput();
+	DecodedFrame frame {};
+	auto result = TryReadFrame(frame);
+	outFrame = std::move(frame.image);
+	if(result == VideoPlayer::ReadResult::Success)
+		outPts = frame.pts;
+	return result;
+}
+bool FFMpegDecoder::ReadFrame(FrameBuffer &outFrame,double &outPts)
+{
+	DecodedFrame frame {};
+	if(ReadFrame(frame) == false)
+		return false;
+	outFrame = std::move(frame.frameBuffer);
+	outPts = frame.pts;
+	return true;
+}
+VideoPlayer::ReadResult FFMpegDecoder::TryReadFrame(FrameBuffer &outFrame,double &outPts)
+{
+	DecodedFrame frame {};
+	auto result = TryReadFrame(frame);
+	if(result == VideoPlayer::ReadResult::Success)
+	{
+		outFrame = std::move(frame.frameBuffer);
+		outPts = frame.pts;
 	}
-	double test = pts *av_q2d(m_videoInputStream.raw()->time_base);
+	return result;
+}
+
+VideoPlayer::DecodeAheadStatistics FFMpegDecoder::GetDecodeAheadStatistics() const
+{
+	VideoPlayer::DecodeAheadStatistics stats {};
+	if(m_asyncDecoding == false)
+		return stats;
+	stats.capacity = static_cast<uint32_t>(m_frameRing.size());
+	stats.occupancy = static_cast<uint32_t>(m_ringWriteIndex.load(std::memory_order_relaxed) -m_ringReadIndex.load(std::memory_order_relaxed));
+	stats.framesRead = m_framesRead.load(std::memory_order_relaxed);
+	stats.underrunCount = m_underrunCount.load(std::memory_order_relaxed);
+	stats.averageOccupancy = (stats.framesRead > 0) ? (m_occupancySum.load(std::memory_order_relaxed) /static_cast<double>(stats.framesRead)) : 0.0;
+	return stats;
+}
 
-	outPts = test;
+bool FFMpegDecoder::HasReadyFrame() const {return m_ringWriteIndex != m_ringReadIndex;}
+bool FFMpegDecoder::HasFreeSlot() const {return m_ringWriteIndex -m_ringReadIndex < m_frameRing.size();}
 
-	//auto t = pts *av_q2d(m_videoInputStream.raw()->time_base);
-	//outPts = t;
-	return m_frame;
+void FFMpegDecoder::StartDecodeThread()
+{
+	m_ringReadIndex = 0;
+	m_ringWriteIndex = 0;
+	m_decodeThreadFinished = false;
+	m_decodeException = nullptr;
+	for(auto &slot : m_frameRing)
+		slot = {};
+	m_framePool->ResetInterrupt();
+	m_decodeThreadRunning = true;
+	m_decodeThread = std::thread{[this]() {RunDecodeThread();}};
+}
+void FFMpegDecoder::StopDecodeThread()
+{
+	if(m_decodeThread.joinable() == false)
+		return;
+	m_decodeThreadRunning = false;
+	m_waitStrategy.Notify();
+	// The decode thread may be waiting for a frame to be released
+	m_framePool->Interrupt();
+	m_decodeThread.join();
+}
+void FFMpegDecoder::RunDecodeThread()
+{
+	trace::set_thread_name("FFMpegDecoder (decode)");
+	try
+	{
+		for(;;)
+		{
+			m_waitStrategy.Wait([this]() {return HasFreeSlot() || m_decodeThreadRunning == false;});
+			if(m_decodeThreadRunning == false)
+				break;
+			auto writeIndex = m_ringWriteIndex.load(std::memory_order_relaxed);
+			auto &slot = m_frameRing.at(writeIndex %m_frameRing.size());
+			trace::ScopedEvent event {"FFMpegDecoder::DecodeFrame","frame",-1};
+			if(DecodeFrame(slot) == false)
+				break;
+			if(event.IsActive())
+				event.SetArgument(std::llround(slot.pts *GetVideoFrameRate()));
+			m_ringWriteIndex = writeIndex +1;
+			m_waitStrategy.Notify();
+		}
+	}
+	catch(...)
+	{
+		m_decodeException = std::current_exception();
+	}
+	m_decodeThreadFinished = true;
+	m_waitStrategy.Notify();
 }
-#pragma optimize("",on)
@@ -7,6 +7,12 @@
 
 #include <memory>
 #include <array>
+#include <optional>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <utility>
 #include <av.h>
 #include <frame.h>
 #include <format.h>
@@ -14,36 +20,157 @@
 #include <codeccontext.h>
 #include <fsys/filesystem.h>
 #include "util_media.hpp"
+#include "util_video_player.hpp"
+#include "thread_wait_strategy.hpp"
 
 struct SwsContext;
+struct SwrContext;
+struct AVPacket;
+struct AVFrame;
 namespace uimg {class ImageBuffer;};
 namespace media
 {
-	struct AVFileIOFSys;
+	class VideoIndex;
+	class FramePool;
+	class AudioRingBuffer;
 	class FFMpegDecoder
 	{
 	public:
-		static std::shared_ptr<FFMpegDecoder> Create(VFilePtr f);
+		static std::shared_ptr<FFMpegDecoder> Create(VFilePtr f,const VideoPlayer::DecodingSettings &settings);
+		static std::shared_ptr<FFMpegDecoder> Create(const std::string &localFileName,const VideoPlayer::DecodingSettings &settings);
 		std::shared_ptr<uimg::ImageBuffer> ReadFrame(double &outPts);
+		VideoPlayer::ReadResult TryReadFrame(std::shared_ptr<uimg::ImageBuffer> &outFrame,double &outPts);
+		bool ReadFrame(FrameBuffer &outFrame,double &outPts);
+		VideoPlayer::ReadResult TryReadFrame(FrameBuffer &outFrame,double &outPts);
+		VideoPlayer::DecodeAheadStatistics GetDecodeAheadStatistics() const;
+		bool HasAudio() const;
+		VideoPlayer::AudioFormat GetAudioFormat() const;
+		uint32_t ReadAudio(void *outData,uint32_t frameCount);
+		double GetAudioTime() const;
+		VideoPlayer::AudioStatistics GetAudioStatistics() const;
+		bool Seek(double seconds);
+		bool SeekToFrame(uint64_t frameIndex);
 		double GetVideoFrameRate() const;
 		double GetAudioFrameRate() const;
 		double GetAspectRatio() const;
 		uint32_t GetWidth() const;
 		uint32_t GetHeight() const;
+		uint32_t GetCodecThreadCount() const;
+		std::optional<ColorMatrix> GetColorMatrix() const;
+		static uint32_t CalcCodecThreadCount(const CodecThreadingSettings &threading);
+		~FFMpegDecoder();
 	private:
+		struct DecodedFrame
+		{
+			// Views either the image, or the planes of the decoded frame if it is passed through without conversion
+			FrameBuffer frameBuffer {};
+			std::shared_ptr<uimg::ImageBuffer> image = nullptr;
+			double pts = 0.0;
+		};
 		FFMpegDecoder();
+		void Initialize(std::unique_ptr<av::CustomIO> fileIo,const VideoPlayer::DecodingSettings &settings,const std::shared_ptr<const VideoIndex> &index=nullptr);
+		// Returns true if the index and the container headers describe all streams sufficiently, so probing can be skipped
+		bool ApplyIndex();
+		void InitializeAudio(const VideoPlayer::DecodingSettings &settings);
+		// Decodes the packet (or drains the decoder if packet is nullptr) and pushes the resampled frames into the audio ring
+		void DecodeAudioPacket(const AVPacket *packet);
+		void WriteAudioFrame();
+		void FlushAudio(double targetTime);
+		// Decodes into m_decodedFrame; Returns false once the end of the stream has been reached
+		bool DecodeNextVideoFrame();
+		bool SeekToPts(int64_t pts);
+		bool SeekDemuxerToPts(int64_t pts);
+		// Decodes the next frame and converts it into an image from the frame pool, unless it is passed through.
+		// Returns false once the end of the stream has been reached.
+		bool DecodeFrame(DecodedFrame &outFrame);
+		bool ReadFrame(DecodedFrame &outFrame);
+		VideoPlayer::ReadResult TryReadFrame(DecodedFrame &outFrame);
+		void ValidateImageOutput() const;
+		std::pair<uint32_t,uint32_t> CalcOutputSize(uint32_t srcWidth,uint32_t srcHeight) const;
+		bool HasReadyFrame() const;
+		bool HasFreeSlot() const;
+		void StartDecodeThread();
+		void StopDecodeThread();
+		void RunDecodeThread();
+		bool IsBeforeSeekTarget() const;
+		// Nominal duration of a frame in the time base of the video stream
+		int64_t GetFrameDuration() const;
+		void RestampDecodedFrame();
 
-		std::unique_ptr<AVFileIOFSys> m_fileIo = nullptr;
+		std::unique_ptr<av::CustomIO> m_fileIo = nullptr;
 		av::FormatContext m_formatContext = {};
 		av::Stream m_videoInputStream;
 		av::Stream m_audioInputStream;
 
-		uint32_t m_width = 0;
-		uint32_t m_height = 0;
-		AVCodecParserContext *m_parser = nullptr;
-		std::shared_ptr<uimg::ImageBuffer> m_frame = nullptr;
+		std::atomic<uint32_t> m_width = 0;
+		std::atomic<uint32_t> m_height = 0;
+		// Written by the thread decoding the frames, so GetColorMatrix doesn't have to touch the codec context
+		std::atomic<std::optional<ColorMatrix>> m_colorMatrix {};
+		std::shared_ptr<FramePool> m_framePool = nullptr;
+		// Output settings; A width or height of 0 is derived from the aspect ratio of the video
+		uint32_t m_outputWidth = 0;
+		uint32_t m_outputHeight = 0;
+		VideoPlayer::OutputFormat m_outputFormat = VideoPlayer::OutputFormat::RGBA8;
+		int m_scalerFlags = 0;
 		SwsContext *m_swsContext = nullptr;
-		av::Packet m_packet {};
+		// Reused for every packet and frame, so the steady state of the read loop doesn't allocate
+		AVPacket *m_packet = nullptr;
+		AVFrame *m_decodedFrame = nullptr;
+		// Set while m_packet holds a video packet the decoder hasn't accepted yet
+		bool m_hasPendingPacket = false;
+		bool m_isDraining = false;
+		// Set after a seek; Decoded frames before this timestamp are skipped
+		std::optional<int64_t> m_seekTargetPts {};
+		// A byte seek resets the timestamp state of the demuxer; Elementary streams (and some MPEG-PS files) have no
+		// timestamps or start counting from scratch afterwards. If the first decoded frame doesn't carry the timestamp
+		// of the keyframe, the frames are restamped by counting them from the keyframe instead, until the next seek.
+		enum class RestampState : uint8_t
+		{
+			Off = 0,
+			// Waiting for the first frame after a byte seek
+			Pending,
+			Active
+		};
+		RestampState m_restampState = RestampState::Off;
+		int64_t m_restampBasePts = 0;
+		uint64_t m_restampFrameCount = 0;
+		std::shared_ptr<const VideoIndex> m_index = nullptr;
+
+		// Asynchronous decoding: Single-producer single-consumer ring of converted frames. The write index is only
+		// advanced by the decode thread, the read index only by the thread calling ReadFrame/TryReadFrame.
+		bool m_asyncDecoding = false;
+		std::vector<DecodedFrame> m_frameRing;
+		std::atomic<uint64_t> m_ringReadIndex = 0;
+		std::atomic<uint64_t> m_ringWriteIndex = 0;
+		std::thread m_decodeThread;
+		std::atomic<bool> m_decodeThreadRunning = false;
+		// Set once the decode thread has reached the end of the stream or failed
+		std::atomic<bool> m_decodeThreadFinished = false;
+		std::exception_ptr m_decodeException = nullptr;
+		WaitCounters m_waitCounters {};
+		WaitStrategy m_waitStrategy {VideoRecorder::WaitSettings{},m_waitCounters};
+		std::atomic<uint64_t> m_framesRead = 0;
+		std::atomic<uint64_t> m_underrunCount = 0;
+		std::atomic<uint64_t> m_occupancySum = 0;
+
+		// Audio decoding; The decoded samples are resampled to m_audioFormat and pushed into m_audioRing
+		// by whichever thread is demuxing, and drained by the thread calling ReadAudio.
+		VideoPlayer::AudioFormat m_audioFormat {};
+		SwrContext *m_swrContext = nullptr;
+		AVFrame *m_decodedAudioFrame = nullptr;
+		std::vector<uint8_t> m_resampleBuffer;
+		std::unique_ptr<AudioRingBuffer> m_audioRing {};
+		// Set after a seek; Samples before this time are discarded
+		std::optional<double> m_audioSeekTarget {};
+		// Time of the sample frame following the last converted one, used for frames without a timestamp
+		double m_nextAudioTime = 0.0;
+		// The ring is only timestamped at the start and after a seek; The time of any other sample frame follows from its index.
+		bool m_isAudioTimeBaseValid = false;
+		std::atomic<uint64_t> m_audioTimeBaseIndex = 0;
+		std::atomic<double> m_audioTimeBase = 0.0;
+		std::atomic<uint64_t> m_audioFramesDecoded = 0;
+		std::atomic<uint64_t> m_audioFramesRead = 0;
+		std::atomic<uint64_t> m_audioFramesDropped = 0;
 
 		std::unique_ptr<av::VideoDecoderContext> m_videoCodecContext = nullptr;
 		std::unique_ptr<av::AudioDecoderContext> m_audioCodecContest = nullptr;
@@ -5,7 +5,16 @@
 #include "ffmpeg_encoder.hpp"
 #include "ffmpeg_worker_threads.hpp"
 #include "util_ffmpeg.hpp"
+#include "trace_events.hpp"
 #include <avutils.h>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <algorithm>
+extern "C" {
+	#include <libswscale/swscale.h>
+	#include <libavformat/avformat.h>
+}
 
 using namespace media;
 
@@ -20,6 +29,11 @@ std::unique_ptr<FFMpegEncoder> FFMpegEncoder::Create(
 	return encoder;
 }
 
+FFMpegEncoder::FFMpegEncoder()
+	: m_stageCounters{std::make_unique<StageCounters>()}
+{}
+FFMpegEncoder::~FFMpegEncoder() {}
+
 void FFMpegEncoder::Initialize(const std::string &outFileName,const VideoRecorder::EncodingSettings &encodingSettings,const std::shared_ptr<ICustomFile> &fileInterface)
 {
     av::init();
@@ -33,6 +47,10 @@ void FFMpegEncoder::Initialize(const std::string &outFileName,const VideoRecorde
 	
 	m_formatContext.setFormat(outputFormat);
 
+	m_frameRateMode = encodingSettings.frameRateMode;
+	if(m_frameRateMode == VideoRecorder::FrameRateMode::Variable && supports_variable_frame_rate(encodingSettings.format) == false)
+		throw LogicError{"Output format '" +strFormat +"' does not support variable frame rates!"};
+
 	auto strCodec = codec_to_name(encodingSettings.codec);
 	auto avCodec = av::findEncodingCodec(strCodec);
 	if(outputFormat.codecSupported(avCodec) == false)
@@ -42,9 +60,119 @@ void FFMpegEncoder::Initialize(const std::string &outFileName,const VideoRecorde
 	m_outputStream = m_formatContext.addStream(avCodec,errCode);
 	check_error(errCode);
 
+	auto numGopWorkers = std::max(encodingSettings.gopParallelWorkerCount,1u);
+	if(numGopWorkers > 1)
+	{
+		if(supports_gop_parallel_encoding(encodingSettings.codec) == false)
+			throw LogicError{"Codec '" +strCodec +"' does not support GOP-parallel encoding!"};
+		if(encodingSettings.maxBFrames.has_value() && *encodingSettings.maxBFrames > 0)
+			throw LogicError{"B-frames are not supported with GOP-parallel encoding!"};
+		m_gopSize = (encodingSettings.gopParallelChunkSize > 0) ? encodingSettings.gopParallelChunkSize : encodingSettings.frameRate;
+	}
+
 	m_encoder = std::make_unique<av::VideoEncoderContext>(m_outputStream);
 	auto &encoder = *m_encoder;
+	auto dstPixelFormat = ConfigureEncoder(encoder,encodingSettings);
+	m_maxCodecThreadCount = std::max(static_cast<uint32_t>(encoder.raw()->thread_count),IsGopParallel() ? 1u : CalcCodecThreadBudget(encodingSettings));
+	m_nominalFrameDuration = std::max<int64_t>(encoder.timeBase().getDenominator() /static_cast<int32_t>(encodingSettings.frameRate),1);
+    m_outputStream.setFrameRate({static_cast<int32_t>(encodingSettings.frameRate),1});
+    m_outputStream.setTimeBase(encoder.timeBase());
+
+	if(fileInterface == nullptr)
+		m_formatContext.openOutput(outFileName,errCode);
+	else
+	{
+		m_fileIo = std::unique_ptr<AVFileIO>{new AVFileIO{fileInterface,encodingSettings.writeBufferSize}};
+		if(m_fileIo->open(outFileName)	== true)
+		{
+			if(encodingSettings.avioBufferSize > 0)
+				m_formatContext.openOutput(m_fileIo.get(),errCode,encodingSettings.avioBufferSize);
+			else
+				m_formatContext.openOutput(m_fileIo.get(),errCode);
+		}
+		else
+			throw RuntimeError{"Unable to open file '" +outFileName +"'!"};
+	}
+	check_error(errCode);
+    
+    encoder.open(avCodec,errCode);
+	check_error(errCode);
+
+	if(encodingSettings.audio.has_value())
+	{
+		auto &audioSettings = *encodingSettings.audio;
+		auto strAudioCodec = audio_codec_to_name(audioSettings.codec);
+		auto avAudioCodec = av::findEncodingCodec(strAudioCodec);
+		if(outputFormat.codecSupported(avAudioCodec) == false)
+			throw LogicError{"Audio codec '" +strAudioCodec +"' is not supported by output format '" +strFormat +"'!"};
+		if(audioSettings.sampleRate == 0 || audioSettings.channelCount == 0)
+			throw LogicError{"Invalid audio sample rate or channel count!"};
+		m_audioStream = m_formatContext.addStream(avAudioCodec,errCode);
+		check_error(errCode);
+		m_audioEncoder = std::make_unique<av::AudioEncoderContext>(m_audioStream);
+		ConfigureAudioEncoder(avAudioCodec,audioSettings);
+		m_audioEncoder->open(avAudioCodec,errCode);
+		check_error(errCode);
+		m_audioStream.setTimeBase(av::Rational{1,static_cast<int32_t>(audioSettings.sampleRate)});
+	}
+
+	// Each additional GOP worker gets its own context with identical settings. Only the primary
+	// context is associated with the stream, the others merely produce packets for it.
+	m_gopEncoders.reserve(numGopWorkers -1);
+	for(auto i=decltype(numGopWorkers){1u};i<numGopWorkers;++i)
+	{
+		auto gopEncoder = std::make_unique<av::VideoEncoderContext>(avCodec);
+		ConfigureEncoder(*gopEncoder,encodingSettings);
+		gopEncoder->open(avCodec,errCode);
+		check_error(errCode);
+		m_gopEncoders.push_back(std::move(gopEncoder));
+	}
 
+	m_formatContext.writeHeader(errCode);
+	check_error(errCode);
+	m_formatContext.flush();
+
+	auto threadSettings = encodingSettings;
+	if(IsGopParallel())
+	{
+		threadSettings.gopParallelChunkSize = m_gopSize;
+		// Chunks are handed to the workers round-robin. If a worker couldn't queue up its whole chunk, WriteFrame would block on
+		// it after a few frames, and the next worker wouldn't receive any frames until then, so the workers would run one after another.
+		threadSettings.frameQueueSize = std::max(threadSettings.frameQueueSize,m_gopSize);
+		// Likewise, the packets of all chunks in flight have to fit into the writer's ring, otherwise the workers
+		// which are ahead of the writer have to wait for the one encoding the oldest chunk
+		threadSettings.packetQueueSize = std::max(threadSettings.packetQueueSize,numGopWorkers *m_gopSize);
+		// The workers already keep the cores busy, splitting the conversion as well would only oversubscribe them
+		if(threadSettings.conversionSliceCount == 0)
+			threadSettings.conversionSliceCount = 1;
+	}
+	m_packetWriterThread = std::make_unique<VideoPacketWriterThread>(
+		m_formatContext,threadSettings.packetQueueSize,encodingSettings.waitSettings,m_waitCounters,*m_stageCounters
+	);
+	if(m_audioEncoder)
+	{
+		// Several packets per video frame, e.g. ~47 AAC packets per second at 48 kHz
+		m_packetWriterThread->EnableAudio(threadSettings.packetQueueSize);
+		m_audioEncoderThread = std::make_shared<AudioEncoderThread>(
+			*m_packetWriterThread,*m_audioEncoder->raw(),m_audioStream.index(),*encodingSettings.audio,encodingSettings.waitSettings,m_waitCounters
+		);
+	}
+	m_packetWriterThread->Start();
+	if(m_audioEncoderThread)
+		m_audioEncoderThread->Start();
+	// Without GOP-parallel encoding there MUST only be one thread, as some codecs do not support multi-threading this way!
+	m_encoderThreads.resize(numGopWorkers);
+	for(auto i=decltype(m_encoderThreads.size()){0u};i<m_encoderThreads.size();++i)
+	{
+		auto &threadEncoder = (i == 0) ? *m_encoder : *m_gopEncoders.at(i -1);
+		auto &thread = m_encoderThreads.at(i);
+		thread = std::make_shared<VideoEncoderThread>(*m_packetWriterThread,threadEncoder,m_outputStream.index(),threadSettings,dstPixelFormat,m_waitCounters,*m_stageCounters);
+		thread->Start();
+	}
+}
+
+av::PixelFormat FFMpegEncoder::ConfigureEncoder(av::VideoEncoderContext &encoder,const VideoRecorder::EncodingSettings &encodingSettings) const
+{
 	switch(encodingSettings.quality)
 	{
 		case Quality::VeryLow:
@@ -66,7 +194,20 @@ void FFMpegEncoder::Initialize(const std::string &outFileName,const VideoRecorde
 	encoder.addFlags(AV_CODEC_FLAG_QSCALE);
 
 	auto *pRawEncoder = encoder.raw();
-	pRawEncoder->thread_count = 4;
+	auto &threading = encodingSettings.codecThreading;
+	pRawEncoder->thread_count = (threading.threadCount > 0) ? threading.threadCount : CalcAutoCodecThreadCount(encodingSettings,0);
+	pRawEncoder->thread_type = to_av_thread_type(threading.threadType);
+	if(encodingSettings.maxBFrames.has_value())
+		pRawEncoder->max_b_frames = *encodingSettings.maxBFrames;
+	if(IsGopParallel())
+	{
+		// Every frame has to produce exactly one packet right away, so the packets of all
+		// workers can be ordered by frame index. Each chunk starts with a keyframe.
+		pRawEncoder->thread_count = 1;
+		pRawEncoder->max_b_frames = 0;
+		pRawEncoder->gop_size = m_gopSize;
+		encoder.addFlags(AV_CODEC_FLAG_CLOSED_GOP);
+	}
     av::PixelFormat dstPixelFormat {AVPixelFormat::AV_PIX_FMT_YUV420P};
 	switch(encodingSettings.codec)
 	{
@@ -74,64 +215,96 @@ void FFMpegEncoder::Initialize(const std::string &outFileName,const VideoRecorde
 			// Deprecated in favor of AV_PIX_FMT_YUV420P according to ffmpeg log, but
 			// AV_PIX_FMT_YUV420P does not work with MotionJPEG
 			dstPixelFormat = AVPixelFormat::AV_PIX_FMT_YUVJ420P;
-
-			pRawEncoder->thread_count = 1;
 			break;
 	}
     encoder.setPixelFormat(dstPixelFormat);
+	switch(encodingSettings.colorMatrix)
+	{
+		case ColorMatrix::BT709:
+			pRawEncoder->colorspace = AVCOL_SPC_BT709;
+			pRawEncoder->color_primaries = AVCOL_PRI_BT709;
+			pRawEncoder->color_trc = AVCOL_TRC_BT709;
+			break;
+		case ColorMatrix::BT601:
+			pRawEncoder->colorspace = AVCOL_SPC_SMPTE170M;
+			break;
+	}
+	pRawEncoder->color_range = (dstPixelFormat.get() == AVPixelFormat::AV_PIX_FMT_YUVJ420P) ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
 
     // Settings
     encoder.setWidth(encodingSettings.width);
     encoder.setHeight(encodingSettings.height);
-    encoder.setTimeBase(av::Rational{1,static_cast<int32_t>(encodingSettings.frameRate)});
+	auto timeBaseDenominator = static_cast<int32_t>(encodingSettings.frameRate);
+	if(m_frameRateMode == VideoRecorder::FrameRateMode::Variable)
+	{
+		// Some codecs (e.g. MPEG4) don't allow denominators above 16 bits
+		timeBaseDenominator = std::min<int32_t>(timeBaseDenominator *VFR_TIME_BASE_SUBDIVISIONS,std::numeric_limits<uint16_t>::max());
+	}
+    encoder.setTimeBase(av::Rational{1,timeBaseDenominator});
 	uint64_t bitRate = 0;
 	if(encodingSettings.bitRate.has_value())
 		bitRate = *encodingSettings.bitRate;
 	else
 		bitRate = calc_bitrate(encodingSettings.width,encodingSettings.height,encodingSettings.frameRate,get_bits_per_pixel(encodingSettings.quality));
     encoder.setBitRate(bitRate);
-    m_outputStream.setFrameRate({static_cast<int32_t>(encodingSettings.frameRate),1});
-    m_outputStream.setTimeBase(encoder.timeBase());
-
-	if(fileInterface == nullptr)
-		m_formatContext.openOutput(outFileName,errCode);
-	else
-	{
-		m_fileIo = std::unique_ptr<AVFileIO>{new AVFileIO{fileInterface}};
-		if(m_fileIo->open(outFileName)	== true)
-			m_formatContext.openOutput(m_fileIo.get(),errCode);
-		else
-			throw RuntimeError{"Unable to open file '" +outFileName +"'!"};
-	}
-	check_error(errCode);
-    
-    encoder.open(avCodec,errCode);
-	check_error(errCode);
-
-	m_formatContext.writeHeader(errCode);
-	check_error(errCode);
-	m_formatContext.flush();
+	return dstPixelFormat;
+}
 
-	m_packetWriterThread = std::make_unique<VideoPacketWriterThread>(m_formatContext);
-	m_packetWriterThread->Start();
-	m_encoderThreads.resize(1); // MUST be 1, as some codecs do not support multi-threading this way!
-	for(auto &thread : m_encoderThreads)
+void FFMpegEncoder::ConfigureAudioEncoder(const av::Codec &codec,const VideoRecorder::AudioEncodingSettings &audioSettings)
+{
+	auto *rawEncoder = m_audioEncoder->raw();
+	auto *rawCodec = codec.raw();
+	// Prefer the format of the input samples, so no conversion is required, then its planar variant (e.g. for AAC)
+	auto srcSampleFormat = (audioSettings.sampleFormat == AudioSampleFormat::Int16) ? AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_FLT;
+	auto sampleFormat = AV_SAMPLE_FMT_NONE;
+	if(rawCodec->sample_fmts)
 	{
-		thread = std::make_shared<VideoEncoderThread>(*m_packetWriterThread,*m_encoder,encodingSettings,dstPixelFormat);
-		thread->Start();
+		for(auto *fmt=rawCodec->sample_fmts;*fmt != AV_SAMPLE_FMT_NONE;++fmt)
+		{
+			if(*fmt == srcSampleFormat)
+			{
+				sampleFormat = *fmt;
+				break;
+			}
+			if(*fmt == av_get_planar_sample_fmt(srcSampleFormat) || sampleFormat == AV_SAMPLE_FMT_NONE)
+				sampleFormat = *fmt;
+		}
 	}
+	rawEncoder->sample_fmt = (sampleFormat != AV_SAMPLE_FMT_NONE) ? sampleFormat : srcSampleFormat;
+	rawEncoder->sample_rate = audioSettings.sampleRate;
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57,28,100)
+	av_channel_layout_uninit(&rawEncoder->ch_layout);
+	av_channel_layout_default(&rawEncoder->ch_layout,audioSettings.channelCount);
+#else
+	rawEncoder->channels = audioSettings.channelCount;
+	rawEncoder->channel_layout = av_get_default_channel_layout(audioSettings.channelCount);
+#endif
+	rawEncoder->time_base = AVRational{1,static_cast<int>(audioSettings.sampleRate)};
+	if(audioSettings.codec != AudioCodec::PCM)
+		rawEncoder->bit_rate = audioSettings.bitRate;
+	if(m_formatContext.raw()->oformat->flags &AVFMT_GLOBALHEADER)
+		rawEncoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 }
 
+bool FFMpegEncoder::IsGopParallel() const {return m_gopSize > 0;}
+VideoRecorder::ThreadIndex FFMpegEncoder::GetGopThreadIndex(FrameIndex frameIndex) const {return (frameIndex /m_gopSize) %m_encoderThreads.size();}
+
 VideoRecorder::ThreadIndex FFMpegEncoder::StartFrame()
 {
+	if(IsGopParallel())
+	{
+		// The thread is determined by the chunk the frame belongs to
+		m_curThreadIndex = GetGopThreadIndex(m_curFrameIndex);
+		return m_curThreadIndex;
+	}
 	auto longestDuration = std::chrono::steady_clock::duration{std::chrono::nanoseconds{0}};
 	auto bestCandidateIndex = std::numeric_limits<VideoRecorder::ThreadIndex>::max();
-	// Find thread that is either not busy, or has been
+	// Find thread that either has a free queue slot, or has been
 	// busy the longest (in which case its likely to finish first)
 	for(auto i=decltype(m_encoderThreads.size()){0u};i<m_encoderThreads.size();++i)
 	{
 		auto &pEncoderThread = m_encoderThreads.at(i);
-		if(pEncoderThread->IsBusy() == false)
+		if(pEncoderThread->IsQueueFull() == false)
 		{
 			bestCandidateIndex = i;
 			break;
@@ -148,16 +321,63 @@ VideoRecorder::ThreadIndex FFMpegEncoder::StartFrame()
 	return m_curThreadIndex;
 }
 
-void FFMpegEncoder::EncodeFrame(const uimg::ImageBuffer &imgBuf)
+void FFMpegEncoder::EncodeFrame(const FrameBuffer &frameBuffer,int64_t pts,int64_t duration)
 {
-	m_encoderThreads.at(m_curThreadIndex)->EncodeFrame(m_curFrameIndex,imgBuf);
+	// A single WriteFrame call may produce frames for several chunks
+	auto threadIndex = IsGopParallel() ? GetGopThreadIndex(m_curFrameIndex) : m_curThreadIndex;
+	m_encoderThreads.at(threadIndex)->EncodeFrame(m_curFrameIndex,pts,duration,frameBuffer);
+}
+
+FrameBuffer FFMpegEncoder::ToFrameBuffer(const uimg::ImageBuffer &imgBuf)
+{
+	auto ptrBuf = imgBuf.shared_from_this();
+	std::optional<PixelFormat> format {};
+	switch(ptrBuf->GetFormat())
+	{
+		case uimg::ImageBuffer::Format::RGBA8:
+			format = PixelFormat::RGBA8;
+			break;
+		case uimg::ImageBuffer::Format::RGB8:
+			format = PixelFormat::RGB8;
+			break;
+		case uimg::ImageBuffer::Format::RGBA16:
+			format = PixelFormat::RGBA16F;
+			break;
+		case uimg::ImageBuffer::Format::RGBA32:
+			format = PixelFormat::RGBA32F;
+			break;
+		default:
+			break;
+	}
+	// Formats swscale can't handle have to be converted first
+	if(format.has_value() == false || sws_isSupportedInput(to_av_pixel_format(*format)) == 0)
+	{
+		ptrBuf = ptrBuf->Copy(uimg::ImageBuffer::Format::RGBA8);
+		format = PixelFormat::RGBA8;
+	}
+	FrameBuffer frameBuffer {};
+	frameBuffer.format = *format;
+	frameBuffer.width = ptrBuf->GetWidth();
+	frameBuffer.height = ptrBuf->GetHeight();
+	frameBuffer.data.front() = static_cast<const uint8_t*>(ptrBuf->GetData());
+	frameBuffer.lineSize.front() = ptrBuf->GetWidth() *ptrBuf->GetPixelSize();
+	frameBuffer.owner = ptrBuf;
+	return frameBuffer;
 }
 
 void FFMpegEncoder::EndRecording()
 {
-	m_packetWriterThread->Stop(m_curFrameIndex);
+	// Encoder threads have to be stopped first, so any packets still buffered
+	// by the encoder (lookahead, B-frames, frame threads) are handed to the writer
+	if(m_audioEncoderThread)
+		m_audioEncoderThread->Stop();
+	PacketIndex numPackets = 0;
 	for(auto &thread : m_encoderThreads)
+	{
 		thread->Stop();
+		numPackets += thread->GetPacketCount();
+	}
+	m_packetWriterThread->Stop(numPackets);
 	std::error_code errCode {};
 	if(m_packetWriterThread->GetErrorCode().has_value())
 		errCode = *m_packetWriterThread->GetErrorCode();
@@ -171,15 +391,53 @@ void FFMpegEncoder::EndRecording()
 		check_error(errCode);
 	}
 	m_encoderThreads.clear();
+	if(m_audioEncoderThread)
+	{
+		if(m_audioEncoderThread->GetErrorCode().has_value())
+			errCode = *m_audioEncoderThread->GetErrorCode();
+		check_error(errCode);
+		m_audioEncoderThread = nullptr;
+	}
 
     m_formatContext.writePacket(errCode);
 	check_error(errCode);
     m_formatContext.writeTrailer(errCode);
 	check_error(errCode);
+	if(m_fileIo && m_fileIo->sync() == false)
+		throw RuntimeError{"Unable to write to output file!"};
 }
 
 int32_t FFMpegEncoder::WriteFrame(const uimg::ImageBuffer &imgBuf,double frameTime)
 {
+	return WriteFrame(ToFrameBuffer(imgBuf),frameTime);
+}
+
+int32_t FFMpegEncoder::WriteFrame(const FrameBuffer &frameBuffer,double frameTime)
+{
+	trace::ScopedEvent event {"FFMpegEncoder::WriteFrame","frame",m_curFrameIndex};
+	m_stageCounters->framesSubmitted.fetch_add(1,std::memory_order_relaxed);
+	if(m_frameRateMode == VideoRecorder::FrameRateMode::Variable)
+	{
+		auto timeBase = m_encoder->timeBase();
+		auto pts = static_cast<int64_t>(std::llround(frameTime *timeBase.getDenominator() /timeBase.getNumerator()));
+		if(m_curFrameIndex > 0 && pts <= m_prevPts)
+		{
+			m_stageCounters->framesSkipped.fetch_add(1,std::memory_order_relaxed);
+			return 0; // Timestamps have to be strictly increasing; Skip this frame
+		}
+		// The display duration of this frame is not known until the next frame arrives, so we assume
+		// it matches the interval to the previous one. Only used as a hint, the muxer derives the actual
+		// durations from the timestamps.
+		auto duration = (m_curFrameIndex > 0) ? (pts -m_prevPts) : m_nominalFrameDuration;
+		m_prevPts = pts;
+
+		auto tCur = std::chrono::steady_clock::now();
+		EncodeFrame(frameBuffer,pts,duration);
+		++m_curFrameIndex;
+		m_encodeDuration += std::chrono::steady_clock::now() -tCur;
+		return 1;
+	}
+
 	auto timeStamp = frameTime; // Timestamp to beginning of recording
 	auto prevTimeStamp = m_prevTimeStamp; // TODO
 	auto dtTimeStamp = timeStamp -prevTimeStamp;
@@ -191,21 +449,84 @@ int32_t FFMpegEncoder::WriteFrame(const uimg::ImageBuffer &imgBuf,double frameTi
 
 	uint32_t deltaTime = dtTimeUnits;
 	if(deltaTime == 0 && m_curFrameIndex > 0)
+	{
+		m_stageCounters->framesSkipped.fetch_add(1,std::memory_order_relaxed);
 		return 0; // Skip this frame
+	}
 	auto numFrames = std::max(deltaTime,1u);
+	if(numFrames > 1)
+		m_stageCounters->framesDuplicated.fetch_add(numFrames -1,std::memory_order_relaxed);
 	// Frame may have to be encoded multiple times
 	auto tCur = std::chrono::steady_clock::now();
 	for(auto i=decltype(numFrames){0u};i<numFrames;++i)
 	{
 		/* encode the image */
-		EncodeFrame(imgBuf);
+		EncodeFrame(frameBuffer,m_curFrameIndex,1);
 		++m_curFrameIndex;
 	}
 	auto tDelta = std::chrono::steady_clock::now() -tCur;
 	m_encodeDuration += tDelta;
 	return numFrames;
 }
+int32_t FFMpegEncoder::WriteAudio(const void *data,uint32_t frameCount)
+{
+	if(m_audioEncoderThread == nullptr)
+		return -1;
+	return m_audioEncoderThread->WriteSamples(static_cast<const uint8_t*>(data),frameCount);
+}
 uint32_t FFMpegEncoder::GetWidth() const {return m_encoder->width();}
 uint32_t FFMpegEncoder::GetHeight() const {return m_encoder->height();}
 std::chrono::nanoseconds FFMpegEncoder::GetEncodingDuration() const {return m_encodeDuration;}
+VideoRecorder::WaitStatistics FFMpegEncoder::GetWaitStatistics() const {return m_waitCounters.GetStatistics();}
+VideoRecorder::StageTimings FFMpegEncoder::GetStageTimings() const {return m_stageCounters->GetTimings();}
+VideoRecorder::IOStatistics FFMpegEncoder::GetIOStatistics() const
+{
+	if(m_fileIo == nullptr)
+		return {};
+	auto stats = m_fileIo->getStatistics();
+	return {stats.bytesWritten,stats.writeCallCount};
+}
+VideoRecorder::Statistics FFMpegEncoder::GetStatistics() const
+{
+	auto stats = m_stageCounters->GetStatistics();
+	if(m_packetWriterThread)
+		stats.writerQueueDepth = m_packetWriterThread->GetQueuedPacketCount();
+	return stats;
+}
+uint32_t FFMpegEncoder::GetCodecThreadCount() const {return m_encoder->raw()->thread_count;}
+uint32_t FFMpegEncoder::CalcCodecThreadBudget(const VideoRecorder::EncodingSettings &encodingSettings)
+{
+	// MotionJPEG does not work reliably with multiple threads
+	if(encodingSettings.codec == Codec::MotionJPEG)
+		return 1;
+	auto numCores = std::max(std::thread::hardware_concurrency(),1u);
+	auto reservedCoreCount = encodingSettings.codecThreading.reservedCoreCount;
+	auto numAvailableCores = (numCores > reservedCoreCount) ? (numCores -reservedCoreCount) : 1u;
+	return std::clamp(numAvailableCores,1u,MAX_AUTO_CODEC_THREAD_COUNT);
+}
+uint32_t FFMpegEncoder::CalcAutoCodecThreadCount(const VideoRecorder::EncodingSettings &encodingSettings,uint32_t previousThreadCount)
+{
+	auto maxThreadCount = CalcCodecThreadBudget(encodingSettings);
+	if(previousThreadCount > 0)
+		return std::min(previousThreadCount,maxThreadCount);
+	// Start in the middle of the budget, subsequent recordings will be tuned from there
+	return std::max(maxThreadCount /2,1u);
+}
+uint32_t FFMpegEncoder::CalcTunedCodecThreadCount() const
+{
+	auto threadCount = GetCodecThreadCount();
+	auto timings = GetStageTimings();
+	if(timings.wallDuration.count() <= 0 || timings.numEncodedFrames == 0)
+		return threadCount;
+	auto wallDuration = static_cast<double>(timings.wallDuration.count());
+	auto submitWaitRatio = timings.submitWaitDuration.count() /wallDuration;
+	auto encoderIdleRatio = timings.encoderIdleDuration.count() /wallDuration;
+	// The encoder could not keep up, so WriteFrame had to wait for it
+	if(submitWaitRatio > 0.05)
+		return std::min(threadCount +std::max(threadCount /2,1u),m_maxCodecThreadCount);
+	// The encoder mostly had nothing to do, give a core back to the application
+	if(encoderIdleRatio > 0.5 && threadCount > 1)
+		return threadCount -1;
+	return threadCount;
+}
 #pragma optimize("",on)
@@ -10,7 +10,6 @@
 #include <format.h>
 #include <formatcontext.h>
 #include <codeccontext.h>
-#include <videorescaler.h>
 #include <memory>
 #include <string>
 #include <vector>
@@ -18,45 +17,89 @@
 #include <functional>
 #include "util_video_recorder.hpp"
 #include "util_ffmpeg.hpp"
+#include "thread_wait_strategy.hpp"
 
 namespace media
 {
 	class VideoPacketWriterThread;
 	class VideoEncoderThread;
+	class AudioEncoderThread;
+	struct StageCounters;
 	struct AVFileIO;
 	class FFMpegEncoder
 	{
 	public:
-		static const auto SOURCE_PIXEL_FORMAT = AV_PIX_FMT_RGB24;
+		~FFMpegEncoder();
 		static const auto FRAME_ALIGNMENT = 32u;
+		// Time base of variable frame rate recordings, in fractions of a frame
+		static const auto VFR_TIME_BASE_SUBDIVISIONS = 100u;
+		// Most codecs don't scale beyond this, some (e.g. libx264) warn about larger counts
+		static const auto MAX_AUTO_CODEC_THREAD_COUNT = 16u;
 	
 		using FrameIndex = uint32_t;
+		// Position of a packet in the order the encoder has emitted it (i.e. decoding order)
+		using PacketIndex = uint64_t;
 		static std::unique_ptr<FFMpegEncoder> Create(
 			const std::string &outFileName,const VideoRecorder::EncodingSettings &encodingSettings,const std::shared_ptr<ICustomFile> &fileInterface=nullptr
 		);
 
 		VideoRecorder::ThreadIndex StartFrame();
 		int32_t WriteFrame(const uimg::ImageBuffer &imgBuf,double frameTime);
+		int32_t WriteFrame(const FrameBuffer &frameBuffer,double frameTime);
+		int32_t WriteAudio(const void *data,uint32_t frameCount);
 		void EndRecording();
 		uint32_t GetWidth() const;
 		uint32_t GetHeight() const;
 		std::chrono::nanoseconds GetEncodingDuration() const;
+		VideoRecorder::WaitStatistics GetWaitStatistics() const;
+		VideoRecorder::StageTimings GetStageTimings() const;
+		VideoRecorder::IOStatistics GetIOStatistics() const;
+		VideoRecorder::Statistics GetStatistics() const;
+		uint32_t GetCodecThreadCount() const;
+
+		// Returns the codec thread count for a recording with automatic threading. previousThreadCount
+		// is the tuned count of the previous recording with the same settings, or 0 if there was none.
+		static uint32_t CalcAutoCodecThreadCount(const VideoRecorder::EncodingSettings &encodingSettings,uint32_t previousThreadCount);
+		// Returns the codec thread count the next recording should use, based on the
+		// timings of this one. Only valid after EndRecording has been called.
+		uint32_t CalcTunedCodecThreadCount() const;
 	private:
-		FFMpegEncoder()=default;
+		FFMpegEncoder();
 		void Initialize(const std::string &outFileName,const VideoRecorder::EncodingSettings &encodingSettings,const std::shared_ptr<ICustomFile> &fileInterface=nullptr);
-		void EncodeFrame(const uimg::ImageBuffer &imgBuf);
+		static FrameBuffer ToFrameBuffer(const uimg::ImageBuffer &imgBuf);
+		// Maximum number of codec threads with automatic threading
+		static uint32_t CalcCodecThreadBudget(const VideoRecorder::EncodingSettings &encodingSettings);
+		void EncodeFrame(const FrameBuffer &frameBuffer,int64_t pts,int64_t duration);
+		// Applies the encoding settings to the context and returns the pixel format the frames have to be converted to
+		av::PixelFormat ConfigureEncoder(av::VideoEncoderContext &encoder,const VideoRecorder::EncodingSettings &encodingSettings) const;
+		void ConfigureAudioEncoder(const av::Codec &codec,const VideoRecorder::AudioEncodingSettings &audioSettings);
+		bool IsGopParallel() const;
+		VideoRecorder::ThreadIndex GetGopThreadIndex(FrameIndex frameIndex) const;
 
 		std::unique_ptr<AVFileIO> m_fileIo = nullptr;
 		av::FormatContext m_formatContext = {};
 		av::Stream m_outputStream;
 		std::unique_ptr<av::VideoEncoderContext> m_encoder;
+		av::Stream m_audioStream;
+		std::unique_ptr<av::AudioEncoderContext> m_audioEncoder = nullptr;
+		// Contexts of the additional workers with GOP-parallel encoding
+		std::vector<std::unique_ptr<av::VideoEncoderContext>> m_gopEncoders;
+		// Number of frames per chunk with GOP-parallel encoding, 0 otherwise
+		uint32_t m_gopSize = 0;
 		std::chrono::steady_clock::duration m_encodeDuration = std::chrono::seconds{0};
 		FrameIndex m_curFrameIndex = 0;
 		VideoRecorder::ThreadIndex m_curThreadIndex = 0;
 		double m_prevTimeStamp = 0.0;
+		VideoRecorder::FrameRateMode m_frameRateMode = VideoRecorder::FrameRateMode::Constant;
+		int64_t m_prevPts = 0;
+		int64_t m_nominalFrameDuration = 1; // In encoder time base units
+		uint32_t m_maxCodecThreadCount = 1;
+		WaitCounters m_waitCounters = {};
+		std::unique_ptr<StageCounters> m_stageCounters;
 
 		std::shared_ptr<VideoPacketWriterThread> m_packetWriterThread = {};
 		std::vector<std::shared_ptr<VideoEncoderThread>> m_encoderThreads = {};
+		std::shared_ptr<AudioEncoderThread> m_audioEncoderThread = nullptr;
 	};
 };
 
@@ -0,0 +1,168 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ffmpeg_frame_converter.hpp"
+#include <algorithm>
+#include <array>
+extern "C" {
+	#include <libavutil/pixdesc.h>
+	#include <libswscale/swscale.h>
+}
+
+using namespace media;
+
+static constexpr uint32_t MIN_SLICE_HEIGHT = 64;
+static constexpr uint32_t MAX_AUTO_SLICE_COUNT = 8;
+
+// Returns the data pointers of an image, offset to the row y
+template<typename T>
+	static std::array<T*,4> get_plane_pointers(AVPixelFormat format,T *const *planes,const int32_t *lineSizes,uint32_t y)
+{
+	auto *desc = av_pix_fmt_desc_get(format);
+	std::array<T*,4> data {};
+	for(auto i=0u;i<data.size();++i)
+	{
+		if(planes[i] == nullptr)
+			continue;
+		// Planes 1 and 2 are the (possibly vertically subsampled) chroma planes
+		auto planeY = (i == 1 || i == 2) ? (y >>desc->log2_chroma_h) : y;
+		data[i] = planes[i] +static_cast<ptrdiff_t>(planeY) *lineSizes[i];
+	}
+	return data;
+}
+
+FrameConverter::FrameConverter(
+	av::PixelFormat srcPixelFormat,av::PixelFormat dstPixelFormat,uint32_t width,uint32_t height,uint32_t sliceCount,
+	ColorMatrix colorMatrix,const VideoRecorder::WaitSettings &waitSettings,WaitCounters &waitCounters
+)
+	: m_width{width},m_srcPixelFormat{srcPixelFormat},m_workerWaitStrategy{waitSettings,waitCounters},m_completionWaitStrategy{waitSettings,waitCounters}
+{
+	auto isRgba = (srcPixelFormat.get() == AV_PIX_FMT_RGBA);
+	auto isBgra = (srcPixelFormat.get() == AV_PIX_FMT_BGRA);
+	auto fullRange = (dstPixelFormat.get() == AV_PIX_FMT_YUVJ420P);
+	if(isRgba || isBgra)
+	{
+		switch(dstPixelFormat.get())
+		{
+			case AV_PIX_FMT_YUV420P:
+			case AV_PIX_FMT_YUVJ420P:
+				m_conversionKernel = color::get_conversion_kernel();
+				m_yuvLayout = color::YUVLayout::Planar;
+				break;
+			case AV_PIX_FMT_NV12:
+				m_conversionKernel = color::get_conversion_kernel();
+				m_yuvLayout = color::YUVLayout::NV12;
+				break;
+			default:
+				break;
+		}
+		m_conversionCoefficients = color::calc_conversion_coefficients(colorMatrix,fullRange,isBgra);
+	}
+
+	// Slices have to start at a row which is not in the middle of a subsampled chroma row
+	auto *dstDesc = av_pix_fmt_desc_get(dstPixelFormat.get());
+	auto *srcDesc = av_pix_fmt_desc_get(srcPixelFormat.get());
+	auto rowAlignment = 1u <<std::max(dstDesc->log2_chroma_h,srcDesc->log2_chroma_h);
+	if(sliceCount == 0)
+		sliceCount = CalcSliceCount(height,rowAlignment);
+	auto sliceHeight = std::max(height /sliceCount,1u);
+	sliceHeight = ((sliceHeight +rowAlignment -1) /rowAlignment) *rowAlignment;
+
+	for(auto y=0u;y<height;y+=sliceHeight)
+	{
+		Slice slice {};
+		slice.y = y;
+		slice.height = std::min(sliceHeight,height -y);
+		if(m_conversionKernel == nullptr)
+		{
+			slice.swsContext = sws_getContext(
+				width,slice.height,srcPixelFormat.get(),width,slice.height,dstPixelFormat.get(),SWS_BICUBIC,nullptr,nullptr,nullptr
+			);
+			if(slice.swsContext == nullptr)
+				throw RuntimeError{"Unable to create scaling context for conversion from '" +std::string{srcPixelFormat.name()} +"' to '" +std::string{dstPixelFormat.name()} +"'!"};
+			auto colorSpace = (colorMatrix == ColorMatrix::BT709) ? SWS_CS_ITU709 : SWS_CS_ITU601;
+			sws_setColorspaceDetails(
+				slice.swsContext,sws_getCoefficients(SWS_CS_DEFAULT),1,sws_getCoefficients(colorSpace),fullRange ? 1 : 0,
+				0,1 <<16,1 <<16
+			);
+		}
+		m_slices.push_back(slice);
+	}
+
+	m_workers.reserve(m_slices.size() -1);
+	for(auto i=1u;i<m_slices.size();++i)
+		m_workers.push_back(std::thread{[this,i]() {RunWorker(i);}});
+}
+FrameConverter::~FrameConverter()
+{
+	m_running = false;
+	m_workerWaitStrategy.Notify();
+	for(auto &worker : m_workers)
+		worker.join();
+	for(auto &slice : m_slices)
+		sws_freeContext(slice.swsContext);
+}
+uint32_t FrameConverter::CalcSliceCount(uint32_t height,uint32_t rowAlignment)
+{
+	auto numCores = std::max(std::thread::hardware_concurrency(),1u);
+	// Use at most half of the cores, the remaining ones are needed by the codec and the application
+	auto sliceCount = std::clamp(numCores /2,1u,MAX_AUTO_SLICE_COUNT);
+	return std::clamp(height /std::max(MIN_SLICE_HEIGHT,rowAlignment),1u,sliceCount);
+}
+uint32_t FrameConverter::GetSliceCount() const {return m_slices.size();}
+color::ConversionKernel FrameConverter::GetConversionKernel() const {return m_conversionKernel;}
+bool FrameConverter::ConvertSlice(const Slice &slice)
+{
+	auto &src = *m_src;
+	auto &dst = *m_dstFrame->raw();
+	if(m_conversionKernel)
+	{
+		color::ConversionTarget target {};
+		target.data = {dst.data[0],dst.data[1],dst.data[2]};
+		target.lineSize = {dst.linesize[0],dst.linesize[1],dst.linesize[2]};
+		target.layout = m_yuvLayout;
+		m_conversionKernel(src.data[0],src.lineSize[0],target,m_width,slice.y,slice.y +slice.height,m_conversionCoefficients);
+		return true;
+	}
+	auto srcData = get_plane_pointers(m_srcPixelFormat.get(),src.data.data(),src.lineSize.data(),slice.y);
+	auto dstData = get_plane_pointers(static_cast<AVPixelFormat>(dst.format),dst.data,dst.linesize,slice.y);
+	auto numRows = sws_scale(slice.swsContext,srcData.data(),src.lineSize.data(),0,slice.height,dstData.data(),dst.linesize);
+	return numRows > 0;
+}
+void FrameConverter::RunWorker(uint32_t sliceIndex)
+{
+	uint64_t lastGeneration = 0;
+	for(;;)
+	{
+		m_workerWaitStrategy.Wait([this,lastGeneration]() {return m_generation != lastGeneration || m_running == false;});
+		if(m_running == false)
+			break;
+		lastGeneration = m_generation;
+		if(ConvertSlice(m_slices.at(sliceIndex)) == false)
+			m_failed = true;
+		if(--m_pendingSlices == 0)
+			m_completionWaitStrategy.Notify();
+	}
+}
+bool FrameConverter::Convert(const FrameBuffer &src,av::VideoFrame &dstFrame)
+{
+	// The encoder may still be referencing the buffers of the destination frame
+	if(av_frame_make_writable(dstFrame.raw()) < 0)
+		return false;
+	m_src = &src;
+	m_dstFrame = &dstFrame;
+	m_failed = false;
+	m_pendingSlices = m_slices.size();
+	if(m_workers.empty() == false)
+	{
+		++m_generation;
+		m_workerWaitStrategy.Notify();
+	}
+
+	if(ConvertSlice(m_slices.front()) == false)
+		m_failed = true;
+	--m_pendingSlices;
+	m_completionWaitStrategy.Wait([this]() {return m_pendingSlices == 0;});
+	return m_failed == false;
+}
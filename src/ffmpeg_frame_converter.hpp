@@ -0,0 +1,65 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __FFMPEG_FRAME_CONVERTER_HPP__
+#define __FFMPEG_FRAME_CONVERTER_HPP__
+
+#include <frame.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include "thread_wait_strategy.hpp"
+#include "color_conversion.hpp"
+
+struct SwsContext;
+namespace media
+{
+	// Converts frames between pixel formats (without scaling) by splitting them into horizontal
+	// slices, which are converted in parallel. The thread calling Convert always converts the
+	// first slice itself, all other slices are handed to worker threads owned by the converter.
+	// Conversions from RGBA/BGRA to 4:2:0 YUV use the SIMD kernels from color_conversion.hpp,
+	// everything else is converted by swscale.
+	class FrameConverter
+	{
+	public:
+		// If sliceCount is 0, the number of slices is determined automatically
+		FrameConverter(
+			av::PixelFormat srcPixelFormat,av::PixelFormat dstPixelFormat,uint32_t width,uint32_t height,uint32_t sliceCount,
+			ColorMatrix colorMatrix,const VideoRecorder::WaitSettings &waitSettings,WaitCounters &waitCounters
+		);
+		~FrameConverter();
+		bool Convert(const FrameBuffer &src,av::VideoFrame &dstFrame);
+		uint32_t GetSliceCount() const;
+		// Returns nullptr if swscale is used for the conversion
+		color::ConversionKernel GetConversionKernel() const;
+	private:
+		struct Slice
+		{
+			uint32_t y = 0;
+			uint32_t height = 0;
+			SwsContext *swsContext = nullptr;
+		};
+		static uint32_t CalcSliceCount(uint32_t height,uint32_t rowAlignment);
+		bool ConvertSlice(const Slice &slice);
+		void RunWorker(uint32_t sliceIndex);
+
+		color::ConversionKernel m_conversionKernel = nullptr;
+		color::ConversionCoefficients m_conversionCoefficients = {};
+		color::YUVLayout m_yuvLayout = color::YUVLayout::Planar;
+		uint32_t m_width = 0;
+		std::vector<Slice> m_slices = {};
+		std::vector<std::thread> m_workers = {};
+		const FrameBuffer *m_src = nullptr;
+		av::PixelFormat m_srcPixelFormat;
+		av::VideoFrame *m_dstFrame = nullptr;
+		std::atomic<uint64_t> m_generation = 0;
+		std::atomic<uint32_t> m_pendingSlices = 0;
+		std::atomic<bool> m_failed = false;
+		std::atomic<bool> m_running = true;
+		WaitStrategy m_workerWaitStrategy;
+		WaitStrategy m_completionWaitStrategy;
+	};
+};
+
+#endif
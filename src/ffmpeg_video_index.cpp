@@ -0,0 +1,245 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ffmpeg_video_index.hpp"
+#include <unordered_map>
+#include <mutex>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <array>
+#include <type_traits>
+extern "C" {
+	#include <libavcodec/avcodec.h>
+	#include <libavformat/avformat.h>
+}
+
+using namespace media;
+
+static constexpr std::array<char,4> INDEX_FILE_IDENTIFIER = {'V','I','D','X'};
+#pragma pack(push,1)
+struct IndexFileHeader
+{
+	std::array<char,4> identifier;
+	uint32_t version;
+	VideoIndex::FileIdentity fileIdentity;
+	VideoIndex::StreamParameters streamParameters;
+	uint64_t keyframeCount;
+};
+#pragma pack(pop)
+// Structs which are written to the file as a whole must not contain padding, which would be left uninitialized
+static_assert(std::has_unique_object_representations_v<VideoIndex::Keyframe>);
+static_assert(std::has_unique_object_representations_v<VideoIndex::FileIdentity>);
+static_assert(std::has_unique_object_representations_v<VideoIndex::StreamParameters>);
+
+static std::mutex g_indexCacheMutex;
+static std::unordered_map<std::string,std::shared_ptr<const VideoIndex>> g_indexCache;
+
+static std::string get_cache_key(const std::string &fileName)
+{
+	std::error_code errCode;
+	auto canonicalPath = std::filesystem::weakly_canonical(fileName,errCode).string();
+	return errCode ? fileName : canonicalPath;
+}
+
+std::optional<VideoIndex::FileIdentity> VideoIndex::QueryFileIdentity(const std::string &fileName)
+{
+	std::error_code errCode;
+	FileIdentity identity {};
+	identity.size = std::filesystem::file_size(fileName,errCode);
+	if(errCode)
+		return {};
+	identity.modificationTime = std::filesystem::last_write_time(fileName,errCode).time_since_epoch().count();
+	if(errCode)
+		return {};
+	return identity;
+}
+
+std::shared_ptr<const VideoIndex> VideoIndex::Find(const std::string &fileName,const std::string &sidecarFileName)
+{
+	auto identity = QueryFileIdentity(fileName);
+	if(identity.has_value() == false)
+		return nullptr;
+	auto key = get_cache_key(fileName);
+	{
+		std::scoped_lock<std::mutex> lock {g_indexCacheMutex};
+		auto it = g_indexCache.find(key);
+		if(it != g_indexCache.end())
+		{
+			if(it->second->GetFileIdentity() == *identity)
+				return it->second;
+			g_indexCache.erase(it);
+		}
+	}
+	if(sidecarFileName.empty())
+		return nullptr;
+	std::shared_ptr<const VideoIndex> index = Load(sidecarFileName);
+	if(index == nullptr || (index->GetFileIdentity() == *identity) == false)
+		return nullptr;
+	std::scoped_lock<std::mutex> lock {g_indexCacheMutex};
+	g_indexCache[key] = index;
+	return index;
+}
+
+void VideoIndex::Store(const std::string &fileName,const std::string &sidecarFileName,const std::shared_ptr<VideoIndex> &index)
+{
+	auto identity = QueryFileIdentity(fileName);
+	if(identity.has_value() == false)
+		return;
+	index->m_fileIdentity = *identity;
+	{
+		std::scoped_lock<std::mutex> lock {g_indexCacheMutex};
+		g_indexCache[get_cache_key(fileName)] = index;
+	}
+	// Failing to write the sidecar is not critical, the index will simply be rebuilt next time
+	if(sidecarFileName.empty() == false)
+		index->Save(sidecarFileName);
+}
+
+std::shared_ptr<VideoIndex> VideoIndex::Build(AVFormatContext *formatContext,int streamIndex)
+{
+	if(streamIndex < 0 || streamIndex >= static_cast<int>(formatContext->nb_streams))
+		return nullptr;
+	auto *stream = formatContext->streams[streamIndex];
+	auto index = std::shared_ptr<VideoIndex>{new VideoIndex{}};
+	auto &params = index->m_streamParameters;
+	params.streamIndex = streamIndex;
+	params.codecId = stream->codecpar->codec_id;
+	params.width = stream->codecpar->width;
+	params.height = stream->codecpar->height;
+	params.pixelFormat = stream->codecpar->format;
+	params.timeBaseNum = stream->time_base.num;
+	params.timeBaseDen = stream->time_base.den;
+	params.frameRateNum = stream->avg_frame_rate.num;
+	params.frameRateDen = stream->avg_frame_rate.den;
+	params.startTime = (stream->start_time != AV_NOPTS_VALUE) ? stream->start_time : 0;
+	params.duration = (stream->duration != AV_NOPTS_VALUE) ? stream->duration : 0;
+
+	// Elementary streams may have no timestamps at all; Their keyframes are placed by counting the frames instead
+	auto frameRate = (stream->avg_frame_rate.num > 0) ? stream->avg_frame_rate : stream->r_frame_rate;
+	auto hasFrameRate = (frameRate.num > 0 && frameRate.den > 0);
+
+	auto *packet = av_packet_alloc();
+	uint64_t frameIndex = 0;
+	while(av_read_frame(formatContext,packet) >= 0)
+	{
+		if(packet->stream_index == streamIndex)
+		{
+			if(packet->flags &AV_PKT_FLAG_KEY)
+			{
+				Keyframe keyframe {};
+				keyframe.dts = packet->dts;
+				keyframe.pts = (packet->pts != AV_NOPTS_VALUE) ? packet->pts : packet->dts;
+				if(keyframe.pts == AV_NOPTS_VALUE && hasFrameRate)
+					keyframe.pts = params.startTime +av_rescale_q(frameIndex,AVRational{frameRate.den,frameRate.num},stream->time_base);
+				keyframe.position = packet->pos;
+				keyframe.frameIndex = frameIndex;
+				if(keyframe.pts != AV_NOPTS_VALUE || keyframe.position >= 0)
+					index->m_keyframes.push_back(keyframe);
+			}
+			++frameIndex;
+		}
+		av_packet_unref(packet);
+	}
+	av_packet_free(&packet);
+	params.frameCount = frameIndex;
+	std::stable_sort(index->m_keyframes.begin(),index->m_keyframes.end(),[](const Keyframe &a,const Keyframe &b) {return a.pts < b.pts;});
+
+	// Rewind; Not all demuxers support seeking by byte offset
+	if(av_seek_frame(formatContext,streamIndex,params.startTime,AVSEEK_FLAG_BACKWARD) < 0)
+		av_seek_frame(formatContext,-1,0,AVSEEK_FLAG_BYTE);
+	return index;
+}
+
+const VideoIndex::Keyframe *VideoIndex::FindKeyframe(int64_t pts) const
+{
+	if(m_keyframes.empty())
+		return nullptr;
+	auto it = std::upper_bound(m_keyframes.begin(),m_keyframes.end(),pts,[](int64_t pts,const Keyframe &keyframe) {return pts < keyframe.pts;});
+	if(it == m_keyframes.begin())
+		return &*it;
+	return &*(it -1);
+}
+const std::vector<VideoIndex::Keyframe> &VideoIndex::GetKeyframes() const {return m_keyframes;}
+const VideoIndex::StreamParameters &VideoIndex::GetStreamParameters() const {return m_streamParameters;}
+const VideoIndex::FileIdentity &VideoIndex::GetFileIdentity() const {return m_fileIdentity;}
+
+bool VideoIndex::ApplyStreamParameters(AVStream &stream) const
+{
+	auto &params = m_streamParameters;
+	auto &codecPar = *stream.codecpar;
+	if(stream.index != params.streamIndex || (codecPar.codec_id != AV_CODEC_ID_NONE && codecPar.codec_id != params.codecId))
+		return false;
+	codecPar.codec_id = static_cast<AVCodecID>(params.codecId);
+	if(codecPar.width <= 0 || codecPar.height <= 0)
+	{
+		codecPar.width = params.width;
+		codecPar.height = params.height;
+	}
+	if(codecPar.format < 0)
+		codecPar.format = params.pixelFormat;
+	if(stream.avg_frame_rate.num <= 0 && params.frameRateNum > 0)
+		stream.avg_frame_rate = AVRational{params.frameRateNum,params.frameRateDen};
+	if(stream.start_time == AV_NOPTS_VALUE)
+		stream.start_time = params.startTime;
+	if(stream.duration == AV_NOPTS_VALUE && params.duration > 0)
+		stream.duration = params.duration;
+	return true;
+}
+
+bool VideoIndex::Save(const std::string &fileName) const
+{
+	// The file is written in native byte order; A sidecar from a machine with a different
+	// byte order fails the version check and is rebuilt.
+	IndexFileHeader header;
+	memset(&header,0,sizeof(header));
+	header.identifier = INDEX_FILE_IDENTIFIER;
+	header.version = FORMAT_VERSION;
+	header.fileIdentity = m_fileIdentity;
+	header.streamParameters = m_streamParameters;
+	header.keyframeCount = m_keyframes.size();
+
+	std::ofstream f {fileName,std::ios::binary | std::ios::trunc};
+	if(f.is_open() == false)
+		return false;
+	f.write(reinterpret_cast<const char*>(&header),sizeof(header));
+	f.write(reinterpret_cast<const char*>(m_keyframes.data()),m_keyframes.size() *sizeof(m_keyframes.front()));
+	f.close();
+	if(f.fail())
+	{
+		std::error_code errCode;
+		std::filesystem::remove(fileName,errCode);
+		return false;
+	}
+	return true;
+}
+
+std::shared_ptr<VideoIndex> VideoIndex::Load(const std::string &fileName)
+{
+	std::ifstream f {fileName,std::ios::binary};
+	if(f.is_open() == false)
+		return nullptr;
+	IndexFileHeader header {};
+	if(f.read(reinterpret_cast<char*>(&header),sizeof(header)).fail())
+		return nullptr;
+	if(header.identifier != INDEX_FILE_IDENTIFIER || header.version != FORMAT_VERSION)
+		return nullptr;
+	// Guard against truncated or corrupted files before allocating anything. The keyframe count is compared
+	// against the size of the payload instead of multiplying it, which could overflow for a corrupted count.
+	std::error_code errCode;
+	auto fileSize = std::filesystem::file_size(fileName,errCode);
+	if(errCode || fileSize < sizeof(header))
+		return nullptr;
+	auto payloadSize = fileSize -sizeof(header);
+	if(payloadSize %sizeof(Keyframe) != 0 || header.keyframeCount != payloadSize /sizeof(Keyframe))
+		return nullptr;
+	auto index = std::shared_ptr<VideoIndex>{new VideoIndex{}};
+	index->m_fileIdentity = header.fileIdentity;
+	index->m_streamParameters = header.streamParameters;
+	index->m_keyframes.resize(header.keyframeCount);
+	if(f.read(reinterpret_cast<char*>(index->m_keyframes.data()),index->m_keyframes.size() *sizeof(Keyframe)).fail())
+		return nullptr;
+	return index;
+}
@@ -0,0 +1,87 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __FFMPEG_VIDEO_INDEX_HPP__
+#define __FFMPEG_VIDEO_INDEX_HPP__
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <memory>
+#include <optional>
+
+struct AVFormatContext;
+struct AVStream;
+namespace media
+{
+	// Keyframe positions and stream parameters of the video stream of a file. Built once with a full
+	// demuxing pass; Afterwards seeking only requires a binary search and a single jump in the file.
+	class VideoIndex
+	{
+	public:
+		// Has to be incremented whenever the layout of the sidecar file changes
+		static constexpr uint32_t FORMAT_VERSION = 2;
+		struct Keyframe
+		{
+			// Derived from frameIndex if the packet has no timestamp
+			int64_t pts = 0;
+			int64_t dts = 0;
+			// Byte offset of the packet in the file; -1 if unknown
+			int64_t position = -1;
+			// Number of video packets before this one, i.e. the first frame of the GOP in decoding order
+			uint64_t frameIndex = 0;
+		};
+		struct FileIdentity
+		{
+			uint64_t size = 0;
+			int64_t modificationTime = 0;
+			bool operator==(const FileIdentity &other) const {return size == other.size && modificationTime == other.modificationTime;}
+		};
+		struct StreamParameters
+		{
+			int32_t streamIndex = -1;
+			int32_t codecId = 0;
+			int32_t width = 0;
+			int32_t height = 0;
+			int32_t pixelFormat = -1;
+			int32_t timeBaseNum = 0;
+			int32_t timeBaseDen = 1;
+			int32_t frameRateNum = 0;
+			int32_t frameRateDen = 1;
+			// Makes the alignment padding explicit, so it is written to the sidecar file as zeroes
+			int32_t reserved = 0;
+			int64_t startTime = 0;
+			int64_t duration = 0;
+			uint64_t frameCount = 0;
+		};
+		static std::optional<FileIdentity> QueryFileIdentity(const std::string &fileName);
+		// Looks the index up in the in-memory cache first, then tries to load it from the sidecar file
+		// (if sidecarFileName is not empty). Returns nullptr if there is no index or the file has changed since.
+		static std::shared_ptr<const VideoIndex> Find(const std::string &fileName,const std::string &sidecarFileName);
+		// Adds the index to the in-memory cache and writes it to the sidecar file (if sidecarFileName is not empty)
+		static void Store(const std::string &fileName,const std::string &sidecarFileName,const std::shared_ptr<VideoIndex> &index);
+		// Reads all packets of the file and seeks back to the start afterwards
+		static std::shared_ptr<VideoIndex> Build(AVFormatContext *formatContext,int streamIndex);
+
+		// Returns the last keyframe at or before the given timestamp, or the first keyframe if there is none
+		const Keyframe *FindKeyframe(int64_t pts) const;
+		const std::vector<Keyframe> &GetKeyframes() const;
+		const StreamParameters &GetStreamParameters() const;
+		const FileIdentity &GetFileIdentity() const;
+		// Fills in the parameters the demuxer could not determine without probing. Returns false if
+		// the stream does not match the one the index was built for.
+		bool ApplyStreamParameters(AVStream &stream) const;
+	private:
+		VideoIndex()=default;
+		bool Save(const std::string &fileName) const;
+		static std::shared_ptr<VideoIndex> Load(const std::string &fileName);
+
+		FileIdentity m_fileIdentity {};
+		StreamParameters m_streamParameters {};
+		// Sorted by pts
+		std::vector<Keyframe> m_keyframes;
+	};
+};
+
+#endif
@@ -3,6 +3,15 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "ffmpeg_worker_threads.hpp"
+#include "trace_events.hpp"
+#include <cstring>
+#include <algorithm>
+#include <bit>
+extern "C" {
+	#include <libavcodec/avcodec.h>
+	#include <libavutil/mathematics.h>
+	#include <libswresample/swresample.h>
+}
 
 #pragma optimize("",off)
 #ifdef _WIN32
@@ -76,166 +85,695 @@ static void set_thread_priority(std::thread &thread,ThreadPriority priority)
 	}
 #endif
 }
-VideoPacketWriterThread::VideoPacketWriterThread(av::FormatContext &formatContext)
-	: m_formatContext{formatContext}
+VideoPacketWriterThread::VideoPacketWriterThread(
+	av::FormatContext &formatContext,uint32_t capacity,const VideoRecorder::WaitSettings &waitSettings,WaitCounters &waitCounters,StageCounters &stageCounters
+)
+	: BaseVideoThread{waitSettings,waitCounters},m_formatContext{formatContext},m_packetRing(std::max(capacity,1u)),m_stageCounters{stageCounters}
 {}
 VideoPacketWriterThread::~VideoPacketWriterThread()
 {
 	Stop();
 }
+void VideoPacketWriterThread::EnableAudio(uint32_t capacity)
+{
+	m_hasAudio = true;
+	m_audioPacketRing.resize(std::max(capacity,1u));
+}
 void VideoPacketWriterThread::Start()
 {
 	m_running = true;
 	m_thread = std::thread{[this]() {
+		trace::set_thread_name("VideoPacketWriterThread");
 		while(m_running && IsValid())
+		{
+			m_waitStrategy.Wait([this]() {return m_running == false || IsValid() == false || SelectNextPacket().has_value();});
 			Run();
+		}
 	}};
 	set_thread_priority(m_thread,ThreadPriority::AboveNormal);
 }
-void VideoPacketWriterThread::Stop(std::optional<FFMpegEncoder::FrameIndex> waitUntilFrameIndex)
+void VideoPacketWriterThread::Stop(std::optional<FFMpegEncoder::PacketIndex> waitUntilPacketIndex)
 {
-	while(waitUntilFrameIndex.has_value() && m_nextPacketFrameIndex < waitUntilFrameIndex && IsValid())
-		; // Wait until final frame has been written
+	// Wait until final packet has been written
+	if(waitUntilPacketIndex.has_value() && m_thread.joinable())
+	{
+		// Audio packets are no longer held back for video packets that will never come
+		m_finalPacketIndex = *waitUntilPacketIndex;
+		m_waitStrategy.Notify();
+		m_waitStrategy.Wait([this]() {return (IsVideoFinished() && IsAudioFinished()) || IsValid() == false;});
+	}
 	m_running = false;
+	m_waitStrategy.Notify();
 	if(m_thread.joinable())
 		m_thread.join();
 }
-void VideoPacketWriterThread::AddPacket(const av::Packet &packet,FFMpegEncoder::FrameIndex frameIndex)
+bool VideoPacketWriterThread::HasCapacity(FFMpegEncoder::PacketIndex packetIndex) const
 {
-	std::scoped_lock<std::mutex> lock{m_packetQueueMutex};
-
-	auto it = std::find_if(m_packetQueue.begin(),m_packetQueue.end(),[frameIndex](const std::pair<FFMpegEncoder::FrameIndex,av::Packet> &pair) {
-		return frameIndex < pair.first;
-	});
-	m_packetQueue.insert(it,std::pair<FFMpegEncoder::FrameIndex,av::Packet>{frameIndex,packet});
+	return packetIndex < m_nextPacketIndex.load(std::memory_order_acquire) +m_packetRing.size();
+}
+void VideoPacketWriterThread::AddPacket(const av::Packet &packet,FFMpegEncoder::PacketIndex packetIndex)
+{
+	if(HasCapacity(packetIndex) == false)
+	{
+		// The writer can't keep up (e.g. the disk is stalling); The packet with the next index
+		// never has to wait here, so the writer is always able to make progress.
+		auto t = std::chrono::steady_clock::now();
+		m_waitStrategy.Wait([this,packetIndex]() {return HasCapacity(packetIndex) || m_running == false || IsValid() == false;});
+		m_stageCounters.AddDuration(m_stageCounters.packetStallDuration,std::chrono::steady_clock::now() -t);
+		++m_stageCounters.numPacketStalls;
+		if(HasCapacity(packetIndex) == false)
+			return; // Writer has been stopped or has failed
+	}
+	auto &slot = m_packetRing.at(packetIndex %m_packetRing.size());
+	slot.packet = packet;
+	slot.queueTime = std::chrono::steady_clock::now().time_since_epoch().count();
+	slot.ready.store(true,std::memory_order_release);
+	m_queuedPacketCount.fetch_add(1,std::memory_order_relaxed);
+	UpdateMaxQueueDepth();
+	m_waitStrategy.Notify();
+}
+uint32_t VideoPacketWriterThread::GetQueuedPacketCount() const
+{
+	// The read index has to be loaded first, it can never overtake the write index loaded afterwards
+	auto audioReadIndex = m_audioReadIndex.load(std::memory_order_acquire);
+	auto numAudioPackets = m_audioWriteIndex.load(std::memory_order_acquire) -audioReadIndex;
+	return m_queuedPacketCount.load(std::memory_order_relaxed) +static_cast<uint32_t>(numAudioPackets);
+}
+void VideoPacketWriterThread::UpdateMaxQueueDepth()
+{
+	auto depth = GetQueuedPacketCount();
+	auto &maxDepth = m_stageCounters.maxWriterQueueDepth;
+	auto curMax = maxDepth.load(std::memory_order_relaxed);
+	while(depth > curMax && maxDepth.compare_exchange_weak(curMax,depth,std::memory_order_relaxed) == false);
+}
+bool VideoPacketWriterThread::HasAudioCapacity() const {return m_audioWriteIndex.load(std::memory_order_relaxed) -m_audioReadIndex.load(std::memory_order_acquire) < m_audioPacketRing.size();}
+bool VideoPacketWriterThread::HasAudioPacket() const {return m_audioWriteIndex.load(std::memory_order_acquire) != m_audioReadIndex.load(std::memory_order_relaxed);}
+void VideoPacketWriterThread::AddAudioPacket(const av::Packet &packet)
+{
+	if(HasAudioCapacity() == false)
+	{
+		auto t = std::chrono::steady_clock::now();
+		m_waitStrategy.Wait([this]() {return HasAudioCapacity() || m_running == false || IsValid() == false;});
+		m_stageCounters.AddDuration(m_stageCounters.packetStallDuration,std::chrono::steady_clock::now() -t);
+		++m_stageCounters.numPacketStalls;
+		if(HasAudioCapacity() == false)
+			return;
+	}
+	auto writeIndex = m_audioWriteIndex.load(std::memory_order_relaxed);
+	auto &slot = m_audioPacketRing.at(writeIndex %m_audioPacketRing.size());
+	slot.packet = packet;
+	slot.queueTime = std::chrono::steady_clock::now().time_since_epoch().count();
+	m_audioWriteIndex.store(writeIndex +1,std::memory_order_release);
+	UpdateMaxQueueDepth();
+	m_waitStrategy.Notify();
 }
-void VideoPacketWriterThread::WritePacket(const av::Packet &packet)
+void VideoPacketWriterThread::EndAudio()
 {
+	m_audioEnded = true;
+	m_waitStrategy.Notify();
+}
+bool VideoPacketWriterThread::IsVideoFinished() const {return m_nextPacketIndex.load(std::memory_order_relaxed) >= m_finalPacketIndex.load(std::memory_order_relaxed);}
+bool VideoPacketWriterThread::IsAudioFinished() const {return m_hasAudio == false || (m_audioEnded.load(std::memory_order_acquire) && HasAudioPacket() == false);}
+static int64_t get_decoding_timestamp(const av::Packet &packet)
+{
+	auto *rawPacket = packet.raw();
+	return (rawPacket->dts != AV_NOPTS_VALUE) ? rawPacket->dts : rawPacket->pts;
+}
+std::optional<VideoPacketWriterThread::StreamType> VideoPacketWriterThread::SelectNextPacket() const
+{
+	auto isVideoReady = IsNextPacketReady();
+	if(m_hasAudio == false)
+		return isVideoReady ? StreamType::Video : std::optional<StreamType>{};
+	auto isAudioReady = HasAudioPacket();
+	if(isVideoReady && isAudioReady)
+	{
+		auto &videoPacket = m_packetRing.at(m_nextPacketIndex.load(std::memory_order_relaxed) %m_packetRing.size()).packet;
+		auto &audioPacket = m_audioPacketRing.at(m_audioReadIndex.load(std::memory_order_relaxed) %m_audioPacketRing.size()).packet;
+		auto cmp = av_compare_ts(
+			get_decoding_timestamp(audioPacket),audioPacket.timeBase().getValue(),
+			get_decoding_timestamp(videoPacket),videoPacket.timeBase().getValue()
+		);
+		return (cmp <= 0) ? StreamType::Audio : StreamType::Video;
+	}
+	if(isVideoReady)
+	{
+		if(IsAudioFinished() || m_queuedPacketCount.load(std::memory_order_relaxed) *2 >= m_packetRing.size())
+			return StreamType::Video;
+	}
+	else if(isAudioReady)
+	{
+		auto numAudioPackets = m_audioWriteIndex.load(std::memory_order_acquire) -m_audioReadIndex.load(std::memory_order_relaxed);
+		if(IsVideoFinished() || numAudioPackets *2 >= m_audioPacketRing.size())
+			return StreamType::Audio;
+	}
+	return {};
+}
+bool VideoPacketWriterThread::IsNextPacketReady() const
+{
+	return m_packetRing.at(m_nextPacketIndex.load(std::memory_order_relaxed) %m_packetRing.size()).ready.load(std::memory_order_acquire);
+}
+void VideoPacketWriterThread::WritePacket(const av::Packet &packet,StreamType streamType)
+{
+	trace::ScopedEvent event {(streamType == StreamType::Audio) ? "VideoPacketWriterThread::WritePacket (audio)" : "VideoPacketWriterThread::WritePacket","pts",packet.raw()->pts};
+	auto size = packet.size();
+	auto t = std::chrono::steady_clock::now();
 	std::error_code errCode {};
 	m_formatContext.writePacket(packet,errCode);
-	CheckError(errCode);
+	if(CheckError(errCode))
+		return;
+	m_stageCounters.writePacketHistogram.Add(std::chrono::steady_clock::now() -t);
+	m_stageCounters.bytesWritten.fetch_add(size,std::memory_order_relaxed);
+	m_stageCounters.packetsWritten.fetch_add(1,std::memory_order_relaxed);
 }
 void VideoPacketWriterThread::Run()
 {
-	std::unique_lock<std::mutex> lock {m_packetQueueMutex};
-	if(m_packetQueue.empty() || m_packetQueue.front().first != m_nextPacketFrameIndex)
-		return; // Wait for correct packet
-	auto packet = m_packetQueue.front().second;
-	m_packetQueue.erase(m_packetQueue.begin());
+	// Write as many consecutive packets as are available
+	while(IsValid())
+	{
+		auto streamType = SelectNextPacket();
+		if(streamType.has_value() == false)
+			break;
+		av::Packet packet;
+		TimePoint queueTime = 0;
+		if(*streamType == StreamType::Audio)
+		{
+			auto readIndex = m_audioReadIndex.load(std::memory_order_relaxed);
+			auto &slot = m_audioPacketRing.at(readIndex %m_audioPacketRing.size());
+			packet = std::move(slot.packet);
+			queueTime = slot.queueTime;
+			m_audioReadIndex.store(readIndex +1,std::memory_order_release);
+		}
+		else
+		{
+			auto &slot = m_packetRing.at(m_nextPacketIndex %m_packetRing.size());
+			packet = std::move(slot.packet);
+			queueTime = slot.queueTime;
+			slot.ready.store(false,std::memory_order_relaxed);
+			m_queuedPacketCount.fetch_sub(1,std::memory_order_relaxed);
+			m_nextPacketIndex.fetch_add(1,std::memory_order_release);
+		}
+		// Frees up the slot for the producers
+		m_waitStrategy.Notify();
+		m_stageCounters.writerQueueWaitHistogram.Add(std::chrono::steady_clock::now() -std::chrono::steady_clock::time_point{std::chrono::steady_clock::duration{queueTime}});
 
-	lock.unlock();
+		WritePacket(packet,*streamType);
+	}
+}
 
-	WritePacket(packet);
-		
-	++m_nextPacketFrameIndex;
+//////////////////
+
+void LatencyHistogramCounters::Add(std::chrono::steady_clock::duration duration)
+{
+	auto ns = static_cast<uint64_t>(std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(),0));
+	auto bucket = std::min<uint32_t>(std::bit_width(ns /1'000),buckets.size() -1);
+	buckets.at(bucket).fetch_add(1,std::memory_order_relaxed);
+	count.fetch_add(1,std::memory_order_relaxed);
+	totalDuration.fetch_add(ns,std::memory_order_relaxed);
+	auto curMax = maxDuration.load(std::memory_order_relaxed);
+	while(ns > curMax && maxDuration.compare_exchange_weak(curMax,ns,std::memory_order_relaxed) == false);
+}
+VideoRecorder::LatencyHistogram LatencyHistogramCounters::GetHistogram() const
+{
+	VideoRecorder::LatencyHistogram histogram {};
+	for(auto i=decltype(buckets.size()){0u};i<buckets.size();++i)
+		histogram.buckets.at(i) = buckets.at(i).load(std::memory_order_relaxed);
+	histogram.count = count.load(std::memory_order_relaxed);
+	histogram.totalDuration = std::chrono::nanoseconds{totalDuration.load(std::memory_order_relaxed)};
+	histogram.maxDuration = std::chrono::nanoseconds{maxDuration.load(std::memory_order_relaxed)};
+	return histogram;
+}
+void StageCounters::AddDuration(std::atomic<uint64_t> &counter,std::chrono::steady_clock::duration duration)
+{
+	counter.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(),std::memory_order_relaxed);
+}
+VideoRecorder::Statistics StageCounters::GetStatistics() const
+{
+	VideoRecorder::Statistics stats {};
+	stats.submitWait = submitWaitHistogram.GetHistogram();
+	stats.rescale = rescaleHistogram.GetHistogram();
+	stats.encode = encodeHistogram.GetHistogram();
+	stats.writerQueueWait = writerQueueWaitHistogram.GetHistogram();
+	stats.writePacket = writePacketHistogram.GetHistogram();
+	stats.maxWriterQueueDepth = maxWriterQueueDepth.load(std::memory_order_relaxed);
+	stats.bytesWritten = bytesWritten.load(std::memory_order_relaxed);
+	stats.packetsWritten = packetsWritten.load(std::memory_order_relaxed);
+	stats.framesSubmitted = framesSubmitted.load(std::memory_order_relaxed);
+	stats.framesSkipped = framesSkipped.load(std::memory_order_relaxed);
+	stats.framesDuplicated = framesDuplicated.load(std::memory_order_relaxed);
+	return stats;
+}
+VideoRecorder::StageTimings StageCounters::GetTimings() const
+{
+	VideoRecorder::StageTimings timings {};
+	timings.conversionDuration = std::chrono::nanoseconds{conversionDuration.load(std::memory_order_relaxed)};
+	timings.encodeDuration = std::chrono::nanoseconds{encodeDuration.load(std::memory_order_relaxed)};
+	timings.numConvertedFrames = numConvertedFrames.load(std::memory_order_relaxed);
+	timings.numEncodedFrames = numEncodedFrames.load(std::memory_order_relaxed);
+	timings.submitWaitDuration = std::chrono::nanoseconds{submitWaitDuration.load(std::memory_order_relaxed)};
+	timings.encoderIdleDuration = std::chrono::nanoseconds{encoderIdleDuration.load(std::memory_order_relaxed)};
+	timings.packetStallDuration = std::chrono::nanoseconds{packetStallDuration.load(std::memory_order_relaxed)};
+	timings.numPacketStalls = numPacketStalls.load(std::memory_order_relaxed);
+	auto tFirst = firstFrameTime.load(std::memory_order_relaxed);
+	auto tLast = lastFrameTime.load(std::memory_order_relaxed);
+	if(tFirst != 0 && tLast > tFirst)
+		timings.wallDuration = std::chrono::steady_clock::duration{tLast -tFirst};
+	return timings;
 }
 
 //////////////////
 
 VideoEncoderThread::VideoEncoderThread(
-	VideoPacketWriterThread &writerThread,av::VideoEncoderContext &encoder,const VideoRecorder::EncodingSettings &encodingSettings,
-	av::PixelFormat dstPixelFormat
+	VideoPacketWriterThread &writerThread,av::VideoEncoderContext &encoder,int streamIndex,const VideoRecorder::EncodingSettings &encodingSettings,
+	av::PixelFormat dstPixelFormat,WaitCounters &waitCounters,StageCounters &stageCounters
 )
-	: m_writerThread{writerThread},m_encoder{encoder}
+	: BaseVideoThread{encodingSettings.waitSettings,waitCounters},m_encodingSettings{encodingSettings},m_dstPixelFormat{dstPixelFormat},
+	m_waitCounters{waitCounters},m_encoder{encoder},m_streamIndex{streamIndex},m_stageCounters{stageCounters},m_writerThread{writerThread}
 {
-	av::PixelFormat srcPixelFormat {AVPixelFormat::AV_PIX_FMT_RGBA};
-	m_srcFrame = {srcPixelFormat,static_cast<int32_t>(encodingSettings.width),static_cast<int32_t>(encodingSettings.height),static_cast<int32_t>(FFMpegEncoder::FRAME_ALIGNMENT)};
-	m_dstFrame = {dstPixelFormat,static_cast<int32_t>(encodingSettings.width),static_cast<int32_t>(encodingSettings.height),static_cast<int32_t>(FFMpegEncoder::FRAME_ALIGNMENT)};
-	m_dstFrame.setTimeBase(encoder.timeBase());
-	m_dstFrame.setStreamIndex(0);
-	m_dstFrame.setPictureType();
+	for(auto &convertedFrame : m_convertedFrames)
+	{
+		auto &dstFrame = convertedFrame.frame;
+		dstFrame = {dstPixelFormat,static_cast<int32_t>(encodingSettings.width),static_cast<int32_t>(encodingSettings.height),static_cast<int32_t>(FFMpegEncoder::FRAME_ALIGNMENT)};
+		dstFrame.setTimeBase(encoder.timeBase());
+		dstFrame.setStreamIndex(streamIndex);
+		dstFrame.setPictureType();
+	}
+	m_frameQueue.resize(std::max(encodingSettings.frameQueueSize,1u));
+	m_receivedPacket = av_packet_alloc();
 }
 VideoEncoderThread::~VideoEncoderThread()
 {
 	Stop();
+	av_packet_free(&m_receivedPacket);
 }
-void VideoEncoderThread::InitFrameFromBufferData(av::VideoFrame &frame,const uimg::ImageBuffer &imgBuf)
+FrameConverter *VideoEncoderThread::GetFrameConverter(PixelFormat srcFormat)
 {
-	/*
-	av::VideoFrame frame {
-		reinterpret_cast<const uint8_t*>(colors.data()),colors.size() *sizeof(colors.front()),
-		format,static_cast<int32_t>(width),static_cast<int32_t>(height),static_cast<int32_t>(alignment)
-	};*/
-	// VideoFrame constructor has a bug as of 19-06-10, where only the first row of the source data would be used.
-	// We will have to copy the data manually as a work-around
-
-	std::array<uint8_t*,4> buf;
-	std::array<int,4> lineSize;
-	auto *bufferData = reinterpret_cast<const uint8_t*>(imgBuf.GetData());
-	av_image_fill_arrays(buf.data(),lineSize.data(),bufferData,frame.pixelFormat(),frame.width(),frame.height(),FFMpegEncoder::FRAME_ALIGNMENT);
-	if(lineSize.at(0) != frame.width() *sizeof(Color))
-		throw LogicError{"Frame line size does not match input data line size!"};
-
-	// No need to copy data
-	//memcpy(frame.raw()->data[0],colors.data(),colors.size() *sizeof(colors.front()));
-	frame.raw()->data[0] = static_cast<uint8_t*>(const_cast<uint8_t*>(bufferData));
-	frame.setComplete(true);
-
-	frame.raw()->pts = 0;
-	frame.raw()->pkt_dts = 0;
+	auto &converter = m_frameConverters.at(static_cast<size_t>(srcFormat));
+	if(converter == nullptr)
+	{
+		converter = std::make_unique<FrameConverter>(
+			to_av_pixel_format(srcFormat),m_dstPixelFormat,m_encodingSettings.width,m_encodingSettings.height,m_encodingSettings.conversionSliceCount,
+			m_encodingSettings.colorMatrix,m_encodingSettings.waitSettings,m_waitCounters
+		);
+	}
+	return converter.get();
 }
-bool VideoEncoderThread::IsBusy() const {return m_isEncodingFrame;}
-void VideoEncoderThread::EncodeFrame(FFMpegEncoder::FrameIndex frameIndex,const uimg::ImageBuffer &imgBuf)
+bool VideoEncoderThread::HasQueuedFrame() const {return m_queueWriteIndex > m_queueReadIndex;}
+bool VideoEncoderThread::HasConvertedFrame() const {return m_convertedWriteIndex > m_convertedReadIndex;}
+bool VideoEncoderThread::IsConvertedQueueFull() const {return m_convertedWriteIndex -m_convertedReadIndex >= m_convertedFrames.size();}
+bool VideoEncoderThread::IsBusy() const {return HasQueuedFrame() || HasConvertedFrame();}
+bool VideoEncoderThread::IsQueueFull() const {return m_queueWriteIndex -m_queueReadIndex >= m_frameQueue.size();}
+uint32_t VideoEncoderThread::GetQueuedFrameCount() const {return (m_queueWriteIndex -m_queueReadIndex) +(m_convertedWriteIndex -m_convertedReadIndex);}
+FFMpegEncoder::PacketIndex VideoEncoderThread::GetPacketCount() const {return m_nextPacketIndex;}
+bool VideoEncoderThread::IsGopParallel() const {return m_encodingSettings.gopParallelWorkerCount > 1;}
+void VideoEncoderThread::EncodeFrame(FFMpegEncoder::FrameIndex frameIndex,int64_t pts,int64_t duration,const FrameBuffer &frameBuffer)
 {
-	while(IsBusy() && IsValid())
-		;
+	if(frameBuffer.width != m_encodingSettings.width || frameBuffer.height != m_encodingSettings.height)
+		throw LogicError{"Frame resolution does not match the resolution of the recording!"};
+	if(to_av_pixel_format(frameBuffer.format) == AV_PIX_FMT_NONE)
+		throw LogicError{"Pixel format '" +pixel_format_to_name(frameBuffer.format) +"' is not supported by this FFmpeg version!"};
+	if(frameBuffer.data.front() == nullptr)
+		throw LogicError{"Frame has no data!"};
+
+	// Only wait if all slots are taken
+	std::chrono::steady_clock::duration waitDuration {0};
+	if(IsQueueFull())
+	{
+		auto t = std::chrono::steady_clock::now();
+		m_waitStrategy.Wait([this]() {return IsQueueFull() == false || IsValid() == false;});
+		waitDuration = std::chrono::steady_clock::now() -t;
+		m_stageCounters.AddDuration(m_stageCounters.submitWaitDuration,waitDuration);
+	}
+	m_stageCounters.submitWaitHistogram.Add(waitDuration);
 	if(IsValid() == false)
 		return;
-	m_startTime = std::chrono::steady_clock::now();
-	m_frameIndex = frameIndex;
-	auto ptrBuf = imgBuf.shared_from_this();
-	if(ptrBuf->GetFormat() != uimg::ImageBuffer::Format::RGBA8)
-		ptrBuf = ptrBuf->Copy(uimg::ImageBuffer::Format::RGBA8);
-	m_currentFrameImageBuffer = ptrBuf;
-	InitFrameFromBufferData(m_srcFrame,imgBuf);
-
-	auto calcSize = av_image_get_buffer_size(m_srcFrame.pixelFormat(),m_srcFrame.width(),m_srcFrame.height(),FFMpegEncoder::FRAME_ALIGNMENT);
-	if(calcSize != imgBuf.GetSize())
-		throw LogicError{"Data size does not match expected size for the specified format and resolution!"};
-
-	m_isEncodingFrame = true;
+	auto tFirst = std::chrono::steady_clock::rep{0};
+	m_stageCounters.firstFrameTime.compare_exchange_strong(tFirst,std::chrono::steady_clock::now().time_since_epoch().count());
+	auto &queuedFrame = m_frameQueue.at(m_queueWriteIndex %m_frameQueue.size());
+	queuedFrame.frameIndex = frameIndex;
+	queuedFrame.pts = pts;
+	queuedFrame.duration = duration;
+	queuedFrame.frameBuffer = frameBuffer;
+	++m_queueWriteIndex;
+	m_waitStrategy.Notify();
+}
+std::chrono::steady_clock::duration VideoEncoderThread::GetWorkDuration() const
+{
+	if(IsBusy() == false)
+		return std::chrono::steady_clock::duration{0};
+	return std::chrono::steady_clock::now() -std::chrono::steady_clock::time_point{std::chrono::steady_clock::duration{m_frameStartTime.load()}};
 }
-std::chrono::steady_clock::duration VideoEncoderThread::GetWorkDuration() const {return std::chrono::steady_clock::now() -m_startTime;}
 void VideoEncoderThread::Start()
 {
 	m_running = true;
+	m_conversionThread = std::thread{[this]() {
+		trace::set_thread_name("VideoEncoderThread (conversion)");
+		while(m_running && IsValid())
+		{
+			m_waitStrategy.Wait([this]() {return m_running == false || IsValid() == false || (HasQueuedFrame() && IsConvertedQueueFull() == false);});
+			if(HasQueuedFrame() && IsConvertedQueueFull() == false)
+				ConvertNextFrame();
+		}
+	}};
 	m_thread = std::thread{[this]() {
+		trace::set_thread_name("VideoEncoderThread");
 		while(m_running && IsValid())
-			Run();
+		{
+			auto t = std::chrono::steady_clock::now();
+			m_waitStrategy.Wait([this]() {return m_running == false || IsValid() == false || HasConvertedFrame();});
+			if(HasConvertedFrame() == false)
+				continue;
+			// Waiting for the first frame of the recording doesn't count as idle time
+			if(m_stageCounters.numEncodedFrames > 0)
+				m_stageCounters.AddDuration(m_stageCounters.encoderIdleDuration,std::chrono::steady_clock::now() -t);
+			EncodeNextFrame();
+		}
 	}};
+	set_thread_priority(m_conversionThread,ThreadPriority::AboveNormal);
 	set_thread_priority(m_thread,ThreadPriority::AboveNormal);
 }
 void VideoEncoderThread::Stop()
 {
-	while(IsBusy() && IsValid())
-		;
+	if(m_thread.joinable() == false)
+		return;
+	m_waitStrategy.Wait([this]() {return IsBusy() == false || IsValid() == false;});
 	m_running = false;
-	if(m_thread.joinable())
-		m_thread.join();
+	m_waitStrategy.Notify();
+	if(m_conversionThread.joinable())
+		m_conversionThread.join();
+	m_thread.join();
+	if(IsValid())
+		Drain();
 }
-void VideoEncoderThread::Run()
+void VideoEncoderThread::ConvertNextFrame()
 {
-	if(IsBusy() == false)
-		return;
-	EncodeCurrentFrame();
+	auto &queuedFrame = m_frameQueue.at(m_queueReadIndex %m_frameQueue.size());
+	trace::ScopedEvent event {"VideoEncoderThread::ConvertNextFrame","frame",queuedFrame.frameIndex};
+	auto &convertedFrame = m_convertedFrames.at(m_convertedWriteIndex %m_convertedFrames.size());
+	auto &frameBuffer = queuedFrame.frameBuffer;
+	auto t = std::chrono::steady_clock::now();
+	convertedFrame.isPassthrough = (to_av_pixel_format(frameBuffer.format) == m_dstPixelFormat.get());
+	if(convertedFrame.isPassthrough)
+	{
+		// No conversion required, the encoder can reference the source data directly
+		convertedFrame.passthroughFrame = wrap_frame_buffer(frameBuffer);
+		convertedFrame.passthroughFrame.setTimeBase(m_encoder.timeBase());
+		convertedFrame.passthroughFrame.setStreamIndex(m_streamIndex);
+	}
+	else
+	{
+		FrameConverter *converter = nullptr;
+		try
+		{
+			converter = GetFrameConverter(frameBuffer.format);
+		}
+		catch(const RuntimeError &)
+		{
+			CheckError(std::make_error_code(std::errc::not_supported));
+			return;
+		}
+		if(converter->Convert(frameBuffer,convertedFrame.frame) == false)
+		{
+			CheckError(std::make_error_code(std::errc::invalid_argument));
+			return;
+		}
+		auto conversionDuration = std::chrono::steady_clock::now() -t;
+		m_stageCounters.AddDuration(m_stageCounters.conversionDuration,conversionDuration);
+		m_stageCounters.rescaleHistogram.Add(conversionDuration);
+		++m_stageCounters.numConvertedFrames;
+	}
+	convertedFrame.frameIndex = queuedFrame.frameIndex;
+	convertedFrame.pts = queuedFrame.pts;
+	convertedFrame.duration = queuedFrame.duration;
+
+	// Source data is no longer needed (unless it is referenced by the passthrough frame)
+	queuedFrame.frameBuffer = {};
+	++m_queueReadIndex;
+	++m_convertedWriteIndex;
+	m_waitStrategy.Notify();
 }
-void VideoEncoderThread::EncodeCurrentFrame()
+void VideoEncoderThread::EncodeNextFrame()
 {
-	std::error_code errCode;
-	m_videoRescaler.rescale(m_dstFrame,m_srcFrame,errCode);
-	if(CheckError(errCode))
+	auto &convertedFrame = m_convertedFrames.at(m_convertedReadIndex %m_convertedFrames.size());
+	trace::ScopedEvent event {"VideoEncoderThread::EncodeNextFrame","frame",convertedFrame.frameIndex};
+	auto &dstFrame = convertedFrame.isPassthrough ? convertedFrame.passthroughFrame : convertedFrame.frame;
+	auto t = std::chrono::steady_clock::now();
+	m_frameStartTime = t.time_since_epoch().count();
+
+	auto *rawFrame = dstFrame.raw();
+	rawFrame->pts = convertedFrame.pts;
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57,30,100)
+	rawFrame->duration = convertedFrame.duration;
+#else
+	rawFrame->pkt_duration = convertedFrame.duration;
+#endif
+	if(IsGopParallel())
+	{
+		// Chunks have to be decodable on their own
+		auto isChunkStart = (convertedFrame.frameIndex %m_encodingSettings.gopParallelChunkSize) == 0;
+		rawFrame->pict_type = isChunkStart ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+		m_pendingGopFrameIndex = convertedFrame.frameIndex;
+	}
+	// The encoder may emit any number of packets per frame (none while it is filling its
+	// lookahead or holding back reference frames for B-frames, several when catching up)
+	auto result = avcodec_send_frame(m_encoder.raw(),rawFrame);
+	if(result < 0)
+	{
+		CheckError(make_ffmpeg_error(result));
 		return;
-	m_dstFrame.raw()->pts = m_frameIndex;
-	auto packet = m_encoder.encode(m_dstFrame,errCode);
-	if(CheckError(errCode))
+	}
+	if(ReceivePackets() == false)
+		return;
+	if(IsGopParallel() && m_pendingGopFrameIndex.has_value())
+	{
+		// The frame has been held back by the codec, the writer would wait for its packet forever
+		CheckError(std::make_error_code(std::errc::not_supported));
 		return;
-	packet.setPts(av::Timestamp{m_frameIndex,m_encoder.timeBase()});
-	packet.setDts(av::Timestamp{m_frameIndex,m_encoder.timeBase()});
-	packet.setDuration(1);
-	packet.setStreamIndex(0);
+	}
+	if(convertedFrame.isPassthrough)
+		convertedFrame.passthroughFrame = {};
+	auto tEnd = std::chrono::steady_clock::now();
+	m_stageCounters.AddDuration(m_stageCounters.encodeDuration,tEnd -t);
+	m_stageCounters.encodeHistogram.Add(tEnd -t);
+	m_stageCounters.lastFrameTime = tEnd.time_since_epoch().count();
+	++m_stageCounters.numEncodedFrames;
+	++m_convertedReadIndex;
+	m_waitStrategy.Notify();
+}
+bool VideoEncoderThread::ReceivePackets()
+{
+	for(;;)
+	{
+		auto result = avcodec_receive_packet(m_encoder.raw(),m_receivedPacket);
+		if(result == AVERROR(EAGAIN) || result == AVERROR_EOF)
+			return true;
+		if(result < 0)
+		{
+			CheckError(make_ffmpeg_error(result));
+			return false;
+		}
+		// Timestamps are kept as assigned by the encoder; With B-frames the dts lags behind the pts
+		auto pts = m_receivedPacket->pts;
+		auto dts = m_receivedPacket->dts;
+		auto duration = m_receivedPacket->duration;
+		av::Packet packet {m_receivedPacket};
+		av_packet_unref(m_receivedPacket);
+		auto packetIndex = static_cast<FFMpegEncoder::PacketIndex>(m_nextPacketIndex);
+		if(IsGopParallel())
+		{
+			// The codec has emitted more than one packet for a frame, or a delayed one,
+			// so the packets can't be mapped to their frames anymore
+			if(m_pendingGopFrameIndex.has_value() == false)
+			{
+				CheckError(std::make_error_code(std::errc::not_supported));
+				return false;
+			}
+			packetIndex = *m_pendingGopFrameIndex;
+			m_pendingGopFrameIndex = {};
+		}
+		packet.setPts(av::Timestamp{pts,m_encoder.timeBase()});
+		packet.setDts(av::Timestamp{dts,m_encoder.timeBase()});
+		packet.setDuration(duration);
+		packet.setStreamIndex(m_streamIndex);
+		m_writerThread.AddPacket(packet,packetIndex);
+		++m_nextPacketIndex;
+	}
+}
+void VideoEncoderThread::Drain()
+{
+	// Signals the end of the stream, after which the encoder returns all packets it is still holding back
+	auto result = avcodec_send_frame(m_encoder.raw(),nullptr);
+	if(result < 0 && result != AVERROR_EOF)
+	{
+		CheckError(make_ffmpeg_error(result));
+		return;
+	}
+	ReceivePackets();
+}
+
+//////////////////
 
-	m_writerThread.AddPacket(packet,m_frameIndex);
-	m_isEncodingFrame = false;
-	m_currentFrameImageBuffer = nullptr;
+// Codecs without a fixed frame size (e.g. PCM) accept any number of samples per frame
+static uint32_t get_codec_frame_size(const AVCodecContext &encoder) {return (encoder.frame_size > 0) ? static_cast<uint32_t>(encoder.frame_size) : 1'024u;}
+static uint32_t calc_sample_queue_capacity(const AVCodecContext &encoder,const VideoRecorder::AudioEncodingSettings &audioSettings)
+{
+	// The queue has to hold at least one full frame, otherwise the encoder could never start
+	auto capacity = static_cast<uint64_t>(audioSettings.sampleRate) *audioSettings.bufferDuration /1'000;
+	return static_cast<uint32_t>(std::clamp<uint64_t>(capacity,get_codec_frame_size(encoder) *2,std::numeric_limits<uint32_t>::max()));
+}
+AudioEncoderThread::AudioEncoderThread(
+	VideoPacketWriterThread &writerThread,AVCodecContext &encoder,int streamIndex,const VideoRecorder::AudioEncodingSettings &audioSettings,
+	const VideoRecorder::WaitSettings &waitSettings,WaitCounters &waitCounters
+)
+	: BaseVideoThread{waitSettings,waitCounters},m_encoder{encoder},m_streamIndex{streamIndex},
+	m_sampleQueue{calc_sample_queue_capacity(encoder,audioSettings),audioSettings.channelCount *((audioSettings.sampleFormat == AudioSampleFormat::Int16) ? 2u : 4u)},
+	m_codecFrameSize{get_codec_frame_size(encoder)},m_writerThread{writerThread}
+{
+	m_padLastFrame = (encoder.frame_size > 0) && (encoder.codec->capabilities &(AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE)) == 0;
+	m_inputBuffer.resize(static_cast<size_t>(m_codecFrameSize) *m_sampleQueue.GetFrameSize());
+
+	// Only the sample format and layout are converted, the sample rate of the input matches the one of the encoder
+	auto srcSampleFormat = (audioSettings.sampleFormat == AudioSampleFormat::Int16) ? AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_FLT;
+	m_frame = av_frame_alloc();
+	m_frame->format = encoder.sample_fmt;
+	m_frame->sample_rate = encoder.sample_rate;
+	m_frame->nb_samples = m_codecFrameSize;
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57,28,100)
+	av_channel_layout_copy(&m_frame->ch_layout,&encoder.ch_layout);
+	auto result = swr_alloc_set_opts2(
+		&m_swrContext,&encoder.ch_layout,encoder.sample_fmt,encoder.sample_rate,
+		&encoder.ch_layout,srcSampleFormat,encoder.sample_rate,0,nullptr
+	);
+	if(result < 0)
+		m_swrContext = nullptr;
+#else
+	m_frame->channel_layout = encoder.channel_layout;
+	m_frame->channels = encoder.channels;
+	m_swrContext = swr_alloc_set_opts(
+		nullptr,encoder.channel_layout,encoder.sample_fmt,encoder.sample_rate,
+		encoder.channel_layout,srcSampleFormat,encoder.sample_rate,0,nullptr
+	);
+#endif
+	if(m_swrContext == nullptr || swr_init(m_swrContext) < 0 || av_frame_get_buffer(m_frame,0) < 0)
+		throw RuntimeError{"Unable to initialize audio conversion!"};
+	m_receivedPacket = av_packet_alloc();
+}
+AudioEncoderThread::~AudioEncoderThread()
+{
+	Stop();
+	swr_free(&m_swrContext);
+	av_frame_free(&m_frame);
+	av_packet_free(&m_receivedPacket);
+}
+bool AudioEncoderThread::HasFullFrame() const {return m_sampleQueue.GetAvailableFrameCount() >= m_codecFrameSize;}
+uint32_t AudioEncoderThread::WriteSamples(const uint8_t *data,uint32_t frameCount)
+{
+	uint32_t numWritten = 0;
+	while(numWritten < frameCount && IsValid())
+	{
+		numWritten += m_sampleQueue.Write(data +static_cast<size_t>(numWritten) *m_sampleQueue.GetFrameSize(),frameCount -numWritten);
+		m_waitStrategy.Notify();
+		if(numWritten < frameCount)
+			m_waitStrategy.Wait([this]() {return m_sampleQueue.GetAvailableFrameCount() < m_sampleQueue.GetCapacity() || IsValid() == false;});
+	}
+	return numWritten;
+}
+void AudioEncoderThread::Start()
+{
+	m_running = true;
+	m_thread = std::thread{[this]() {
+		trace::set_thread_name("AudioEncoderThread");
+		while(m_running && IsValid())
+		{
+			m_waitStrategy.Wait([this]() {return m_running == false || IsValid() == false || HasFullFrame();});
+			if(HasFullFrame())
+				EncodeNextFrame(m_codecFrameSize);
+		}
+	}};
+	set_thread_priority(m_thread,ThreadPriority::AboveNormal);
+}
+void AudioEncoderThread::Stop()
+{
+	if(m_thread.joinable() == false)
+		return;
+	m_running = false;
+	m_waitStrategy.Notify();
+	m_thread.join();
+	if(IsValid())
+	{
+		while(IsValid() && m_sampleQueue.GetAvailableFrameCount() > 0)
+			EncodeNextFrame(std::min(m_sampleQueue.GetAvailableFrameCount(),m_codecFrameSize));
+		auto result = avcodec_send_frame(&m_encoder,nullptr);
+		if(result < 0 && result != AVERROR_EOF)
+			CheckError(make_ffmpeg_error(result));
+		else
+			ReceivePackets();
+	}
+	// The writer must not wait for audio packets anymore, even if encoding has failed
+	m_writerThread.EndAudio();
+}
+void AudioEncoderThread::EncodeNextFrame(uint32_t sampleCount)
+{
+	trace::ScopedEvent event {"AudioEncoderThread::EncodeNextFrame","pts",m_nextPts};
+	auto numRead = m_sampleQueue.Read(m_inputBuffer.data(),sampleCount);
+	m_waitStrategy.Notify();
+	auto numSamples = numRead;
+	if(m_padLastFrame && numSamples < m_codecFrameSize)
+	{
+		// Zero is silence for both float and signed integer samples
+		auto frameSize = m_sampleQueue.GetFrameSize();
+		memset(m_inputBuffer.data() +static_cast<size_t>(numSamples) *frameSize,0,static_cast<size_t>(m_codecFrameSize -numSamples) *frameSize);
+		numSamples = m_codecFrameSize;
+	}
+	if(numSamples == 0)
+		return;
+	// The encoder may still reference the previous frame's buffers
+	auto result = av_frame_make_writable(m_frame);
+	if(result < 0)
+	{
+		CheckError(make_ffmpeg_error(result));
+		return;
+	}
+	const uint8_t *srcData = m_inputBuffer.data();
+	result = swr_convert(m_swrContext,m_frame->extended_data,numSamples,&srcData,numSamples);
+	if(result < 0)
+	{
+		CheckError(make_ffmpeg_error(result));
+		return;
+	}
+	m_frame->nb_samples = numSamples;
+	m_frame->pts = m_nextPts;
+	m_nextPts += numSamples;
+	result = avcodec_send_frame(&m_encoder,m_frame);
+	if(result < 0)
+	{
+		CheckError(make_ffmpeg_error(result));
+		return;
+	}
+	ReceivePackets();
+}
+bool AudioEncoderThread::ReceivePackets()
+{
+	auto timeBase = av::Rational{m_encoder.time_base.num,m_encoder.time_base.den};
+	for(;;)
+	{
+		auto result = avcodec_receive_packet(&m_encoder,m_receivedPacket);
+		if(result == AVERROR(EAGAIN) || result == AVERROR_EOF)
+			return true;
+		if(result < 0)
+		{
+			CheckError(make_ffmpeg_error(result));
+			return false;
+		}
+		auto pts = m_receivedPacket->pts;
+		auto dts = m_receivedPacket->dts;
+		auto duration = m_receivedPacket->duration;
+		av::Packet packet {m_receivedPacket};
+		av_packet_unref(m_receivedPacket);
+		packet.setPts(av::Timestamp{pts,timeBase});
+		packet.setDts(av::Timestamp{dts,timeBase});
+		packet.setDuration(duration);
+		packet.setStreamIndex(m_streamIndex);
+		m_writerThread.AddAudioPacket(packet);
+	}
 }
 #pragma optimize("",on)
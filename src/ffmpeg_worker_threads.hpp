@@ -5,17 +5,25 @@
 #ifndef __FFMPEG_WORKER_THREADS_HPP__
 #define __FFMPEG_WORKER_THREADS_HPP__
 
-#include <queue>
 #include <atomic>
 #include <thread>
 #include <mutex>
+#include <limits>
 #include "ffmpeg_encoder.hpp"
+#include "thread_wait_strategy.hpp"
+#include "ffmpeg_frame_converter.hpp"
+#include "audio_ring_buffer.hpp"
+
+struct SwrContext;
 
 namespace media
 {
 	class BaseVideoThread
 	{
 	public:
+		BaseVideoThread(const VideoRecorder::WaitSettings &waitSettings,WaitCounters &waitCounters)
+			: m_waitStrategy{waitSettings,waitCounters}
+		{}
 		bool IsValid() const {return m_hasError == false;}
 		std::optional<std::error_code> GetErrorCode() const {return m_hasError ? m_errorCode : std::optional<std::error_code>{};}
 	protected:
@@ -25,65 +33,253 @@ namespace media
 				return !!err;
 			m_errorCode = err;
 			m_hasError = true;
+			m_waitStrategy.Notify(); // Wake up anyone waiting on this thread
 			return !!err;
 		}
+		WaitStrategy m_waitStrategy;
 	private:
 		std::error_code m_errorCode;
 		std::atomic<bool> m_hasError = false;
 	};
 
+	// Lock-free counterpart of VideoRecorder::LatencyHistogram; Can be updated from any number of threads
+	struct LatencyHistogramCounters
+	{
+		std::array<std::atomic<uint64_t>,VideoRecorder::LatencyHistogram::BUCKET_COUNT> buckets {};
+		std::atomic<uint64_t> count = 0;
+		std::atomic<uint64_t> totalDuration = 0;
+		std::atomic<uint64_t> maxDuration = 0;
+
+		void Add(std::chrono::steady_clock::duration duration);
+		VideoRecorder::LatencyHistogram GetHistogram() const;
+	};
+
+	// Shared by all encoder threads of a recording; Times are accumulated in nanoseconds
+	struct StageCounters
+	{
+		std::atomic<uint64_t> conversionDuration = 0;
+		std::atomic<uint64_t> encodeDuration = 0;
+		std::atomic<uint64_t> submitWaitDuration = 0;
+		std::atomic<uint64_t> encoderIdleDuration = 0;
+		std::atomic<uint64_t> packetStallDuration = 0;
+		std::atomic<uint64_t> numPacketStalls = 0;
+		std::atomic<uint64_t> numConvertedFrames = 0;
+		std::atomic<uint64_t> numEncodedFrames = 0;
+		std::atomic<std::chrono::steady_clock::rep> firstFrameTime = 0;
+		std::atomic<std::chrono::steady_clock::rep> lastFrameTime = 0;
+
+		LatencyHistogramCounters submitWaitHistogram;
+		LatencyHistogramCounters rescaleHistogram;
+		LatencyHistogramCounters encodeHistogram;
+		LatencyHistogramCounters writerQueueWaitHistogram;
+		LatencyHistogramCounters writePacketHistogram;
+		std::atomic<uint32_t> maxWriterQueueDepth = 0;
+		std::atomic<uint64_t> bytesWritten = 0;
+		std::atomic<uint64_t> packetsWritten = 0;
+		std::atomic<uint64_t> framesSubmitted = 0;
+		std::atomic<uint64_t> framesSkipped = 0;
+		std::atomic<uint64_t> framesDuplicated = 0;
+
+		void AddDuration(std::atomic<uint64_t> &counter,std::chrono::steady_clock::duration duration);
+		VideoRecorder::StageTimings GetTimings() const;
+		// Everything except the current writer queue depth, which is only known to the writer thread
+		VideoRecorder::Statistics GetStatistics() const;
+	};
+
+	// Writes the packets of all encoder threads to the output in order of their packet index. Packets are handed over through
+	// a fixed-size ring indexed by packetIndex %capacity; Every index is only ever written by one producer, so producers don't
+	// need to synchronize with each other. Producers which are too far ahead of the writer have to wait for it.
+	// If there is an audio stream, its packets are queued separately and merged with the video packets by decoding timestamp.
+	// A packet is only written once the other stream has a later packet ready (or has ended), unless its queue is half full,
+	// in which case the writer stops waiting for the other stream so the producers can't stall.
 	class VideoPacketWriterThread
 		: public BaseVideoThread
 	{
 	public:
-		VideoPacketWriterThread(av::FormatContext &formatContext);
+		VideoPacketWriterThread(
+			av::FormatContext &formatContext,uint32_t capacity,const VideoRecorder::WaitSettings &waitSettings,WaitCounters &waitCounters,StageCounters &stageCounters
+		);
 		~VideoPacketWriterThread();
 		void Start();
-		void Stop(std::optional<FFMpegEncoder::FrameIndex> waitUntilFrameIndex={});
-		void AddPacket(const av::Packet &packet,FFMpegEncoder::FrameIndex frameIndex);
+		void Stop(std::optional<FFMpegEncoder::PacketIndex> waitUntilPacketIndex={});
+		// Blocks if the packet index is more than capacity packets ahead of the writer
+		void AddPacket(const av::Packet &packet,FFMpegEncoder::PacketIndex packetIndex);
+		// Has to be called before Start if the output has an audio stream
+		void EnableAudio(uint32_t capacity);
+		// Only called by the audio encoder thread; Blocks if the audio packet queue is full
+		void AddAudioPacket(const av::Packet &packet);
+		// No more audio packets will be added
+		void EndAudio();
+		// Number of video and audio packets waiting to be written
+		uint32_t GetQueuedPacketCount() const;
 	private:
-		void WritePacket(const av::Packet &packet);
+		using TimePoint = std::chrono::steady_clock::rep;
+		struct Slot
+		{
+			av::Packet packet;
+			// Time the packet has been added to the queue
+			TimePoint queueTime = 0;
+			std::atomic<bool> ready = false;
+		};
+		struct AudioSlot
+		{
+			av::Packet packet;
+			TimePoint queueTime = 0;
+		};
+		enum class StreamType : uint8_t
+		{
+			Video = 0,
+			Audio
+		};
+		void WritePacket(const av::Packet &packet,StreamType streamType);
+		void UpdateMaxQueueDepth();
+		bool IsNextPacketReady() const;
+		bool HasCapacity(FFMpegEncoder::PacketIndex packetIndex) const;
+		bool HasAudioPacket() const;
+		bool HasAudioCapacity() const;
+		bool IsVideoFinished() const;
+		bool IsAudioFinished() const;
+		// Returns the stream whose packet has to be written next, if it can be determined yet
+		std::optional<StreamType> SelectNextPacket() const;
 		void Run();
 
 		std::thread m_thread;
 		std::atomic<bool> m_running = false;
-		std::atomic<FFMpegEncoder::FrameIndex> m_nextPacketFrameIndex = 0;
-		std::condition_variable m_waitForFinalFrame = {};
+		std::atomic<FFMpegEncoder::PacketIndex> m_nextPacketIndex = 0;
 		av::FormatContext &m_formatContext;
-		std::vector<std::pair<FFMpegEncoder::FrameIndex,av::Packet>> m_packetQueue = {};
-		std::mutex m_packetQueueMutex = {};
+		std::vector<Slot> m_packetRing;
+		std::atomic<uint32_t> m_queuedPacketCount = 0;
+		// Set by Stop; Once this many video packets have been written, the video stream has ended
+		std::atomic<FFMpegEncoder::PacketIndex> m_finalPacketIndex = std::numeric_limits<FFMpegEncoder::PacketIndex>::max();
+
+		// Single-producer single-consumer ring of audio packets, already in decoding order
+		bool m_hasAudio = false;
+		std::vector<AudioSlot> m_audioPacketRing;
+		std::atomic<uint64_t> m_audioReadIndex = 0;
+		std::atomic<uint64_t> m_audioWriteIndex = 0;
+		std::atomic<bool> m_audioEnded = false;
+		StageCounters &m_stageCounters;
+	};
+
+	// Encodes the samples passed to WriteAudio on its own thread, one codec frame at a time, and hands the
+	// packets to the writer thread. Samples are passed in through a lock-free ring, so WriteAudio only has
+	// to wait if the encoder falls behind by more than the buffer duration.
+	class AudioEncoderThread
+		: public BaseVideoThread
+	{
+	public:
+		AudioEncoderThread(
+			VideoPacketWriterThread &writerThread,AVCodecContext &encoder,int streamIndex,const VideoRecorder::AudioEncodingSettings &audioSettings,
+			const VideoRecorder::WaitSettings &waitSettings,WaitCounters &waitCounters
+		);
+		~AudioEncoderThread();
+		// Returns the number of sample frames which have been queued; Less than frameCount only if the thread has failed
+		uint32_t WriteSamples(const uint8_t *data,uint32_t frameCount);
+		void Start();
+		// Encodes the remaining samples, drains the encoder and ends the audio stream of the writer thread
+		void Stop();
+	private:
+		bool HasFullFrame() const;
+		void EncodeNextFrame(uint32_t sampleCount);
+		bool ReceivePackets();
+
+		AVCodecContext &m_encoder;
+		int m_streamIndex = -1;
+		AudioRingBuffer m_sampleQueue;
+		// Number of samples per channel the codec expects per frame
+		uint32_t m_codecFrameSize = 0;
+		// If the codec can't handle a shorter last frame, it is padded with silence
+		bool m_padLastFrame = false;
+		std::vector<uint8_t> m_inputBuffer;
+		SwrContext *m_swrContext = nullptr;
+		AVFrame *m_frame = nullptr;
+		AVPacket *m_receivedPacket = nullptr;
+		int64_t m_nextPts = 0;
+		std::thread m_thread;
+		std::atomic<bool> m_running = false;
+
+		VideoPacketWriterThread &m_writerThread;
 	};
 
+	// Frames pass through two stages: The conversion thread converts queued frames to the encoder's
+	// pixel format (split into slices across a worker pool), while the encoder thread encodes previously
+	// converted frames. This way the conversion of frame N+1 overlaps with the encoding of frame N.
 	class VideoEncoderThread
 		: public BaseVideoThread
 	{
 	public:
 		VideoEncoderThread(
-			VideoPacketWriterThread &writerThread,av::VideoEncoderContext &encoder,const VideoRecorder::EncodingSettings &encodingSettings,
-			av::PixelFormat dstPixelFormat
+			VideoPacketWriterThread &writerThread,av::VideoEncoderContext &encoder,int streamIndex,const VideoRecorder::EncodingSettings &encodingSettings,
+			av::PixelFormat dstPixelFormat,WaitCounters &waitCounters,StageCounters &stageCounters
 		);
 		~VideoEncoderThread();
+		// Returns true if there are frames which have not been encoded yet
 		bool IsBusy() const;
-		void EncodeFrame(FFMpegEncoder::FrameIndex frameIndex,const uimg::ImageBuffer &imgBuf);
+		bool IsQueueFull() const;
+		uint32_t GetQueuedFrameCount() const;
+		// Number of packets handed to the writer thread so far
+		FFMpegEncoder::PacketIndex GetPacketCount() const;
+		// pts and duration are in the time base of the encoder
+		void EncodeFrame(FFMpegEncoder::FrameIndex frameIndex,int64_t pts,int64_t duration,const FrameBuffer &frameBuffer);
 		std::chrono::steady_clock::duration GetWorkDuration() const;
 		void Start();
+		// Encodes all remaining frames and drains the packets still buffered by the encoder
 		void Stop();
 	private:
-		static void InitFrameFromBufferData(av::VideoFrame &frame,const uimg::ImageBuffer &imgBuf);
-		void Run();
-		void EncodeCurrentFrame();
+		struct QueuedFrame
+		{
+			FFMpegEncoder::FrameIndex frameIndex = 0;
+			int64_t pts = 0;
+			int64_t duration = 0;
+			FrameBuffer frameBuffer = {};
+		};
+		struct ConvertedFrame
+		{
+			FFMpegEncoder::FrameIndex frameIndex = 0;
+			int64_t pts = 0;
+			int64_t duration = 0;
+			av::VideoFrame frame;
+			// Used instead of frame if the source already had the encoder's pixel format
+			av::VideoFrame passthroughFrame;
+			bool isPassthrough = false;
+		};
+		static constexpr uint32_t CONVERTED_FRAME_COUNT = 2;
+		FrameConverter *GetFrameConverter(PixelFormat srcFormat);
+		bool HasQueuedFrame() const;
+		bool HasConvertedFrame() const;
+		bool IsConvertedQueueFull() const;
+		void ConvertNextFrame();
+		void EncodeNextFrame();
+		// Hands all packets the encoder has ready to the writer thread
+		bool ReceivePackets();
+		bool IsGopParallel() const;
+		void Drain();
 
-		void *m_dataBuffer = nullptr;
-		FFMpegEncoder::FrameIndex m_frameIndex = 0;
-		std::shared_ptr<const uimg::ImageBuffer> m_currentFrameImageBuffer = nullptr;
-		std::atomic<bool> m_isEncodingFrame = false;
+		// Single-producer single-consumer ring of frames waiting to be converted. The write index is
+		// only advanced by the thread calling EncodeFrame, the read index only by the conversion thread.
+		std::vector<QueuedFrame> m_frameQueue = {};
+		std::atomic<uint64_t> m_queueReadIndex = 0;
+		std::atomic<uint64_t> m_queueWriteIndex = 0;
+		// Single-producer single-consumer ring of converted frames waiting to be encoded
+		std::array<ConvertedFrame,CONVERTED_FRAME_COUNT> m_convertedFrames = {};
+		std::atomic<uint64_t> m_convertedReadIndex = 0;
+		std::atomic<uint64_t> m_convertedWriteIndex = 0;
+		std::thread m_conversionThread;
 		std::thread m_thread;
 		std::atomic<bool> m_running = false;
-		av::VideoRescaler m_videoRescaler = {};
-		av::VideoFrame m_srcFrame;
-		av::VideoFrame m_dstFrame;
+		// One converter per source pixel format, created on demand by the conversion thread
+		std::array<std::unique_ptr<FrameConverter>,static_cast<size_t>(PixelFormat::Count)> m_frameConverters = {};
+		VideoRecorder::EncodingSettings m_encodingSettings;
+		av::PixelFormat m_dstPixelFormat;
+		WaitCounters &m_waitCounters;
 		av::VideoEncoderContext &m_encoder;
-		std::chrono::steady_clock::time_point m_startTime;
+		int m_streamIndex = 0;
+		AVPacket *m_receivedPacket = nullptr;
+		std::atomic<FFMpegEncoder::PacketIndex> m_nextPacketIndex = 0;
+		// With GOP-parallel encoding packets are ordered by the index of their frame
+		std::optional<FFMpegEncoder::FrameIndex> m_pendingGopFrameIndex = {};
+		std::atomic<std::chrono::steady_clock::rep> m_frameStartTime = 0;
+		StageCounters &m_stageCounters;
 
 		VideoPacketWriterThread &m_writerThread;
 	};
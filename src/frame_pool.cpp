@@ -0,0 +1,182 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "frame_pool.hpp"
+#include <algorithm>
+#include <new>
+
+using namespace media;
+
+// Shared with the allocators stored in the control blocks, since frames may outlive the pool
+struct FramePool::ControlBlockCache
+{
+	// Large enough for the control block of a shared_ptr with the deleter used by Acquire
+	static constexpr size_t BLOCK_SIZE = 128;
+	~ControlBlockCache()
+	{
+		for(auto *block : freeBlocks)
+			::operator delete(block);
+	}
+	void *Allocate(size_t size)
+	{
+		if(size <= BLOCK_SIZE)
+		{
+			std::scoped_lock<std::mutex> lock {mutex};
+			if(freeBlocks.empty() == false)
+			{
+				auto *block = freeBlocks.back();
+				freeBlocks.pop_back();
+				return block;
+			}
+		}
+		return ::operator new(std::max(size,BLOCK_SIZE));
+	}
+	void Free(void *block,size_t size)
+	{
+		if(size > BLOCK_SIZE)
+		{
+			::operator delete(block);
+			return;
+		}
+		std::scoped_lock<std::mutex> lock {mutex};
+		freeBlocks.push_back(block);
+	}
+	std::mutex mutex;
+	std::vector<void*> freeBlocks;
+};
+
+template<typename T>
+	struct FramePool::ControlBlockAllocator
+{
+	static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+	using value_type = T;
+	ControlBlockAllocator(const std::shared_ptr<ControlBlockCache> &cache)
+		: cache{cache}
+	{}
+	template<typename TOther>
+		ControlBlockAllocator(const ControlBlockAllocator<TOther> &other)
+		: cache{other.cache}
+	{}
+	T *allocate(size_t n) {return static_cast<T*>(cache->Allocate(n *sizeof(T)));}
+	void deallocate(T *p,size_t n) {cache->Free(p,n *sizeof(T));}
+	template<typename TOther>
+		bool operator==(const ControlBlockAllocator<TOther> &other) const {return cache == other.cache;}
+	template<typename TOther>
+		bool operator!=(const ControlBlockAllocator<TOther> &other) const {return cache != other.cache;}
+	std::shared_ptr<ControlBlockCache> cache = nullptr;
+};
+
+std::shared_ptr<FramePool> FramePool::Create(uint32_t width,uint32_t height,uimg::ImageBuffer::Format format,uint32_t size,bool growable)
+{
+	return std::shared_ptr<FramePool>{new FramePool{width,height,format,size,growable}};
+}
+
+FramePool::FramePool(uint32_t width,uint32_t height,uimg::ImageBuffer::Format format,uint32_t size,bool growable)
+	: m_width{width},m_height{height},m_format{format},m_size{std::max(size,1u)},m_growable{growable},
+	m_controlBlockCache{std::make_shared<ControlBlockCache>()}
+{
+	m_freeImages.reserve(m_size);
+}
+
+std::shared_ptr<uimg::ImageBuffer> FramePool::Acquire()
+{
+	std::shared_ptr<uimg::ImageBuffer> image = nullptr;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	{
+		std::unique_lock<std::mutex> lock {m_mutex};
+		auto canAcquire = [this]() {return m_freeImages.empty() == false || m_bufferCount < m_size || m_growable;};
+		if(canAcquire() == false)
+		{
+			++m_waitCount;
+			m_condition.wait(lock,[this,&canAcquire]() {return canAcquire() || m_interrupted;});
+		}
+		if(m_freeImages.empty() == false)
+		{
+			image = std::move(m_freeImages.back());
+			m_freeImages.pop_back();
+		}
+		else if(canAcquire() == false)
+			return nullptr;
+		else
+		{
+			++m_bufferCount;
+			width = m_width;
+			height = m_height;
+		}
+	}
+	// New buffers are allocated outside of the lock
+	if(image == nullptr)
+		image = uimg::ImageBuffer::Create(width,height,m_format);
+
+	// The deleter keeps the actual owner alive and hands it back to the pool once the last reference is gone.
+	// If the pool has been destroyed in the meantime, the buffer is simply released.
+	std::weak_ptr<FramePool> wpPool = weak_from_this();
+	return std::shared_ptr<uimg::ImageBuffer>{image.get(),[wpPool,image](uimg::ImageBuffer*) mutable {
+		auto pool = wpPool.lock();
+		if(pool)
+			pool->Release(image);
+		image = nullptr;
+	},ControlBlockAllocator<uimg::ImageBuffer>{m_controlBlockCache}};
+}
+
+void FramePool::Release(const std::shared_ptr<uimg::ImageBuffer> &image)
+{
+	{
+		std::scoped_lock<std::mutex> lock {m_mutex};
+		if(image->GetWidth() == m_width && image->GetHeight() == m_height)
+			m_freeImages.push_back(image);
+		else
+			--m_bufferCount;
+	}
+	m_condition.notify_one();
+}
+
+void FramePool::Resize(uint32_t width,uint32_t height)
+{
+	{
+		std::scoped_lock<std::mutex> lock {m_mutex};
+		if(width == m_width && height == m_height)
+			return;
+		m_width = width;
+		m_height = height;
+		m_bufferCount -= static_cast<uint32_t>(m_freeImages.size());
+		m_freeImages.clear();
+	}
+	m_condition.notify_all();
+}
+
+void FramePool::Interrupt()
+{
+	{
+		std::scoped_lock<std::mutex> lock {m_mutex};
+		m_interrupted = true;
+	}
+	m_condition.notify_all();
+}
+void FramePool::ResetInterrupt()
+{
+	std::scoped_lock<std::mutex> lock {m_mutex};
+	m_interrupted = false;
+}
+
+uint32_t FramePool::GetWidth() const
+{
+	std::scoped_lock<std::mutex> lock {m_mutex};
+	return m_width;
+}
+uint32_t FramePool::GetHeight() const
+{
+	std::scoped_lock<std::mutex> lock {m_mutex};
+	return m_height;
+}
+FramePool::Statistics FramePool::GetStatistics() const
+{
+	std::scoped_lock<std::mutex> lock {m_mutex};
+	Statistics stats {};
+	stats.bufferCount = m_bufferCount;
+	stats.freeBufferCount = static_cast<uint32_t>(m_freeImages.size());
+	stats.waitCount = m_waitCount;
+	return stats;
+}
@@ -0,0 +1,66 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __FRAME_POOL_HPP__
+#define __FRAME_POOL_HPP__
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <util_image_buffer.hpp>
+
+namespace media
+{
+	// Recycles image buffers of one size and format. Acquired images stay valid for as long as a reference
+	// to them is held; Once the last reference has been dropped, the buffer returns to the pool.
+	class FramePool
+		: public std::enable_shared_from_this<FramePool>
+	{
+	public:
+		struct Statistics
+		{
+			// Number of buffers which have been allocated in total
+			uint32_t bufferCount = 0;
+			uint32_t freeBufferCount = 0;
+			// Number of times Acquire had to wait for a buffer to be released
+			uint64_t waitCount = 0;
+		};
+		// If growable is false, Acquire waits for a buffer to be released once all size buffers are in use
+		static std::shared_ptr<FramePool> Create(uint32_t width,uint32_t height,uimg::ImageBuffer::Format format,uint32_t size,bool growable);
+		// Returns nullptr if the wait has been interrupted
+		std::shared_ptr<uimg::ImageBuffer> Acquire();
+		// Wakes up and fails all current and future calls to Acquire which would have to wait, until ResetInterrupt is called
+		void Interrupt();
+		void ResetInterrupt();
+		// Frames of the previous size which are still referenced stay valid, but are released instead of being recycled
+		void Resize(uint32_t width,uint32_t height);
+		uint32_t GetWidth() const;
+		uint32_t GetHeight() const;
+		Statistics GetStatistics() const;
+	private:
+		FramePool(uint32_t width,uint32_t height,uimg::ImageBuffer::Format format,uint32_t size,bool growable);
+		void Release(const std::shared_ptr<uimg::ImageBuffer> &image);
+		struct ControlBlockCache;
+		template<typename T>
+			struct ControlBlockAllocator;
+
+		uint32_t m_width = 0;
+		uint32_t m_height = 0;
+		uimg::ImageBuffer::Format m_format;
+		uint32_t m_size = 0;
+		bool m_growable = false;
+
+		mutable std::mutex m_mutex;
+		std::condition_variable m_condition;
+		std::vector<std::shared_ptr<uimg::ImageBuffer>> m_freeImages;
+		uint32_t m_bufferCount = 0;
+		uint64_t m_waitCount = 0;
+		bool m_interrupted = false;
+		// The control blocks of the returned frames are recycled as well, so Acquire doesn't allocate once the pool is warm
+		std::shared_ptr<ControlBlockCache> m_controlBlockCache = nullptr;
+	};
+};
+
+#endif
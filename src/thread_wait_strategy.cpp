@@ -0,0 +1,52 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "thread_wait_strategy.hpp"
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define VIDEO_RECORDER_CPU_RELAX() _mm_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+	#define VIDEO_RECORDER_CPU_RELAX() asm volatile("yield")
+#else
+	#define VIDEO_RECORDER_CPU_RELAX()
+#endif
+
+using namespace media;
+
+VideoRecorder::WaitStatistics WaitCounters::GetStatistics() const
+{
+	VideoRecorder::WaitStatistics stats {};
+	stats.spinDuration = std::chrono::nanoseconds{spinDuration.load(std::memory_order_relaxed)};
+	stats.yieldDuration = std::chrono::nanoseconds{yieldDuration.load(std::memory_order_relaxed)};
+	stats.parkedDuration = std::chrono::nanoseconds{parkedDuration.load(std::memory_order_relaxed)};
+	stats.waitCount = waitCount.load(std::memory_order_relaxed);
+	stats.parkCount = parkCount.load(std::memory_order_relaxed);
+	return stats;
+}
+
+void media::cpu_relax() {VIDEO_RECORDER_CPU_RELAX();}
+
+WaitStrategy::WaitStrategy(const VideoRecorder::WaitSettings &settings,WaitCounters &counters)
+	: m_settings{settings},m_counters{counters}
+{}
+void WaitStrategy::AddDuration(std::atomic<uint64_t> &counter,Clock::duration duration)
+{
+	counter.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(),std::memory_order_relaxed);
+}
+void WaitStrategy::Notify()
+{
+	// The notifying thread changes the state before reading m_numParked, while the waiting thread increments
+	// m_numParked before evaluating the predicate. Callers usually publish their state with a release store,
+	// which may still be reordered with the following load of m_numParked. The fence (paired with the one in
+	// Wait) prevents that, so either the waiter sees the new state or we see the waiter and no wake-up can get lost.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(m_numParked.load(std::memory_order_relaxed) == 0)
+		return;
+	// Waiter may be between evaluating the predicate and blocking; Locking the mutex ensures
+	// it has actually started waiting before we notify it
+	{
+		std::scoped_lock<std::mutex> lock {m_mutex};
+	}
+	m_condition.notify_all();
+}
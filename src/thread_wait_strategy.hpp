@@ -0,0 +1,94 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __THREAD_WAIT_STRATEGY_HPP__
+#define __THREAD_WAIT_STRATEGY_HPP__
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include "util_video_recorder.hpp"
+
+namespace media
+{
+	// Shared by all threads of a recording; Times are accumulated in nanoseconds
+	struct WaitCounters
+	{
+		std::atomic<uint64_t> spinDuration = 0;
+		std::atomic<uint64_t> yieldDuration = 0;
+		std::atomic<uint64_t> parkedDuration = 0;
+		std::atomic<uint64_t> waitCount = 0;
+		std::atomic<uint64_t> parkCount = 0;
+
+		VideoRecorder::WaitStatistics GetStatistics() const;
+	};
+
+	void cpu_relax();
+
+	// Waits for a condition by spinning for a bounded number of iterations first, then yielding
+	// and finally blocking on a condition variable. Any thread that changes state a waiter
+	// may depend on has to call Notify afterwards. The state checked by the predicate has to be
+	// either atomic or protected by a mutex which is also locked by the notifying thread.
+	class WaitStrategy
+	{
+	public:
+		WaitStrategy(const VideoRecorder::WaitSettings &settings,WaitCounters &counters);
+		template<typename TPredicate>
+			void Wait(TPredicate predicate);
+		void Notify();
+	private:
+		using Clock = std::chrono::steady_clock;
+		static void AddDuration(std::atomic<uint64_t> &counter,Clock::duration duration);
+		VideoRecorder::WaitSettings m_settings;
+		WaitCounters &m_counters;
+		std::mutex m_mutex = {};
+		std::condition_variable m_condition = {};
+		std::atomic<uint32_t> m_numParked = 0;
+	};
+};
+
+template<typename TPredicate>
+	void media::WaitStrategy::Wait(TPredicate predicate)
+{
+	if(predicate())
+		return;
+	m_counters.waitCount.fetch_add(1,std::memory_order_relaxed);
+	auto tStart = Clock::now();
+	for(auto i=decltype(m_settings.spinCount){0u};i<m_settings.spinCount;++i)
+	{
+		cpu_relax();
+		if(predicate())
+		{
+			AddDuration(m_counters.spinDuration,Clock::now() -tStart);
+			return;
+		}
+	}
+	auto tYield = Clock::now();
+	AddDuration(m_counters.spinDuration,tYield -tStart);
+	for(auto i=decltype(m_settings.yieldCount){0u};i<m_settings.yieldCount || m_settings.allowPark == false;++i)
+	{
+		std::this_thread::yield();
+		if(predicate())
+		{
+			AddDuration(m_counters.yieldDuration,Clock::now() -tYield);
+			return;
+		}
+	}
+	auto tPark = Clock::now();
+	AddDuration(m_counters.yieldDuration,tPark -tYield);
+
+	m_counters.parkCount.fetch_add(1,std::memory_order_relaxed);
+	std::unique_lock<std::mutex> lock {m_mutex};
+	// Has to be incremented before the predicate is re-evaluated, see Notify
+	m_numParked.fetch_add(1,std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	m_condition.wait(lock,predicate);
+	m_numParked.fetch_sub(1,std::memory_order_relaxed);
+	lock.unlock();
+	AddDuration(m_counters.parkedDuration,Clock::now() -tPark);
+}
+
+#endif
@@ -0,0 +1,193 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "trace_events.hpp"
+#include "util_media.hpp"
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#ifdef _WIN32
+	#include <Windows.h>
+#else
+	#include <unistd.h>
+#endif
+
+using namespace media;
+
+// Per-thread capacity; ~2.5 MiB, allocated when a thread records its first event
+static constexpr uint32_t EVENTS_PER_THREAD = 65'536;
+
+namespace
+{
+	struct TraceEvent
+	{
+		const char *name = nullptr;
+		const char *argName = nullptr;
+		int64_t argValue = 0;
+		// steady_clock time in nanoseconds
+		int64_t start = 0;
+		int64_t duration = 0;
+	};
+	// Only written by its own thread. The exporter reads the first eventCount events, which the owner never touches
+	// again until the trace is cleared. Clearing only bumps the global generation; Each thread resets its own buffer
+	// the next time it records an event, so a buffer is never reset while it is being exported.
+	struct ThreadBuffer
+	{
+		uint32_t threadId = 0;
+		// Protected by g_registryMutex
+		std::string threadName;
+		std::vector<TraceEvent> events;
+		std::atomic<uint32_t> eventCount = 0;
+		std::atomic<uint64_t> droppedCount = 0;
+		std::atomic<uint64_t> generation = 0;
+		std::atomic<bool> threadExited = false;
+	};
+	struct ThreadBufferHandle
+	{
+		~ThreadBufferHandle()
+		{
+			if(buffer)
+				buffer->threadExited = true;
+		}
+		std::shared_ptr<ThreadBuffer> buffer = nullptr;
+		const char *threadName = nullptr;
+	};
+};
+
+std::atomic<bool> trace::g_enabled = false;
+static std::atomic<uint64_t> g_generation = 0;
+static std::mutex g_registryMutex;
+static std::vector<std::shared_ptr<ThreadBuffer>> g_threadBuffers;
+static uint32_t g_nextThreadId = 1;
+static thread_local ThreadBufferHandle g_threadBuffer {};
+
+static ThreadBuffer &get_thread_buffer()
+{
+	auto &handle = g_threadBuffer;
+	if(handle.buffer != nullptr)
+		return *handle.buffer;
+	auto buffer = std::make_shared<ThreadBuffer>();
+	buffer->events.resize(EVENTS_PER_THREAD);
+	buffer->generation = g_generation.load(std::memory_order_acquire);
+	{
+		std::scoped_lock<std::mutex> lock {g_registryMutex};
+		buffer->threadId = g_nextThreadId++;
+		buffer->threadName = (handle.threadName != nullptr) ? handle.threadName : ("Thread " +std::to_string(buffer->threadId));
+		g_threadBuffers.push_back(buffer);
+	}
+	handle.buffer = std::move(buffer);
+	return *handle.buffer;
+}
+
+void trace::record_event(const char *name,const char *argName,int64_t argValue,Clock::time_point tStart,Clock::time_point tEnd)
+{
+	auto &buffer = get_thread_buffer();
+	auto generation = g_generation.load(std::memory_order_acquire);
+	if(buffer.generation.load(std::memory_order_relaxed) != generation)
+	{
+		// The trace has been cleared; The count has to be reset before the exporter can see the new generation
+		buffer.eventCount.store(0,std::memory_order_relaxed);
+		buffer.droppedCount.store(0,std::memory_order_relaxed);
+		buffer.generation.store(generation,std::memory_order_release);
+	}
+	auto index = buffer.eventCount.load(std::memory_order_relaxed);
+	if(index >= buffer.events.size())
+	{
+		buffer.droppedCount.fetch_add(1,std::memory_order_relaxed);
+		return;
+	}
+	auto &event = buffer.events[index];
+	event.name = name;
+	event.argName = argName;
+	event.argValue = argValue;
+	event.start = std::chrono::duration_cast<std::chrono::nanoseconds>(tStart.time_since_epoch()).count();
+	event.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(tEnd -tStart).count();
+	buffer.eventCount.store(index +1,std::memory_order_release);
+}
+
+void trace::set_thread_name(const char *name)
+{
+	auto &handle = g_threadBuffer;
+	handle.threadName = name;
+	if(handle.buffer == nullptr)
+		return;
+	std::scoped_lock<std::mutex> lock {g_registryMutex};
+	handle.buffer->threadName = name;
+}
+
+void media::set_tracing_enabled(bool enabled) {trace::g_enabled.store(enabled,std::memory_order_relaxed);}
+bool media::is_tracing_enabled() {return trace::is_enabled();}
+
+void media::clear_trace()
+{
+	std::scoped_lock<std::mutex> lock {g_registryMutex};
+	g_generation.fetch_add(1,std::memory_order_acq_rel);
+	// Buffers of threads which have ended can't be reused
+	g_threadBuffers.erase(
+		std::remove_if(g_threadBuffers.begin(),g_threadBuffers.end(),[](const std::shared_ptr<ThreadBuffer> &buffer) {return buffer->threadExited.load();}),
+		g_threadBuffers.end()
+	);
+}
+
+static std::string escape_json(const std::string &str)
+{
+	std::string result;
+	result.reserve(str.size());
+	for(auto c : str)
+	{
+		if(c == '"' || c == '\\')
+			result += '\\';
+		if(static_cast<unsigned char>(c) >= 0x20)
+			result += c;
+	}
+	return result;
+}
+
+std::string media::export_trace()
+{
+#ifdef _WIN32
+	auto pid = static_cast<uint64_t>(GetCurrentProcessId());
+#else
+	auto pid = static_cast<uint64_t>(getpid());
+#endif
+	std::stringstream ss;
+	ss.imbue(std::locale::classic());
+	ss.setf(std::ios::fixed);
+	ss.precision(3);
+	ss <<"{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	auto first = true;
+	auto separator = [&ss,&first]() {
+		ss <<(first ? "\n" : ",\n");
+		first = false;
+	};
+	uint64_t droppedCount = 0;
+	std::scoped_lock<std::mutex> lock {g_registryMutex};
+	auto generation = g_generation.load(std::memory_order_acquire);
+	for(auto &buffer : g_threadBuffers)
+	{
+		// Buffers which haven't been reset since the last clear only contain discarded events
+		if(buffer->generation.load(std::memory_order_acquire) != generation)
+			continue;
+		auto eventCount = buffer->eventCount.load(std::memory_order_acquire);
+		droppedCount += buffer->droppedCount.load(std::memory_order_relaxed);
+		separator();
+		ss <<"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" <<pid <<",\"tid\":" <<buffer->threadId <<",\"args\":{\"name\":\"" <<escape_json(buffer->threadName) <<"\"}}";
+		for(auto i=decltype(eventCount){0u};i<eventCount;++i)
+		{
+			auto &event = buffer->events[i];
+			separator();
+			// Timestamps are in microseconds
+			ss <<"{\"name\":\"" <<event.name <<"\",\"cat\":\"media\",\"ph\":\"X\",\"pid\":" <<pid <<",\"tid\":" <<buffer->threadId;
+			ss <<",\"ts\":" <<(event.start /1'000.0) <<",\"dur\":" <<(event.duration /1'000.0);
+			if(event.argName != nullptr)
+				ss <<",\"args\":{\"" <<event.argName <<"\":" <<event.argValue <<"}";
+			ss <<"}";
+		}
+	}
+	ss <<"\n],\"otherData\":{\"droppedEventCount\":" <<droppedCount <<"}}\n";
+	return ss.str();
+}
@@ -0,0 +1,53 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __TRACE_EVENTS_HPP__
+#define __TRACE_EVENTS_HPP__
+
+#include <cinttypes>
+#include <atomic>
+#include <chrono>
+
+namespace media::trace
+{
+	using Clock = std::chrono::steady_clock;
+	extern std::atomic<bool> g_enabled;
+	inline bool is_enabled() {return g_enabled.load(std::memory_order_relaxed);}
+
+	// Appends a complete event to the buffer of the calling thread. The strings are not copied and have to be literals.
+	// Events are dropped once the buffer of the thread is full.
+	void record_event(const char *name,const char *argName,int64_t argValue,Clock::time_point tStart,Clock::time_point tEnd);
+	// Name the calling thread is shown with in the exported trace
+	void set_thread_name(const char *name);
+
+	// Records the time between construction and destruction as one event. If tracing is disabled at construction,
+	// nothing is recorded and no time is queried.
+	class ScopedEvent
+	{
+	public:
+		ScopedEvent(const char *name,const char *argName=nullptr,int64_t argValue=0)
+			: m_name{is_enabled() ? name : nullptr},m_argName{argName},m_argValue{argValue}
+		{
+			if(m_name != nullptr)
+				m_tStart = Clock::now();
+		}
+		~ScopedEvent()
+		{
+			if(m_name != nullptr)
+				record_event(m_name,m_argName,m_argValue,m_tStart,Clock::now());
+		}
+		ScopedEvent(const ScopedEvent&)=delete;
+		ScopedEvent &operator=(const ScopedEvent&)=delete;
+		bool IsActive() const {return m_name != nullptr;}
+		// For arguments which are only known once the event has ended
+		void SetArgument(int64_t value) {m_argValue = value;}
+	private:
+		const char *m_name = nullptr;
+		const char *m_argName = nullptr;
+		int64_t m_argValue = 0;
+		Clock::time_point m_tStart {};
+	};
+};
+
+#endif
@@ -3,30 +3,161 @@
 * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "util_ffmpeg.hpp"
+#include "util_mapped_file.hpp"
 #include <fsys/filesystem.h>
+#include <averror.h>
+#include <cstring>
+#include <new>
+extern "C" {
+	#include <libavcodec/avcodec.h>
+	#include <libavutil/pixfmt.h>
+	#include <libavutil/buffer.h>
+}
 
 using namespace media;
 
-AVFileIO::AVFileIO(const std::shared_ptr<ICustomFile> &fileInterface)
+void AVFileIO::AlignedDeleter::operator()(uint8_t *p) const {::operator delete[](p,std::align_val_t{WRITE_BUFFER_ALIGNMENT});}
+AVFileIO::AVFileIO(const std::shared_ptr<ICustomFile> &fileInterface,size_t writeBufferSize)
 	: m_fileInterface{fileInterface}
-{}
+{
+	if(writeBufferSize == 0)
+		return;
+	m_writeBufferCapacity = ((writeBufferSize +WRITE_BUFFER_ALIGNMENT -1) /WRITE_BUFFER_ALIGNMENT) *WRITE_BUFFER_ALIGNMENT;
+	for(auto &buffer : m_writeBuffers)
+		buffer.data = std::unique_ptr<uint8_t[],AlignedDeleter>{static_cast<uint8_t*>(::operator new[](m_writeBufferCapacity,std::align_val_t{WRITE_BUFFER_ALIGNMENT}))};
+	m_flushThread = std::thread{[this]() {RunFlushThread();}};
+}
+AVFileIO::~AVFileIO()
+{
+	flush();
+	if(m_flushThread.joinable())
+	{
+		{
+			std::scoped_lock<std::mutex> lock {m_flushMutex};
+			m_stopFlushThread = true;
+		}
+		m_flushCondition.notify_all();
+		m_flushThread.join();
+	}
+}
 bool AVFileIO::open(const std::string &fileName)
 {
 	m_fileName = fileName;
 	return m_fileInterface->open(fileName);
 }
-ssize_t AVFileIO::write(const uint8_t *data, size_t size)
+bool AVFileIO::IsBuffered() const {return m_writeBufferCapacity > 0;}
+bool AVFileIO::WriteToFile(const uint8_t *data,size_t size)
 {
 	auto res = m_fileInterface->write(data,size);
-	return res.has_value() ? *res : -1;
+	++m_writeCallCount;
+	if(res.has_value())
+		m_bytesWritten += *res;
+	return res.has_value() && *res == size;
+}
+void AVFileIO::RunFlushThread()
+{
+	std::unique_lock<std::mutex> lock {m_flushMutex};
+	for(;;)
+	{
+		m_flushCondition.wait(lock,[this]() {return m_pendingBuffer.has_value() || m_stopFlushThread;});
+		if(m_pendingBuffer.has_value() == false)
+			return;
+		auto &buffer = m_writeBuffers.at(*m_pendingBuffer);
+		lock.unlock();
+
+		auto success = WriteToFile(buffer.data.get(),buffer.size);
+		buffer.size = 0;
+
+		lock.lock();
+		if(success == false)
+			m_writeFailed = true;
+		m_pendingBuffer = {};
+		m_flushCondition.notify_all();
+	}
+}
+bool AVFileIO::WaitForPendingWrite()
+{
+	std::unique_lock<std::mutex> lock {m_flushMutex};
+	m_flushCondition.wait(lock,[this]() {return m_pendingBuffer.has_value() == false;});
+	return m_writeFailed == false;
+}
+bool AVFileIO::SubmitActiveBuffer()
+{
+	// Only one buffer can be in flight, the other one is the one we're about to switch to
+	if(WaitForPendingWrite() == false)
+		return false;
+	{
+		std::scoped_lock<std::mutex> lock {m_flushMutex};
+		m_pendingBuffer = m_activeBuffer;
+	}
+	m_flushCondition.notify_all();
+	m_activeBuffer = (m_activeBuffer +1) %m_writeBuffers.size();
+	return true;
+}
+bool AVFileIO::flush()
+{
+	if(IsBuffered() == false)
+		return true;
+	if(WaitForPendingWrite() == false)
+		return false;
+	auto &buffer = m_writeBuffers.at(m_activeBuffer);
+	if(buffer.size == 0)
+		return true;
+	auto success = WriteToFile(buffer.data.get(),buffer.size);
+	buffer.size = 0;
+	if(success == false)
+	{
+		std::scoped_lock<std::mutex> lock {m_flushMutex};
+		m_writeFailed = true;
+	}
+	return success;
+}
+bool AVFileIO::sync() {return flush() && m_fileInterface->sync();}
+AVFileIO::Statistics AVFileIO::getStatistics() const
+{
+	Statistics stats {};
+	stats.bytesWritten = m_bytesWritten;
+	stats.writeCallCount = m_writeCallCount;
+	return stats;
+}
+ssize_t AVFileIO::write(const uint8_t *data, size_t size)
+{
+	if(IsBuffered() == false)
+	{
+		auto res = m_fileInterface->write(data,size);
+		++m_writeCallCount;
+		if(res.has_value())
+			m_bytesWritten += *res;
+		return res.has_value() ? *res : -1;
+	}
+	auto remaining = size;
+	while(remaining > 0)
+	{
+		auto &buffer = m_writeBuffers.at(m_activeBuffer);
+		auto n = std::min(remaining,m_writeBufferCapacity -buffer.size);
+		memcpy(buffer.data.get() +buffer.size,data,n);
+		buffer.size += n;
+		data += n;
+		remaining -= n;
+		if(buffer.size == m_writeBufferCapacity && SubmitActiveBuffer() == false)
+			return -1;
+	}
+	return size;
 }
 ssize_t AVFileIO::read(uint8_t *data, size_t size)
 {
+	// Buffered data has to reach the file first, the muxer may read back what it has written
+	if(flush() == false)
+		return -1;
 	auto res = m_fileInterface->read(data,size);
 	return res.has_value() ? *res : -1;
 }
 int64_t AVFileIO::seek(int64_t offset, int whence)
 {
+	// The muxer seeks back to patch headers and indices; Everything written
+	// so far has to end up at the position it was written for
+	if(flush() == false)
+		return -1;
 	auto res = m_fileInterface->seek(offset,whence);
 	return res.has_value() ? *res : -1;
 }
@@ -71,8 +202,148 @@ const char *AVFileIOFSys::name() const
 
 /////////////
 
+AVFileIOMapped::AVFileIOMapped(const std::shared_ptr<MappedFile> &mappedFile,uint64_t readAheadSize)
+	: m_mappedFile{mappedFile},m_readAheadSize{readAheadSize}
+{}
+ssize_t AVFileIOMapped::write(const uint8_t *data, size_t size) {return -1;}
+ssize_t AVFileIOMapped::read(uint8_t *data, size_t size)
+{
+	auto fileSize = m_mappedFile->GetSize();
+	if(m_position >= fileSize)
+		return AVERROR_EOF;
+	size = std::min<uint64_t>(size,fileSize -m_position);
+	if(m_readAheadSize > 0 && (m_position < m_prefetchStart || (m_position +size +m_readAheadSize /2 > m_prefetchEnd && m_prefetchEnd < fileSize)))
+	{
+		// Request the next window once the reads are halfway through the previous one, or have jumped elsewhere
+		m_mappedFile->Prefetch(m_position,m_readAheadSize);
+		m_prefetchStart = m_position;
+		m_prefetchEnd = std::min(m_position +m_readAheadSize,fileSize);
+	}
+	memcpy(data,m_mappedFile->GetData() +m_position,size);
+	m_position += size;
+	return size;
+}
+int64_t AVFileIOMapped::seek(int64_t offset, int whence)
+{
+	auto fileSize = static_cast<int64_t>(m_mappedFile->GetSize());
+	int64_t newPos = 0;
+	switch(whence & ~AVSEEK_FORCE)
+	{
+		case AVSEEK_SIZE:
+			return fileSize;
+		case SEEK_SET:
+			newPos = offset;
+			break;
+		case SEEK_CUR:
+			newPos = m_position +offset;
+			break;
+		case SEEK_END:
+			newPos = fileSize +offset;
+			break;
+		default:
+			return -1;
+	}
+	if(newPos < 0)
+		return -1;
+	m_position = newPos;
+	return newPos;
+}
+int AVFileIOMapped::seekable() const {return AVIO_SEEKABLE_NORMAL;}
+const char *AVFileIOMapped::name() const {return m_mappedFile->GetFileName().c_str();}
+
+/////////////
+
 void media::check_error(std::error_code errCode)
 {
 	if(errCode)
 		throw RuntimeError{"AVCPP Error: " +errCode.message()};
 }
+
+std::error_code media::make_ffmpeg_error(int avError) {return std::error_code{avError,av::ffmpeg_category()};}
+
+AVPixelFormat media::to_av_pixel_format(PixelFormat format)
+{
+	switch(format)
+	{
+		case PixelFormat::RGBA8:
+			return AV_PIX_FMT_RGBA;
+		case PixelFormat::BGRA8:
+			return AV_PIX_FMT_BGRA;
+		case PixelFormat::RGB8:
+			return AV_PIX_FMT_RGB24;
+		case PixelFormat::RGBA16F:
+#ifdef AV_PIX_FMT_RGBAF16
+			return AV_PIX_FMT_RGBAF16;
+#else
+			return AV_PIX_FMT_NONE;
+#endif
+		case PixelFormat::RGBA32F:
+#ifdef AV_PIX_FMT_RGBAF32
+			return AV_PIX_FMT_RGBAF32;
+#else
+			return AV_PIX_FMT_NONE;
+#endif
+		case PixelFormat::YUV420P:
+			return AV_PIX_FMT_YUV420P;
+		case PixelFormat::NV12:
+			return AV_PIX_FMT_NV12;
+	}
+	return AV_PIX_FMT_NONE;
+}
+
+int media::to_av_thread_type(CodecThreadType type)
+{
+	switch(type)
+	{
+		case CodecThreadType::Frame:
+			return FF_THREAD_FRAME;
+		case CodecThreadType::Slice:
+			return FF_THREAD_SLICE;
+		default:
+			return FF_THREAD_FRAME | FF_THREAD_SLICE;
+	}
+}
+
+std::optional<PixelFormat> media::from_av_pixel_format(AVPixelFormat format)
+{
+	// Full-range YUV variants (e.g. AV_PIX_FMT_YUVJ420P) are intentionally not mapped, PixelFormat implies limited range
+	for(auto i=0u;i<static_cast<uint32_t>(PixelFormat::Count);++i)
+	{
+		auto pixelFormat = static_cast<PixelFormat>(i);
+		auto avFormat = to_av_pixel_format(pixelFormat);
+		if(avFormat != AV_PIX_FMT_NONE && avFormat == format)
+			return pixelFormat;
+	}
+	return {};
+}
+
+av::VideoFrame media::wrap_frame_buffer(const FrameBuffer &frameBuffer)
+{
+	auto *frame = av_frame_alloc();
+	if(frame == nullptr)
+		throw RuntimeError{"Unable to allocate frame!"};
+	frame->format = to_av_pixel_format(frameBuffer.format);
+	frame->width = frameBuffer.width;
+	frame->height = frameBuffer.height;
+	for(auto i=0u;i<frameBuffer.data.size();++i)
+	{
+		frame->data[i] = const_cast<uint8_t*>(frameBuffer.data[i]);
+		frame->linesize[i] = frameBuffer.lineSize[i];
+	}
+	// The buffer only exists to tie the lifetime of the owner to the lifetime of the frame
+	auto *owner = new std::shared_ptr<const void>{frameBuffer.owner};
+	frame->buf[0] = av_buffer_create(
+		frame->data[0],static_cast<size_t>(frameBuffer.lineSize[0]) *frameBuffer.height,
+		[](void *opaque,uint8_t *data) {delete static_cast<std::shared_ptr<const void>*>(opaque);},
+		owner,AV_BUFFER_FLAG_READONLY
+	);
+	if(frame->buf[0] == nullptr)
+	{
+		delete owner;
+		av_frame_free(&frame);
+		throw RuntimeError{"Unable to allocate frame buffer!"};
+	}
+	av::VideoFrame result {frame};
+	av_frame_free(&frame);
+	return result;
+}
@@ -6,25 +6,77 @@
 #define __UTIL_FFMPEG_HPP__
 
 #include <formatcontext.h>
+#include <frame.h>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include "util_media.hpp"
 
 class VFilePtrInternal;
+namespace media {class MappedFile;};
 using VFilePtr = std::shared_ptr<VFilePtrInternal>;
 namespace media
 {
+	// If writeBufferSize is larger than 0, the muxer output is collected in two buffers of that size. Once one is full,
+	// it is written to the file interface on a background thread while the other one is being filled. This way the
+	// file interface only receives a few large writes, instead of one per avio flush.
 	struct AVFileIO
 		: public av::CustomIO
 	{
-		AVFileIO(const std::shared_ptr<ICustomFile> &fileInterface);
+		static constexpr size_t WRITE_BUFFER_ALIGNMENT = 4'096;
+		struct Statistics
+		{
+			uint64_t bytesWritten = 0;
+			// Number of calls to ICustomFile::write
+			uint64_t writeCallCount = 0;
+		};
+		AVFileIO(const std::shared_ptr<ICustomFile> &fileInterface,size_t writeBufferSize=0);
+		virtual ~AVFileIO() override;
 		bool open(const std::string &fileName);
 		virtual ssize_t write(const uint8_t *data, size_t size) override;
 		virtual ssize_t read(uint8_t *data, size_t size) override;
 		virtual int64_t seek(int64_t offset, int whence) override;
 		virtual int seekable() const override;
 		virtual const char *name() const override;
+		// Writes all buffered data to the file interface; Returns false if any write has failed
+		bool flush();
+		// Flushes the buffered data and waits until the file interface has written it; Returns false if any write has failed
+		bool sync();
+		Statistics getStatistics() const;
 	private:
+		struct AlignedDeleter
+		{
+			void operator()(uint8_t *p) const;
+		};
+		struct WriteBuffer
+		{
+			std::unique_ptr<uint8_t[],AlignedDeleter> data = nullptr;
+			size_t size = 0;
+		};
+		bool IsBuffered() const;
+		bool WriteToFile(const uint8_t *data,size_t size);
+		bool SubmitActiveBuffer();
+		bool WaitForPendingWrite();
+		void RunFlushThread();
+
 		std::string m_fileName;
 		std::shared_ptr<ICustomFile> m_fileInterface = nullptr;
+
+		std::array<WriteBuffer,2> m_writeBuffers {};
+		size_t m_writeBufferCapacity = 0;
+		uint32_t m_activeBuffer = 0;
+		// Index of the buffer which is being written by the flush thread
+		std::optional<uint32_t> m_pendingBuffer = {};
+		bool m_writeFailed = false;
+		bool m_stopFlushThread = false;
+		std::mutex m_flushMutex;
+		std::condition_variable m_flushCondition;
+		std::thread m_flushThread;
+
+		std::atomic<uint64_t> m_bytesWritten = 0;
+		std::atomic<uint64_t> m_writeCallCount = 0;
 	};
 
 	struct AVFileIOFSys
@@ -41,7 +93,36 @@ namespace media
 		VFilePtr m_file = nullptr;
 	};
 
+	// Serves avio reads straight from a shared memory mapping of the file. Seeking and size queries don't
+	// involve any syscalls; The OS is asked to prefetch readAheadSize bytes ahead of the read position.
+	struct AVFileIOMapped
+		: public av::CustomIO
+	{
+		AVFileIOMapped(const std::shared_ptr<MappedFile> &mappedFile,uint64_t readAheadSize);
+		virtual ssize_t write(const uint8_t *data, size_t size) override;
+		virtual ssize_t read(uint8_t *data, size_t size) override;
+		virtual int64_t seek(int64_t offset, int whence) override;
+		virtual int seekable() const override;
+		virtual const char *name() const override;
+	private:
+		std::shared_ptr<MappedFile> m_mappedFile = nullptr;
+		uint64_t m_position = 0;
+		uint64_t m_readAheadSize = 0;
+		// Range which has already been prefetched
+		uint64_t m_prefetchStart = 0;
+		uint64_t m_prefetchEnd = 0;
+	};
+
 	void check_error(std::error_code errCode);
+	std::error_code make_ffmpeg_error(int avError);
+	// Returns AV_PIX_FMT_NONE if the format is not available in the FFmpeg version this library was built against
+	AVPixelFormat to_av_pixel_format(PixelFormat format);
+	std::optional<PixelFormat> from_av_pixel_format(AVPixelFormat format);
+	// Returns the FF_THREAD_* flags for AVCodecContext::thread_type
+	int to_av_thread_type(CodecThreadType type);
+	// Creates a frame which references the data of the frame buffer without copying it; The owner
+	// of the frame buffer is kept alive until all references to the frame have been released
+	av::VideoFrame wrap_frame_buffer(const FrameBuffer &frameBuffer);
 };
 
 #endif
@@ -0,0 +1,132 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mapped_file.hpp"
+#include <unordered_map>
+#include <mutex>
+#include <filesystem>
+#include <algorithm>
+#ifdef _WIN32
+	#include <Windows.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+using namespace media;
+
+static std::mutex g_mappedFileMutex;
+static std::unordered_map<std::string,std::weak_ptr<MappedFile>> g_mappedFiles;
+
+std::shared_ptr<MappedFile> MappedFile::Open(const std::string &fileName)
+{
+	std::error_code errCode;
+	auto canonicalPath = std::filesystem::weakly_canonical(fileName,errCode).string();
+	if(errCode)
+		canonicalPath = fileName;
+
+	std::scoped_lock<std::mutex> lock {g_mappedFileMutex};
+	auto it = g_mappedFiles.find(canonicalPath);
+	if(it != g_mappedFiles.end())
+	{
+		auto mappedFile = it->second.lock();
+		if(mappedFile)
+			return mappedFile;
+	}
+	auto mappedFile = std::shared_ptr<MappedFile>{new MappedFile{fileName}};
+	if(mappedFile->Map() == false)
+		return nullptr;
+	g_mappedFiles[canonicalPath] = mappedFile;
+
+	// Clean up entries of mappings which have been released in the meantime
+	for(auto it=g_mappedFiles.begin();it!=g_mappedFiles.end();)
+	{
+		if(it->second.expired())
+			it = g_mappedFiles.erase(it);
+		else
+			++it;
+	}
+	return mappedFile;
+}
+
+MappedFile::MappedFile(const std::string &fileName)
+	: m_fileName{fileName}
+{}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	if(m_data)
+		UnmapViewOfFile(m_data);
+	if(m_mappingHandle)
+		CloseHandle(m_mappingHandle);
+	if(m_fileHandle && m_fileHandle != INVALID_HANDLE_VALUE)
+		CloseHandle(m_fileHandle);
+#else
+	if(m_data)
+		munmap(const_cast<uint8_t*>(m_data),m_size);
+#endif
+}
+
+bool MappedFile::Map()
+{
+#ifdef _WIN32
+	m_fileHandle = CreateFileA(m_fileName.c_str(),GENERIC_READ,FILE_SHARE_READ,nullptr,OPEN_EXISTING,FILE_FLAG_SEQUENTIAL_SCAN,nullptr);
+	if(m_fileHandle == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if(GetFileSizeEx(m_fileHandle,&size) == FALSE || size.QuadPart == 0)
+		return false;
+	m_size = size.QuadPart;
+	m_mappingHandle = CreateFileMappingA(m_fileHandle,nullptr,PAGE_READONLY,0,0,nullptr);
+	if(m_mappingHandle == nullptr)
+		return false;
+	m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mappingHandle,FILE_MAP_READ,0,0,0));
+	return m_data != nullptr;
+#else
+	auto fd = ::open(m_fileName.c_str(),O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return false;
+	struct stat st;
+	if(fstat(fd,&st) != 0 || st.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+	m_size = st.st_size;
+	auto *data = mmap(nullptr,m_size,PROT_READ,MAP_SHARED,fd,0);
+	// The mapping stays valid after the descriptor has been closed
+	::close(fd);
+	if(data == MAP_FAILED)
+		return false;
+	m_data = static_cast<const uint8_t*>(data);
+	// Videos are mostly read front to back, which lets the kernel read ahead more aggressively
+	madvise(data,m_size,MADV_SEQUENTIAL);
+	return true;
+#endif
+}
+
+const uint8_t *MappedFile::GetData() const {return m_data;}
+uint64_t MappedFile::GetSize() const {return m_size;}
+const std::string &MappedFile::GetFileName() const {return m_fileName;}
+
+void MappedFile::Prefetch(uint64_t offset,uint64_t size) const
+{
+	if(offset >= m_size)
+		return;
+	size = std::min(size,m_size -offset);
+#ifdef _WIN32
+	WIN32_MEMORY_RANGE_ENTRY range;
+	range.VirtualAddress = const_cast<uint8_t*>(m_data +offset);
+	range.NumberOfBytes = size;
+	PrefetchVirtualMemory(GetCurrentProcess(),1,&range,0);
+#else
+	// madvise requires a page-aligned address
+	static const auto pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+	auto alignedOffset = offset -(offset %pageSize);
+	madvise(const_cast<uint8_t*>(m_data +alignedOffset),size +(offset -alignedOffset),MADV_WILLNEED);
+#endif
+}
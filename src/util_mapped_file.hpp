@@ -0,0 +1,44 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MAPPED_FILE_HPP__
+#define __UTIL_MAPPED_FILE_HPP__
+
+#include <cinttypes>
+#include <cstddef>
+#include <string>
+#include <memory>
+
+namespace media
+{
+	// Read-only memory mapping of a local file. Mappings are shared: Opening a file
+	// which is already mapped returns the existing mapping.
+	class MappedFile
+	{
+	public:
+		static std::shared_ptr<MappedFile> Open(const std::string &fileName);
+		~MappedFile();
+		MappedFile(const MappedFile&)=delete;
+		MappedFile &operator=(const MappedFile&)=delete;
+
+		const uint8_t *GetData() const;
+		uint64_t GetSize() const;
+		const std::string &GetFileName() const;
+		// Asks the OS to page in the given range ahead of time; Doesn't block
+		void Prefetch(uint64_t offset,uint64_t size) const;
+	private:
+		MappedFile(const std::string &fileName);
+		bool Map();
+
+		std::string m_fileName;
+		const uint8_t *m_data = nullptr;
+		uint64_t m_size = 0;
+#ifdef _WIN32
+		void *m_fileHandle = nullptr;
+		void *m_mappingHandle = nullptr;
+#endif
+	};
+};
+
+#endif
@@ -0,0 +1,321 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_posix_file.hpp"
+
+#ifdef __linux__
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+extern "C" {
+	#include <libavformat/avio.h>
+}
+
+using namespace media;
+
+void PosixFile::AlignedDeleter::operator()(uint8_t *p) const {::operator delete[](p,std::align_val_t{BUFFER_ALIGNMENT});}
+
+PosixFile::PosixFile()
+	: PosixFile{Settings{}}
+{}
+PosixFile::PosixFile(const Settings &settings)
+	: m_settings{settings}
+{
+	m_settings.bufferSize = std::max<size_t>(((m_settings.bufferSize +BUFFER_ALIGNMENT -1) /BUFFER_ALIGNMENT) *BUFFER_ALIGNMENT,BUFFER_ALIGNMENT);
+	m_settings.maxPendingBuffers = std::max(m_settings.maxPendingBuffers,1u);
+}
+PosixFile::~PosixFile()
+{
+	close();
+}
+bool PosixFile::open(const std::string &fileName)
+{
+	close();
+	// Reads are rare (some muxers read back what they've written), but have to be possible
+	auto flags = O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC;
+	m_bufferedFd = ::open(fileName.c_str(),flags,0644);
+	if(m_bufferedFd == -1)
+		return false;
+	m_fd = m_bufferedFd;
+	if(m_settings.directIo)
+	{
+		// If the file system doesn't support O_DIRECT, all writes simply go through the page cache
+		auto directFd = ::open(fileName.c_str(),(flags & ~O_TRUNC) | O_DIRECT,0644);
+		if(directFd != -1)
+			m_fd = directFd;
+	}
+	m_position = 0;
+	m_fileSize = 0;
+	m_preallocatedSize = 0;
+	m_bytesSinceSync = 0;
+	m_writeFailed = false;
+	m_errorCode = 0;
+	m_isSynced = false;
+	m_stopIoThread = false;
+
+	// One buffer is filled by the caller while the others are queued
+	m_buffers.resize(m_settings.maxPendingBuffers +1);
+	m_freeBuffers.clear();
+	m_queuedBuffers.clear();
+	for(auto i=decltype(m_buffers.size()){0u};i<m_buffers.size();++i)
+	{
+		auto &buffer = m_buffers.at(i);
+		if(buffer.data == nullptr)
+			buffer.data = std::unique_ptr<uint8_t[],AlignedDeleter>{static_cast<uint8_t*>(::operator new[](m_settings.bufferSize,std::align_val_t{BUFFER_ALIGNMENT}))};
+		buffer.size = 0;
+		m_freeBuffers.push_back(i);
+	}
+	m_ioThread = std::thread{[this]() {RunIoThread();}};
+	return true;
+}
+void PosixFile::close()
+{
+	if(m_bufferedFd == -1)
+		return;
+	// Errors of the I/O thread have already been recorded
+	Drain();
+	{
+		std::scoped_lock<std::mutex> lock {m_ioMutex};
+		m_stopIoThread = true;
+	}
+	m_ioCondition.notify_all();
+	if(m_ioThread.joinable())
+		m_ioThread.join();
+
+	if(m_settings.syncMode != SyncMode::None && m_isSynced == false && Sync() == false)
+		SetError(errno);
+	// Releases the space which has been preallocated beyond the end of the file
+	if(m_preallocatedSize > m_fileSize && ftruncate(m_bufferedFd,m_fileSize) != 0)
+		SetError(errno);
+	// Some file systems (e.g. NFS) only report write errors on close
+	if(m_fd != m_bufferedFd && ::close(m_fd) != 0)
+		SetError(errno);
+	if(::close(m_bufferedFd) != 0)
+		SetError(errno);
+	m_fd = -1;
+	m_bufferedFd = -1;
+}
+bool PosixFile::AcquireStagingBuffer()
+{
+	std::unique_lock<std::mutex> lock {m_ioMutex};
+	if(m_freeBuffers.empty())
+	{
+		++m_stallCount;
+		m_ioCondition.wait(lock,[this]() {return m_freeBuffers.empty() == false || m_writeFailed;});
+	}
+	if(m_writeFailed)
+		return false;
+	m_stagingBuffer = m_freeBuffers.front();
+	m_freeBuffers.pop_front();
+	auto &buffer = m_buffers.at(*m_stagingBuffer);
+	buffer.size = 0;
+	buffer.offset = m_position;
+	return true;
+}
+void PosixFile::SubmitStagingBuffer()
+{
+	if(m_stagingBuffer.has_value() == false)
+		return;
+	{
+		std::scoped_lock<std::mutex> lock {m_ioMutex};
+		m_queuedBuffers.push_back(*m_stagingBuffer);
+	}
+	m_stagingBuffer = {};
+	m_ioCondition.notify_all();
+}
+bool PosixFile::Drain()
+{
+	SubmitStagingBuffer();
+	std::unique_lock<std::mutex> lock {m_ioMutex};
+	// The I/O thread only returns a buffer to the free list once it has been written
+	m_ioCondition.wait(lock,[this]() {return m_freeBuffers.size() == m_buffers.size() || m_writeFailed;});
+	return m_writeFailed == false;
+}
+std::optional<uint64_t> PosixFile::write(const uint8_t *data, size_t size)
+{
+	if(m_bufferedFd == -1)
+		return {};
+	m_isSynced = false;
+	auto remaining = size;
+	while(remaining > 0)
+	{
+		if(m_stagingBuffer.has_value())
+		{
+			// Writes which don't continue the staging buffer (i.e. after a seek) need a buffer of their own
+			auto &buffer = m_buffers.at(*m_stagingBuffer);
+			if(buffer.offset +buffer.size != m_position || buffer.size == m_settings.bufferSize)
+				SubmitStagingBuffer();
+		}
+		if(m_stagingBuffer.has_value() == false && AcquireStagingBuffer() == false)
+			return {};
+		auto &buffer = m_buffers.at(*m_stagingBuffer);
+		auto n = std::min(remaining,m_settings.bufferSize -buffer.size);
+		memcpy(buffer.data.get() +buffer.size,data,n);
+		buffer.size += n;
+		data += n;
+		remaining -= n;
+		m_position += n;
+		m_fileSize = std::max(m_fileSize,m_position);
+	}
+	return size;
+}
+std::optional<uint64_t> PosixFile::read(uint8_t *data, size_t size)
+{
+	if(m_bufferedFd == -1 || Drain() == false)
+		return {};
+	auto res = pread(m_bufferedFd,data,size,m_position);
+	if(res < 0)
+		return {};
+	m_position += res;
+	return res;
+}
+std::optional<uint64_t> PosixFile::seek(int64_t offset, int whence)
+{
+	if(m_bufferedFd == -1)
+		return {};
+	// Writes are positioned explicitly, so seeking doesn't affect the I/O thread
+	switch(whence & ~AVSEEK_FORCE)
+	{
+		case AVSEEK_SIZE:
+			return m_fileSize;
+		case SEEK_SET:
+			m_position = offset;
+			break;
+		case SEEK_CUR:
+			m_position += offset;
+			break;
+		case SEEK_END:
+			m_position = m_fileSize +offset;
+			break;
+		default:
+			return {};
+	}
+	return m_position;
+}
+bool PosixFile::sync()
+{
+	if(m_bufferedFd == -1 || Drain() == false)
+		return false;
+	if(m_settings.syncMode != SyncMode::None)
+	{
+		if(Sync() == false)
+		{
+			SetError(errno);
+			return false;
+		}
+		m_isSynced = true;
+	}
+	return true;
+}
+std::optional<int> PosixFile::GetError() const
+{
+	std::scoped_lock<std::mutex> lock {m_ioMutex};
+	if(m_writeFailed == false)
+		return {};
+	return m_errorCode;
+}
+void PosixFile::SetError(int errorCode)
+{
+	std::scoped_lock<std::mutex> lock {m_ioMutex};
+	if(m_writeFailed)
+		return;
+	m_writeFailed = true;
+	m_errorCode = errorCode;
+}
+PosixFile::Statistics PosixFile::GetStatistics() const
+{
+	Statistics stats {};
+	stats.bytesWritten = m_bytesWritten;
+	stats.writeCallCount = m_writeCallCount;
+	stats.syncCount = m_syncCount;
+	stats.stallCount = m_stallCount;
+	return stats;
+}
+void PosixFile::RunIoThread()
+{
+	std::unique_lock<std::mutex> lock {m_ioMutex};
+	for(;;)
+	{
+		m_ioCondition.wait(lock,[this]() {return m_queuedBuffers.empty() == false || m_stopIoThread;});
+		if(m_queuedBuffers.empty())
+			return;
+		auto bufferIndex = m_queuedBuffers.front();
+		auto hasFailed = m_writeFailed;
+		lock.unlock();
+
+		// Once a write has failed, the remaining buffers are discarded
+		auto success = (hasFailed == false) && WriteBuffer(m_buffers.at(bufferIndex));
+		auto errorCode = errno;
+
+		lock.lock();
+		if(success == false && m_writeFailed == false)
+		{
+			m_writeFailed = true;
+			m_errorCode = errorCode;
+		}
+		m_queuedBuffers.pop_front();
+		m_freeBuffers.push_back(bufferIndex);
+		m_ioCondition.notify_all();
+	}
+}
+bool PosixFile::WriteToFile(int fd,const uint8_t *data,size_t size,uint64_t offset)
+{
+	while(size > 0)
+	{
+		auto res = pwrite(fd,data,size,offset);
+		++m_writeCallCount;
+		if(res < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		data += res;
+		size -= res;
+		offset += res;
+		m_bytesWritten += res;
+	}
+	return true;
+}
+bool PosixFile::WriteBuffer(const Buffer &buffer)
+{
+	auto end = buffer.offset +buffer.size;
+	if(m_settings.preallocationSize > 0 && end > m_preallocatedSize)
+	{
+		// Failure is not critical, the blocks will simply be allocated on writeback
+		auto newSize = ((end +m_settings.preallocationSize -1) /m_settings.preallocationSize) *m_settings.preallocationSize;
+		if(fallocate(m_bufferedFd,FALLOC_FL_KEEP_SIZE,m_preallocatedSize,newSize -m_preallocatedSize) == 0)
+			m_preallocatedSize = newSize;
+		else
+			m_settings.preallocationSize = 0;
+	}
+
+	auto isAligned = (buffer.offset %BUFFER_ALIGNMENT) == 0 && (buffer.size %BUFFER_ALIGNMENT) == 0;
+	auto fd = isAligned ? m_fd : m_bufferedFd;
+	if(WriteToFile(fd,buffer.data.get(),buffer.size,buffer.offset) == false)
+		return false;
+
+	if(m_settings.syncMode == SyncMode::Interval)
+	{
+		m_bytesSinceSync += buffer.size;
+		if(m_bytesSinceSync >= m_settings.syncInterval)
+		{
+			m_bytesSinceSync = 0;
+			return Sync();
+		}
+	}
+	return true;
+}
+bool PosixFile::Sync()
+{
+	++m_syncCount;
+	auto success = (fdatasync(m_bufferedFd) == 0);
+	if(m_fd != m_bufferedFd)
+		success = (fdatasync(m_fd) == 0) && success;
+	return success;
+}
+#endif
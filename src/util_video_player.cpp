@@ -9,9 +9,16 @@
 using namespace media;
 
 #pragma optimize("",off)
-std::unique_ptr<VideoPlayer> VideoPlayer::Create(VFilePtr f)
+std::unique_ptr<VideoPlayer> VideoPlayer::Create(VFilePtr f) {return Create(f,DecodingSettings{});}
+std::unique_ptr<VideoPlayer> VideoPlayer::Create(VFilePtr f,const DecodingSettings &settings)
 {
-	auto ffmpegDecoder = FFMpegDecoder::Create(f);
+	auto ffmpegDecoder = FFMpegDecoder::Create(f,settings);
+	return ffmpegDecoder ? std::unique_ptr<VideoPlayer>{new VideoPlayer{ffmpegDecoder}} : nullptr;
+}
+std::unique_ptr<VideoPlayer> VideoPlayer::Create(const std::string &localFileName) {return Create(localFileName,DecodingSettings{});}
+std::unique_ptr<VideoPlayer> VideoPlayer::Create(const std::string &localFileName,const DecodingSettings &settings)
+{
+	auto ffmpegDecoder = FFMpegDecoder::Create(localFileName,settings);
 	return ffmpegDecoder ? std::unique_ptr<VideoPlayer>{new VideoPlayer{ffmpegDecoder}} : nullptr;
 }
 
@@ -19,12 +26,25 @@ std::shared_ptr<uimg::ImageBuffer> VideoPlayer::ReadFrame(double &outPts)
 {
 	return m_ffmpegDecoder->ReadFrame(outPts);
 }
+VideoPlayer::ReadResult VideoPlayer::TryReadFrame(std::shared_ptr<uimg::ImageBuffer> &outFrame,double &outPts) {return m_ffmpegDecoder->TryReadFrame(outFrame,outPts);}
+bool VideoPlayer::ReadFrame(FrameBuffer &outFrame,double &outPts) {return m_ffmpegDecoder->ReadFrame(outFrame,outPts);}
+VideoPlayer::ReadResult VideoPlayer::TryReadFrame(FrameBuffer &outFrame,double &outPts) {return m_ffmpegDecoder->TryReadFrame(outFrame,outPts);}
+VideoPlayer::DecodeAheadStatistics VideoPlayer::GetDecodeAheadStatistics() const {return m_ffmpegDecoder->GetDecodeAheadStatistics();}
+bool VideoPlayer::HasAudio() const {return m_ffmpegDecoder->HasAudio();}
+VideoPlayer::AudioFormat VideoPlayer::GetAudioFormat() const {return m_ffmpegDecoder->GetAudioFormat();}
+uint32_t VideoPlayer::ReadAudio(void *outData,uint32_t frameCount) {return m_ffmpegDecoder->ReadAudio(outData,frameCount);}
+double VideoPlayer::GetAudioTime() const {return m_ffmpegDecoder->GetAudioTime();}
+VideoPlayer::AudioStatistics VideoPlayer::GetAudioStatistics() const {return m_ffmpegDecoder->GetAudioStatistics();}
+bool VideoPlayer::Seek(double seconds) {return m_ffmpegDecoder->Seek(seconds);}
+bool VideoPlayer::SeekToFrame(uint64_t frameIndex) {return m_ffmpegDecoder->SeekToFrame(frameIndex);}
 
 double VideoPlayer::GetVideoFrameRate() const {return m_ffmpegDecoder->GetVideoFrameRate();}
 double VideoPlayer::GetAudioFrameRate() const {return m_ffmpegDecoder->GetAudioFrameRate();}
 double VideoPlayer::GetAspectRatio() const {return m_ffmpegDecoder->GetAspectRatio();}
 uint32_t VideoPlayer::GetWidth() const {return m_ffmpegDecoder->GetWidth();}
 uint32_t VideoPlayer::GetHeight() const {return m_ffmpegDecoder->GetHeight();}
+uint32_t VideoPlayer::GetCodecThreadCount() const {return m_ffmpegDecoder->GetCodecThreadCount();}
+std::optional<ColorMatrix> VideoPlayer::GetColorMatrix() const {return m_ffmpegDecoder->GetColorMatrix();}
 
 VideoPlayer::VideoPlayer(std::shared_ptr<FFMpegDecoder> ffmpegDecoder)
 	: m_ffmpegDecoder{ffmpegDecoder}
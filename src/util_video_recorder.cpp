@@ -4,6 +4,8 @@
 
 #include "util_video_recorder.hpp"
 #include "ffmpeg_encoder.hpp"
+#include <cmath>
+#include <algorithm>
 
 using namespace media;
 
@@ -34,6 +36,40 @@ static std::array<std::string,static_cast<std::underlying_type_t<Format>>(Format
 	"3g2"
 };
 std::string media::format_to_name(Format format) {return s_formatToString.at(static_cast<std::underlying_type_t<decltype(format)>>(format));}
+bool media::supports_gop_parallel_encoding(Codec codec)
+{
+	// Codecs which emit exactly one packet per frame without delay (with B-frames disabled)
+	switch(codec)
+	{
+		case Codec::Raw:
+		case Codec::MPEG4:
+		case Codec::MotionJPEG:
+		case Codec::MPEG1:
+			return true;
+		default:
+			return false;
+	}
+}
+bool media::supports_variable_frame_rate(Format format)
+{
+	// Formats which store per-frame timestamps. Others either have no timestamps at all (e.g. M4V,
+	// which is a raw MPEG-4 elementary stream), or (like AVI) fill timestamp gaps with empty frames.
+	switch(format)
+	{
+		case Format::WebM:
+		case Format::Matroska:
+		case Format::Flash:
+		case Format::F4V:
+		case Format::Ogg:
+		case Format::QuickTime:
+		case Format::MPEG4:
+		case Format::ThreeGPP:
+		case Format::ThreeGPP2:
+			return true;
+		default:
+			return false;
+	}
+}
 
 static std::array<std::string,static_cast<std::underlying_type_t<Codec>>(Codec::Count)> s_codecToString = {
 	"rawvideo",
@@ -51,6 +87,24 @@ static std::array<std::string,static_cast<std::underlying_type_t<Codec>>(Codec::
 	"hevc"
 };
 std::string media::codec_to_name(Codec codec) {return s_codecToString.at(static_cast<std::underlying_type_t<decltype(codec)>>(codec));}
+
+static std::array<std::string,static_cast<std::underlying_type_t<AudioCodec>>(AudioCodec::Count)> s_audioCodecToString = {
+	"aac",
+	"libopus",
+	"pcm_s16le"
+};
+std::string media::audio_codec_to_name(AudioCodec codec) {return s_audioCodecToString.at(static_cast<std::underlying_type_t<decltype(codec)>>(codec));}
+
+static std::array<std::string,static_cast<std::underlying_type_t<PixelFormat>>(PixelFormat::Count)> s_pixelFormatToString = {
+	"rgba",
+	"bgra",
+	"rgb24",
+	"rgbaf16",
+	"rgbaf32",
+	"yuv420p",
+	"nv12"
+};
+std::string media::pixel_format_to_name(PixelFormat format) {return s_pixelFormatToString.at(static_cast<std::underlying_type_t<decltype(format)>>(format));}
 BitRate media::calc_bitrate(uint32_t width,uint32_t height,FrameRate frameRate,double bitsPerPixel)
 {
 	return width *height *frameRate *bitsPerPixel;
@@ -92,7 +146,7 @@ std::vector<Codec> media::get_all_codecs()
 		codecs.push_back(static_cast<Codec>(i));
 	return codecs;
 }
-std::vector<Codec> GetSupportedCodecs(Format format)
+std::vector<Codec> media::get_supported_codecs(Format format)
 {
 	auto formatName = format_to_name(format);
 	av::OutputFormat avFormat {};
@@ -111,6 +165,28 @@ std::vector<Codec> GetSupportedCodecs(Format format)
 	}
 	return supportedCodecs;
 }
+std::chrono::nanoseconds VideoRecorder::LatencyHistogram::GetMeanDuration() const
+{
+	if(count == 0)
+		return std::chrono::nanoseconds{0};
+	return totalDuration /count;
+}
+std::chrono::nanoseconds VideoRecorder::LatencyHistogram::GetPercentile(double percentile) const
+{
+	if(count == 0)
+		return std::chrono::nanoseconds{0};
+	auto rank = static_cast<uint64_t>(std::ceil(std::clamp(percentile,0.0,1.0) *count));
+	uint64_t n = 0;
+	for(auto i=decltype(buckets.size()){0u};i<buckets.size();++i)
+	{
+		n += buckets.at(i);
+		if(n < std::max<uint64_t>(rank,1))
+			continue;
+		std::chrono::nanoseconds upperBound {std::chrono::microseconds{1ull <<i}};
+		return (i == buckets.size() -1) ? maxDuration : std::min(upperBound,maxDuration);
+	}
+	return maxDuration;
+}
 VideoRecorder::VideoRecorder(std::unique_ptr<ICustomFile> fileInterface)
 	: m_fileInterface{std::move(fileInterface)}
 {}
@@ -130,23 +206,50 @@ int32_t VideoRecorder::WriteFrame(const uimg::ImageBuffer &imgBuf,double frameTi
 		return -1;
 	return m_ffmpegEncoder->WriteFrame(imgBuf,frameTime);
 }
+int32_t VideoRecorder::WriteFrame(const FrameBuffer &frameBuffer,double frameTime)
+{
+	if(IsRecording() == false)
+		return -1;
+	return m_ffmpegEncoder->WriteFrame(frameBuffer,frameTime);
+}
+int32_t VideoRecorder::WriteAudio(const void *data,uint32_t frameCount)
+{
+	if(IsRecording() == false)
+		return -1;
+	return m_ffmpegEncoder->WriteAudio(data,frameCount);
+}
 uint32_t VideoRecorder::GetWidth() const {return m_ffmpegEncoder->GetWidth();}
 uint32_t VideoRecorder::GetHeight() const {return m_ffmpegEncoder->GetHeight();}
 std::chrono::nanoseconds VideoRecorder::GetEncodingDuration() const {return m_ffmpegEncoder ? m_ffmpegEncoder->GetEncodingDuration() : std::chrono::nanoseconds{0};}
+VideoRecorder::WaitStatistics VideoRecorder::GetWaitStatistics() const {return m_ffmpegEncoder ? m_ffmpegEncoder->GetWaitStatistics() : WaitStatistics{};}
+VideoRecorder::StageTimings VideoRecorder::GetStageTimings() const {return m_ffmpegEncoder ? m_ffmpegEncoder->GetStageTimings() : StageTimings{};}
+VideoRecorder::IOStatistics VideoRecorder::GetIOStatistics() const {return m_ffmpegEncoder ? m_ffmpegEncoder->GetIOStatistics() : IOStatistics{};}
+VideoRecorder::Statistics VideoRecorder::GetStatistics() const {return m_ffmpegEncoder ? m_ffmpegEncoder->GetStatistics() : Statistics{};}
 std::pair<uint32_t,uint32_t> VideoRecorder::GetResolution() const {return {GetWidth(),GetHeight()};}
 bool VideoRecorder::IsRecording() const {return m_ffmpegEncoder != nullptr;}
 void VideoRecorder::StartRecording(const std::string &outFileName,const EncodingSettings &encodingSettings)
 {
 	if(IsRecording())
 		EndRecording(); // End previous recording session
-
-	m_ffmpegEncoder = FFMpegEncoder::Create(outFileName,encodingSettings,m_fileInterface);
+	auto settings = encodingSettings;
+	m_isAutoThreading = (settings.codecThreading.threadCount == 0);
+	if(m_isAutoThreading)
+	{
+		// Results of previous recordings only apply if the workload is the same
+		auto &state = m_autoThreadingState;
+		if(state.codec != settings.codec || state.width != settings.width || state.height != settings.height)
+			state = {settings.codec,settings.width,settings.height,0};
+		settings.codecThreading.threadCount = FFMpegEncoder::CalcAutoCodecThreadCount(settings,state.threadCount);
+	}
+	m_ffmpegEncoder = FFMpegEncoder::Create(outFileName,settings,m_fileInterface);
 }
 void VideoRecorder::EndRecording()
 {
 	if(IsRecording() == false)
 		return;
 	m_ffmpegEncoder->EndRecording();
+	if(m_isAutoThreading)
+		m_autoThreadingState.threadCount = m_ffmpegEncoder->CalcTunedCodecThreadCount();
 	m_ffmpegEncoder = nullptr;
 	m_fileInterface->close();
 }
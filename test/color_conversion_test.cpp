@@ -0,0 +1,275 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Compares the RGBA to YUV 4:2:0 conversion kernels against each other and against swscale.
+// Every SIMD kernel supported by the CPU has to be bit-exact with the scalar one. The scalar kernel
+// has to be within the tolerance stated in color_conversion.hpp of swscale (SWS_BICUBIC, configured
+// like the FrameConverter fallback). Returns a non-zero exit code if any case fails.
+
+#include "color_conversion.hpp"
+#include <cinttypes>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm>
+extern "C" {
+	#include <libswscale/swscale.h>
+	#include <libavutil/pixfmt.h>
+}
+
+using namespace media;
+
+namespace
+{
+	// Maximum deviation from swscale, see color_conversion.hpp; Both are reached by the smooth cases with libswscale 9 (FFmpeg 8.0)
+	constexpr int LUMA_TOLERANCE = 1;
+	constexpr int CHROMA_TOLERANCE = 2;
+	// Extra bytes at the end of every row, so the kernels have to respect the line sizes
+	constexpr int ROW_PADDING = 24;
+
+	enum class Content : uint8_t
+	{
+		// Gradients with a slope of at most one code value per pixel; The chroma tolerance only holds for smooth content
+		Smooth = 0,
+		// Random pixels; Only the luma is compared against swscale
+		Noise
+	};
+
+	struct Image
+	{
+		uint32_t width = 0;
+		uint32_t height = 0;
+		std::vector<uint8_t> data;
+		int lineSize = 0;
+	};
+	struct YUVImage
+	{
+		std::array<std::vector<uint8_t>,3> planes;
+		std::array<int,3> lineSize {};
+		color::YUVLayout layout = color::YUVLayout::Planar;
+		color::ConversionTarget GetTarget()
+		{
+			color::ConversionTarget target {};
+			for(auto i=0u;i<planes.size();++i)
+			{
+				target.data[i] = planes[i].empty() ? nullptr : planes[i].data();
+				target.lineSize[i] = lineSize[i];
+			}
+			target.layout = layout;
+			return target;
+		}
+	};
+
+	struct MaxError
+	{
+		int luma = 0;
+		int chroma = 0;
+	};
+};
+
+static Image generate_image(uint32_t width,uint32_t height,Content content)
+{
+	Image img {};
+	img.width = width;
+	img.height = height;
+	img.lineSize = width *4 +ROW_PADDING;
+	img.data.resize(static_cast<size_t>(img.lineSize) *height,0xCD);
+	uint32_t rngState = 0x12345678;
+	// Amplitude is limited by the size, so the slope never exceeds one code value per pixel
+	auto ampX = std::min(width,96u);
+	auto ampY = std::min(height,96u);
+	for(auto y=decltype(height){0u};y<height;++y)
+	{
+		auto *row = img.data.data() +static_cast<size_t>(y) *img.lineSize;
+		for(auto x=decltype(width){0u};x<width;++x)
+		{
+			auto *px = row +x *4;
+			if(content == Content::Noise)
+			{
+				rngState ^= rngState <<13;
+				rngState ^= rngState >>17;
+				rngState ^= rngState <<5;
+				px[0] = rngState &0xFF;
+				px[1] = (rngState >>8) &0xFF;
+				px[2] = (rngState >>16) &0xFF;
+			}
+			else
+			{
+				px[0] = static_cast<uint8_t>(80 +(x *ampX) /width);
+				px[1] = static_cast<uint8_t>(60 +(y *ampY) /height);
+				px[2] = static_cast<uint8_t>(200 -(x *ampX) /(2 *width) -(y *ampY) /(2 *height));
+			}
+			px[3] = 255;
+		}
+	}
+	return img;
+}
+
+static YUVImage create_yuv_image(uint32_t width,uint32_t height,color::YUVLayout layout)
+{
+	YUVImage img {};
+	img.layout = layout;
+	auto chromaWidth = (width +1) /2;
+	auto chromaHeight = (height +1) /2;
+	img.lineSize[0] = static_cast<int>(width) +ROW_PADDING;
+	img.planes[0].resize(static_cast<size_t>(img.lineSize[0]) *height,0);
+	if(layout == color::YUVLayout::NV12)
+	{
+		img.lineSize[1] = static_cast<int>(chromaWidth *2) +ROW_PADDING;
+		img.planes[1].resize(static_cast<size_t>(img.lineSize[1]) *chromaHeight,0);
+	}
+	else
+	{
+		for(auto i=1u;i<3;++i)
+		{
+			img.lineSize[i] = static_cast<int>(chromaWidth) +ROW_PADDING;
+			img.planes[i].resize(static_cast<size_t>(img.lineSize[i]) *chromaHeight,0);
+		}
+	}
+	return img;
+}
+
+static bool convert_with_swscale(const Image &src,bool bgra,ColorMatrix matrix,bool fullRange,YUVImage &dst)
+{
+	auto srcFormat = bgra ? AV_PIX_FMT_BGRA : AV_PIX_FMT_RGBA;
+	auto dstFormat = (dst.layout == color::YUVLayout::NV12) ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
+	auto *ctx = sws_getContext(src.width,src.height,srcFormat,src.width,src.height,dstFormat,SWS_BICUBIC,nullptr,nullptr,nullptr);
+	if(ctx == nullptr)
+		return false;
+	auto colorSpace = (matrix == ColorMatrix::BT709) ? SWS_CS_ITU709 : SWS_CS_ITU601;
+	sws_setColorspaceDetails(ctx,sws_getCoefficients(SWS_CS_DEFAULT),1,sws_getCoefficients(colorSpace),fullRange ? 1 : 0,0,1 <<16,1 <<16);
+	std::array<const uint8_t*,4> srcData {src.data.data(),nullptr,nullptr,nullptr};
+	std::array<int,4> srcLineSize {src.lineSize,0,0,0};
+	std::array<uint8_t*,4> dstData {};
+	std::array<int,4> dstLineSize {};
+	for(auto i=0u;i<dst.planes.size();++i)
+	{
+		dstData[i] = dst.planes[i].empty() ? nullptr : dst.planes[i].data();
+		dstLineSize[i] = dst.lineSize[i];
+	}
+	auto numRows = sws_scale(ctx,srcData.data(),srcLineSize.data(),0,src.height,dstData.data(),dstLineSize.data());
+	sws_freeContext(ctx);
+	return numRows > 0;
+}
+
+// Returns the largest difference per plane type; Only the visible samples are compared, not the row padding
+static MaxError compare(const YUVImage &a,const YUVImage &b,uint32_t width,uint32_t height)
+{
+	MaxError err {};
+	auto comparePlane = [](const YUVImage &a,const YUVImage &b,uint32_t plane,uint32_t rowBytes,uint32_t numRows) {
+		auto maxDiff = 0;
+		for(auto y=decltype(numRows){0u};y<numRows;++y)
+		{
+			auto *rowA = a.planes[plane].data() +static_cast<size_t>(y) *a.lineSize[plane];
+			auto *rowB = b.planes[plane].data() +static_cast<size_t>(y) *b.lineSize[plane];
+			for(auto x=decltype(rowBytes){0u};x<rowBytes;++x)
+				maxDiff = std::max(maxDiff,std::abs(rowA[x] -rowB[x]));
+		}
+		return maxDiff;
+	};
+	auto chromaWidth = (width +1) /2;
+	auto chromaHeight = (height +1) /2;
+	err.luma = comparePlane(a,b,0,width,height);
+	if(a.layout == color::YUVLayout::NV12)
+		err.chroma = comparePlane(a,b,1,chromaWidth *2,chromaHeight);
+	else
+		err.chroma = std::max(comparePlane(a,b,1,chromaWidth,chromaHeight),comparePlane(a,b,2,chromaWidth,chromaHeight));
+	return err;
+}
+
+int main()
+{
+	const std::array<std::pair<uint32_t,uint32_t>,8> sizes = {{
+		{64,48},{1'920,1'080},{63,47},{65,33},{17,9},{3,5},{1,1},{131,2}
+	}};
+	const std::array<ColorMatrix,2> matrices = {ColorMatrix::BT601,ColorMatrix::BT709};
+	const std::array<color::YUVLayout,2> layouts = {color::YUVLayout::Planar,color::YUVLayout::NV12};
+
+	// Every instruction set up to the best one supported by the CPU; Sets which aren't part of this build resolve to a lower kernel
+	auto supportedInstructionSet = color::get_supported_instruction_set();
+	std::vector<std::pair<color::InstructionSet,color::ConversionKernel>> kernels;
+	for(auto instructionSet : {color::InstructionSet::SSE41,color::InstructionSet::AVX2,color::InstructionSet::AVX512})
+	{
+		if(instructionSet > supportedInstructionSet)
+		{
+			std::printf("Skipping %s kernel: Not supported by this CPU\n",color::instruction_set_to_string(instructionSet).c_str());
+			continue;
+		}
+		auto kernel = color::get_conversion_kernel(instructionSet);
+		auto isDuplicate = std::find_if(kernels.begin(),kernels.end(),[kernel](const auto &pair) {return pair.second == kernel;}) != kernels.end();
+		if(kernel == static_cast<color::ConversionKernel>(color::convert_rgba_to_yuv420_scalar) || isDuplicate)
+		{
+			std::printf("Skipping %s kernel: Not part of this build\n",color::instruction_set_to_string(instructionSet).c_str());
+			continue;
+		}
+		kernels.push_back({instructionSet,kernel});
+	}
+
+	uint32_t numCases = 0;
+	uint32_t numFailures = 0;
+	for(auto content : {Content::Smooth,Content::Noise})
+	{
+		for(auto &[width,height] : sizes)
+		{
+			auto src = generate_image(width,height,content);
+			for(auto matrix : matrices)
+			{
+				for(auto layout : layouts)
+				{
+					for(auto fullRange : {false,true})
+					{
+						for(auto bgra : {false,true})
+						{
+							++numCases;
+							std::string caseName = std::string{(content == Content::Smooth) ? "smooth" : "noise"} +" " +std::to_string(width) +"x" +std::to_string(height) +" "
+								+((matrix == ColorMatrix::BT709) ? "BT.709" : "BT.601") +" " +((layout == color::YUVLayout::NV12) ? "NV12" : "I420") +" "
+								+(fullRange ? "full" : "limited") +" " +(bgra ? "BGRA" : "RGBA");
+							auto coefficients = color::calc_conversion_coefficients(matrix,fullRange,bgra);
+
+							auto scalar = create_yuv_image(width,height,layout);
+							color::convert_rgba_to_yuv420_scalar(src.data.data(),src.lineSize,scalar.GetTarget(),width,0,height,coefficients);
+
+							auto reference = create_yuv_image(width,height,layout);
+							if(convert_with_swscale(src,bgra,matrix,fullRange,reference) == false)
+							{
+								std::printf("FAIL %s: swscale conversion failed\n",caseName.c_str());
+								++numFailures;
+								continue;
+							}
+							auto err = compare(scalar,reference,width,height);
+							auto checkChroma = (content == Content::Smooth);
+							auto failed = false;
+							if(err.luma > LUMA_TOLERANCE || (checkChroma && err.chroma > CHROMA_TOLERANCE))
+							{
+								std::printf("FAIL %s: Scalar deviates from swscale by %d (luma), %d (chroma)\n",caseName.c_str(),err.luma,err.chroma);
+								failed = true;
+							}
+
+							for(auto &[instructionSet,kernel] : kernels)
+							{
+								auto simd = create_yuv_image(width,height,layout);
+								kernel(src.data.data(),src.lineSize,simd.GetTarget(),width,0,height,coefficients);
+								auto simdErr = compare(simd,scalar,width,height);
+								if(simdErr.luma != 0 || simdErr.chroma != 0)
+								{
+									std::printf(
+										"FAIL %s: %s kernel is not bit-exact with the scalar one (%d luma, %d chroma)\n",caseName.c_str(),
+										color::instruction_set_to_string(instructionSet).c_str(),simdErr.luma,simdErr.chroma
+									);
+									failed = true;
+								}
+							}
+							if(failed)
+								++numFailures;
+						}
+					}
+				}
+			}
+		}
+	}
+	std::printf("%u of %u cases passed\n",numCases -numFailures,numCases);
+	return (numFailures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
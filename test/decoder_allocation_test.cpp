@@ -0,0 +1,360 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Records a short clip, decodes it and checks that reading frames doesn't allocate once the decoder has warmed up.
+// Every operator new counts, which covers the decoder, avcpp and the frame pool. With glibc the C heap (and with it
+// av_malloc) is counted as well. FFmpeg's demuxers allocate a new buffer for every packet they read though, so for
+// the C heap the test only checks that everything allocated while reading a frame is released again.
+// Returns a non-zero exit code if the check fails.
+
+#include "util_video_recorder.hpp"
+#include "util_video_player.hpp"
+#include "stdio_file.hpp"
+#include <cinttypes>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <filesystem>
+
+using namespace media;
+
+namespace
+{
+	constexpr uint32_t WIDTH = 320;
+	constexpr uint32_t HEIGHT = 240;
+	constexpr uint32_t FRAME_COUNT = 96;
+	// Frames read before the counters are reset; Lets the codec, the scaler and the pools reach their steady state
+	constexpr uint32_t WARM_UP_FRAME_COUNT = 24;
+
+	struct AllocationCounters
+	{
+		std::atomic<bool> enabled = false;
+		std::atomic<uint64_t> newCount = 0;
+		std::atomic<uint64_t> mallocCount = 0;
+	};
+	AllocationCounters g_counters {};
+
+	// Remembers the C heap blocks allocated while counting is enabled, so only their release is counted. Blocks
+	// from before (e.g. the packets and frames of the warm-up) would otherwise cancel out blocks that are never
+	// released. Can't use the heap itself, so it's a fixed-size open-addressing table.
+	class TrackedBlocks
+	{
+	public:
+		static constexpr size_t CAPACITY = 1u<<16;
+		void Insert(const void *p)
+		{
+			Lock();
+			if(m_count +1 >= CAPACITY)
+				m_overflow = true;
+			else
+			{
+				auto i = Hash(p);
+				while(m_blocks[i] != nullptr)
+					i = Next(i);
+				m_blocks[i] = p;
+				++m_count;
+			}
+			Unlock();
+		}
+		bool Erase(const void *p)
+		{
+			Lock();
+			auto i = Hash(p);
+			while(m_blocks[i] != nullptr && m_blocks[i] != p)
+				i = Next(i);
+			if(m_blocks[i] == nullptr)
+			{
+				Unlock();
+				return false;
+			}
+			// Shifts the following entries back instead of leaving a tombstone, so lookups stay short
+			for(auto j=Next(i);m_blocks[j] != nullptr;j=Next(j))
+			{
+				auto home = Hash(m_blocks[j]);
+				auto canMove = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+				if(canMove == false)
+					continue;
+				m_blocks[i] = m_blocks[j];
+				i = j;
+			}
+			m_blocks[i] = nullptr;
+			--m_count;
+			Unlock();
+			return true;
+		}
+		size_t GetCount() const {return m_count;}
+		bool HasOverflowed() const {return m_overflow;}
+	private:
+		static size_t Next(size_t i) {return (i +1) &(CAPACITY -1);}
+		static size_t Hash(const void *p)
+		{
+			return static_cast<size_t>((reinterpret_cast<uintptr_t>(p) >>4) *UINT64_C(0x9E3779B97F4A7C15) >>48) &(CAPACITY -1);
+		}
+		void Lock()
+		{
+			while(m_lock.test_and_set(std::memory_order_acquire))
+				;
+		}
+		void Unlock() {m_lock.clear(std::memory_order_release);}
+		std::atomic_flag m_lock = ATOMIC_FLAG_INIT;
+		const void *m_blocks[CAPACITY] {};
+		size_t m_count = 0;
+		bool m_overflow = false;
+	};
+	TrackedBlocks g_trackedBlocks {};
+
+	void count_new()
+	{
+		if(g_counters.enabled.load(std::memory_order_relaxed))
+			g_counters.newCount.fetch_add(1,std::memory_order_relaxed);
+	}
+	void count_malloc(const void *p)
+	{
+		if(p == nullptr || g_counters.enabled.load(std::memory_order_relaxed) == false)
+			return;
+		g_counters.mallocCount.fetch_add(1,std::memory_order_relaxed);
+		g_trackedBlocks.Insert(p);
+	}
+	void count_free(const void *p)
+	{
+		if(p != nullptr && g_counters.enabled.load(std::memory_order_relaxed))
+			g_trackedBlocks.Erase(p);
+	}
+};
+
+void *operator new(size_t size)
+{
+	count_new();
+	auto *p = std::malloc((size > 0) ? size : 1);
+	if(p == nullptr)
+		throw std::bad_alloc{};
+	return p;
+}
+void *operator new[](size_t size) {return ::operator new(size);}
+void operator delete(void *p) noexcept {std::free(p);}
+void operator delete[](void *p) noexcept {std::free(p);}
+void operator delete(void *p,size_t) noexcept {std::free(p);}
+void operator delete[](void *p,size_t) noexcept {std::free(p);}
+#ifndef _WIN32
+// Aligned blocks would have to be released with _aligned_free on Windows, so they're only counted elsewhere
+void *operator new(size_t size,std::align_val_t alignment)
+{
+	count_new();
+	auto align = std::max(static_cast<size_t>(alignment),sizeof(void*));
+	void *p = nullptr;
+	if(posix_memalign(&p,align,(size > 0) ? size : 1) != 0)
+		throw std::bad_alloc{};
+	return p;
+}
+void *operator new[](size_t size,std::align_val_t alignment) {return ::operator new(size,alignment);}
+void operator delete(void *p,std::align_val_t) noexcept {std::free(p);}
+void operator delete[](void *p,std::align_val_t) noexcept {std::free(p);}
+void operator delete(void *p,size_t,std::align_val_t) noexcept {std::free(p);}
+void operator delete[](void *p,size_t,std::align_val_t) noexcept {std::free(p);}
+#endif
+
+#ifdef __GLIBC__
+// Interposes the C allocator for the shared FFmpeg libraries as well; av_malloc ends up in posix_memalign or malloc
+#define ENABLE_MALLOC_COUNTING
+extern "C" {
+	void *__libc_malloc(size_t size);
+	void *__libc_calloc(size_t count,size_t size);
+	void *__libc_realloc(void *p,size_t size);
+	void *__libc_memalign(size_t alignment,size_t size);
+	void __libc_free(void *p);
+
+	void *malloc(size_t size) noexcept
+	{
+		auto *p = __libc_malloc(size);
+		count_malloc(p);
+		return p;
+	}
+	void *calloc(size_t count,size_t size) noexcept
+	{
+		auto *p = __libc_calloc(count,size);
+		count_malloc(p);
+		return p;
+	}
+	void *realloc(void *p,size_t size) noexcept
+	{
+		auto *newP = __libc_realloc(p,size);
+		// Resizing an existing block is counted as an allocation, but doesn't change the number of live blocks.
+		// A block that has been moved stays tracked only if the original one was.
+		if(p == nullptr)
+			count_malloc(newP);
+		else if(size == 0)
+			count_free(p);
+		else if(newP != nullptr && g_counters.enabled.load(std::memory_order_relaxed))
+		{
+			g_counters.mallocCount.fetch_add(1,std::memory_order_relaxed);
+			if(newP != p && g_trackedBlocks.Erase(p))
+				g_trackedBlocks.Insert(newP);
+		}
+		return newP;
+	}
+	void free(void *p) noexcept
+	{
+		count_free(p);
+		__libc_free(p);
+	}
+	int posix_memalign(void **p,size_t alignment,size_t size) noexcept
+	{
+		if(alignment %sizeof(void*) != 0 || (alignment &(alignment -1)) != 0)
+			return EINVAL;
+		auto *mem = __libc_memalign(alignment,size);
+		if(mem == nullptr)
+			return ENOMEM;
+		count_malloc(mem);
+		*p = mem;
+		return 0;
+	}
+	void *aligned_alloc(size_t alignment,size_t size) noexcept
+	{
+		auto *p = __libc_memalign(alignment,size);
+		count_malloc(p);
+		return p;
+	}
+	void *memalign(size_t alignment,size_t size) noexcept
+	{
+		auto *p = __libc_memalign(alignment,size);
+		count_malloc(p);
+		return p;
+	}
+};
+#endif
+
+static bool record_clip(const std::string &fileName)
+{
+	// A few distinct frames, so the encoder produces regular P-frames instead of empty ones
+	std::vector<std::shared_ptr<std::vector<uint8_t>>> images;
+	for(auto i=0u;i<8;++i)
+	{
+		auto image = std::make_shared<std::vector<uint8_t>>(static_cast<size_t>(WIDTH) *HEIGHT *4);
+		for(auto y=decltype(HEIGHT){0u};y<HEIGHT;++y)
+		{
+			for(auto x=decltype(WIDTH){0u};x<WIDTH;++x)
+			{
+				auto *px = image->data() +(static_cast<size_t>(y) *WIDTH +x) *4;
+				px[0] = static_cast<uint8_t>(x +i *16);
+				px[1] = static_cast<uint8_t>(y +i *8);
+				px[2] = static_cast<uint8_t>(x ^y);
+				px[3] = 255;
+			}
+		}
+		images.push_back(std::move(image));
+	}
+
+	auto recorder = VideoRecorder::Create(std::make_unique<StdioFile>());
+	VideoRecorder::EncodingSettings encodingSettings {};
+	encodingSettings.width = WIDTH;
+	encodingSettings.height = HEIGHT;
+	encodingSettings.codec = Codec::MPEG4;
+	encodingSettings.format = Format::AVI;
+	encodingSettings.frameRate = 30;
+	try
+	{
+		recorder->StartRecording(fileName,encodingSettings);
+		for(auto i=decltype(FRAME_COUNT){0u};i<FRAME_COUNT;++i)
+		{
+			auto &image = images.at(i %images.size());
+			FrameBuffer frameBuffer {};
+			frameBuffer.format = PixelFormat::RGBA8;
+			frameBuffer.width = WIDTH;
+			frameBuffer.height = HEIGHT;
+			frameBuffer.data[0] = image->data();
+			frameBuffer.lineSize[0] = WIDTH *4;
+			frameBuffer.owner = image;
+			recorder->StartFrame();
+			recorder->WriteFrame(frameBuffer,i /static_cast<double>(encodingSettings.frameRate));
+		}
+		recorder->EndRecording();
+	}
+	catch(const std::exception &e)
+	{
+		std::printf("FAIL: Recording failed: %s\n",e.what());
+		return false;
+	}
+	return true;
+}
+
+int main()
+{
+	auto fileName = (std::filesystem::temp_directory_path() /"decoder_allocation_test.avi").string();
+	if(record_clip(fileName) == false)
+		return EXIT_FAILURE;
+
+	VideoPlayer::DecodingSettings decodingSettings {};
+	// Synchronous decoding on a single codec thread, so all work happens on this thread between the counter resets
+	decodingSettings.codecThreading.threadCount = 1;
+	decodingSettings.framePoolSize = 2;
+	auto player = VideoPlayer::Create(fileName,decodingSettings);
+	if(player == nullptr)
+	{
+		std::printf("FAIL: Unable to open '%s'\n",fileName.c_str());
+		return EXIT_FAILURE;
+	}
+
+	auto success = true;
+	uint32_t numFrames = 0;
+	FrameBuffer frame {};
+	double pts = 0.0;
+	for(;numFrames < WARM_UP_FRAME_COUNT;++numFrames)
+	{
+		if(player->ReadFrame(frame,pts) == false)
+			break;
+	}
+	g_counters.enabled = true;
+	uint32_t numMeasuredFrames = 0;
+	for(;;)
+	{
+		// The previous frame is released first, like a caller which is done with it would
+		frame = {};
+		if(player->ReadFrame(frame,pts) == false)
+			break;
+		++numMeasuredFrames;
+	}
+	frame = {};
+	g_counters.enabled = false;
+	player = nullptr;
+	std::filesystem::remove(fileName);
+
+	if(numMeasuredFrames == 0)
+	{
+		std::printf("FAIL: Only %u frames could be read\n",numFrames);
+		return EXIT_FAILURE;
+	}
+	auto newCount = g_counters.newCount.load();
+	std::printf("operator new: %llu calls over %u frames\n",static_cast<unsigned long long>(newCount),numMeasuredFrames);
+	if(newCount > 0)
+	{
+		std::printf("FAIL: Reading frames allocates with operator new\n");
+		success = false;
+	}
+#ifdef ENABLE_MALLOC_COUNTING
+	auto mallocCount = g_counters.mallocCount.load();
+	auto liveMallocCount = g_trackedBlocks.GetCount();
+	std::printf(
+		"C heap: %llu allocations over %u frames (%.2f per frame), %llu still live\n",static_cast<unsigned long long>(mallocCount),numMeasuredFrames,
+		mallocCount /static_cast<double>(numMeasuredFrames),static_cast<unsigned long long>(liveMallocCount)
+	);
+	if(g_trackedBlocks.HasOverflowed())
+	{
+		std::printf("FAIL: Too many live allocations to track\n");
+		success = false;
+	}
+	// The end of the stream releases the last packet and frame as well, so nothing may remain
+	else if(liveMallocCount > 0)
+	{
+		std::printf("FAIL: Memory allocated while reading frames has not been released\n");
+		success = false;
+	}
+#endif
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
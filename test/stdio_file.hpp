@@ -0,0 +1,78 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __STDIO_FILE_HPP__
+#define __STDIO_FILE_HPP__
+
+#include "util_media.hpp"
+#include <cstdio>
+#include <string>
+#include <optional>
+extern "C" {
+	#include <libavformat/avio.h>
+}
+
+namespace media
+{
+	// Minimal ICustomFile on top of stdio, shared by the tests and the benchmark
+	class StdioFile
+		: public ICustomFile
+	{
+	public:
+		virtual ~StdioFile() override {close();}
+		virtual bool open(const std::string &fileName) override
+		{
+			close();
+			m_file = std::fopen(fileName.c_str(),"w+b");
+			return m_file != nullptr;
+		}
+		virtual void close() override
+		{
+			if(m_file == nullptr)
+				return;
+			std::fclose(m_file);
+			m_file = nullptr;
+		}
+		virtual std::optional<uint64_t> write(const uint8_t *data, size_t size) override
+		{
+			if(m_file == nullptr)
+				return {};
+			return std::fwrite(data,1,size,m_file);
+		}
+		virtual std::optional<uint64_t> read(uint8_t *data, size_t size) override
+		{
+			if(m_file == nullptr)
+				return {};
+			return std::fread(data,1,size,m_file);
+		}
+		virtual std::optional<uint64_t> seek(int64_t offset, int whence) override
+		{
+			if(m_file == nullptr)
+				return {};
+			whence &= ~AVSEEK_FORCE;
+			if(whence == AVSEEK_SIZE)
+			{
+				auto pos = std::ftell(m_file);
+				if(pos < 0 || std::fseek(m_file,0,SEEK_END) != 0)
+					return {};
+				auto size = std::ftell(m_file);
+				if(std::fseek(m_file,pos,SEEK_SET) != 0 || size < 0)
+					return {};
+				return size;
+			}
+			if(whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END)
+				return {};
+			if(std::fseek(m_file,offset,whence) != 0)
+				return {};
+			auto pos = std::ftell(m_file);
+			if(pos < 0)
+				return {};
+			return pos;
+		}
+	private:
+		std::FILE *m_file = nullptr;
+	};
+};
+
+#endif